@@ -171,6 +171,13 @@ QVariant PortStatsModel::data(const QModelIndex &index, int role) const
             case e_STAT_RX_FIFO_ERRORS: return quint64(stats.rx_fifo_errors());
             case e_STAT_RX_FRAME_ERRORS: return quint64(stats.rx_frame_errors());
 
+            case e_STAT_CAPTURE_DROPS: return quint64(stats.capture_drops());
+
+            case e_STAT_TX_PACING_OVERSHOOT_AVG:
+                return quint64(stats.tx_pacing_overshoot_avg());
+            case e_STAT_TX_PACING_OVERSHOOT_MAX:
+                return quint64(stats.tx_pacing_overshoot_max());
+
             default:
                 qWarning("%s: Unhandled stats id %d\n", __FUNCTION__,
                         index.row());
@@ -59,7 +59,13 @@ typedef enum {
     e_STAT_RX_FIFO_ERRORS,
     e_STAT_RX_FRAME_ERRORS,
 
-    e_STATISTICS_END = e_STAT_RX_FRAME_ERRORS,
+    e_STAT_CAPTURE_DROPS,
+
+    // Tx Pacing
+    e_STAT_TX_PACING_OVERSHOOT_AVG,
+    e_STAT_TX_PACING_OVERSHOOT_MAX,
+
+    e_STATISTICS_END = e_STAT_TX_PACING_OVERSHOOT_MAX,
 
     e_STAT_MAX
 } PortStat;
@@ -87,6 +93,11 @@ static QStringList PortStatName = (QStringList()
     << "Receive Errors"
     << "Receive Fifo Errors"
     << "Receive Frame Errors"
+
+    << "Capture Drops"
+
+    << "Tx Pacing Overshoot Avg (ns)"
+    << "Tx Pacing Overshoot Max (ns)"
 );
 
 static QStringList LinkStateName = (QStringList()
@@ -361,6 +361,9 @@ void StreamConfigDialog::storeProtocolWidgets()
         w->storeWidget(p);
     }
     delete iter;
+
+    // Protocol data was modified in place - see compileFrameTemplate()
+    mpStream->invalidateFrameTemplate();
 }
 
 void StreamConfigDialog::on_cmbPktLenMode_currentIndexChanged(QString mode)
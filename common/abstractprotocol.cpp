@@ -22,8 +22,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "protocollistiterator.h"
 #include "streambase.h"
 
+#include "counterrng.h"
+#include "ipchecksum.h"
+
+#include <QThreadStorage>
 #include <qendian.h>
 
+//! Size of the on-stack buffer used to serialize a protocol for checksumming
+static const int kCksumBufSize = 16384;
+
+//! Nesting depth of protocolFrameCksum() - per thread since frames may be
+//! generated by several threads at once
+static QThreadStorage<int*> cksumRecursionCount;
+
+//! Max frame indices looked at by the default protocolFrameSizeRange()
+static const int kMaxFrameSizeRangeCount = 4096;
+
 /*!
   \class AbstractProtocol
 
@@ -53,9 +67,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
   - protocolIdType()
   - protocolId()
   - protocolFrameSize()
+  - protocolFrameSizeRange()
+  - writeProtocolFrameValue()
   - isProtocolFrameValueVariable()
   - isProtocolFrameSizeVariable()
   - protocolFrameVariableCount()
+  - isFieldFrameValueVariable()
+  - canFixupProtocolFrameCksum()
+  - fixupProtocolFrameCksum()
+  - appendProtocolFrameVariation()
 
   See the description of the methods for more information.
 
@@ -389,10 +409,42 @@ int AbstractProtocol::protocolFrameSize(int streamIndex) const
         protoSize = (bitsize+7)/8;
     }
 
-    qDebug("%s: protoSize = %d", __FUNCTION__, protoSize);
     return protoSize;
 }
 
+/*!
+  Returns the minimum and maximum size of the protocol across all the frames
+  of the stream without having to compute the size of every frame
+
+  Protocols which pad the frame upto the frame length (e.g. Payload) should
+  exclude the padding i.e. return the size they need irrespective of the
+  frame length, since the padding is derived from the frame length
+
+  The default implementation returns protocolFrameSize() for fixed size
+  protocols; for variable size protocols it looks at the sizes of the first
+  protocolFrameVariableCount() frames (upto a limit) - a subclass which
+  knows its size range should reimplement this method
+*/
+void AbstractProtocol::protocolFrameSizeRange(int &minSize, int &maxSize) const
+{
+    int count;
+
+    minSize = maxSize = protocolFrameSize();
+    if (!isProtocolFrameSizeVariable())
+        return;
+
+    count = qMin(protocolFrameVariableCount(), kMaxFrameSizeRangeCount);
+    for (int i = 1; i < count; i++)
+    {
+        int size = protocolFrameSize(i);
+
+        if (size < minSize)
+            minSize = size;
+        if (size > maxSize)
+            maxSize = size;
+    }
+}
+
 /*!
   Returns the byte offset in the packet where the protocol starts
 
@@ -402,8 +454,14 @@ int AbstractProtocol::protocolFrameSize(int streamIndex) const
 */
 int AbstractProtocol::protocolFrameOffset(int streamIndex) const
 {
-    int size = 0;
+    int size = 0, payloadSize;
     AbstractProtocol *p = prev;
+
+    // Fixed size stacks have the offset precomputed by the stream
+    if (!parent && mpStream
+            && mpStream->frameLayerPosition(this, size, payloadSize))
+        return size;
+
     while (p)
     {
         size += p->protocolFrameSize(streamIndex);
@@ -413,7 +471,6 @@ int AbstractProtocol::protocolFrameOffset(int streamIndex) const
     if (parent)
         size += parent->protocolFrameOffset(streamIndex);
 
-    qDebug("%s: ofs = %d", __FUNCTION__, size);
     return size;
 }
 
@@ -425,8 +482,14 @@ int AbstractProtocol::protocolFrameOffset(int streamIndex) const
 */
 int AbstractProtocol::protocolFramePayloadSize(int streamIndex) const
 {
-    int size = 0;
+    int size = 0, offset;
     AbstractProtocol *p = next;
+
+    // Fixed size stacks have the payload size precomputed by the stream
+    if (!parent && mpStream
+            && mpStream->frameLayerPosition(this, offset, size))
+        return size;
+
     while (p)
     {
         size += p->protocolFrameSize(streamIndex);
@@ -435,7 +498,6 @@ int AbstractProtocol::protocolFramePayloadSize(int streamIndex) const
     if (parent)
         size += parent->protocolFramePayloadSize(streamIndex);
 
-    qDebug("%s: payloadSize = %d", __FUNCTION__, size);
     return size;
 }
 
@@ -545,6 +607,33 @@ QByteArray AbstractProtocol::protocolFrameValue(int streamIndex, bool forCksum)
     return proto;
 }
 
+/*!
+  Writes the protocol (and its fields) into the caller supplied buffer 'buf'
+  at byte offset 'offset' and returns the number of bytes written i.e. the
+  protocol size; if the protocol doesn't fit within bufMaxSize, nothing is
+  written and -1 is returned
+
+  The bytes written are the same as those returned by protocolFrameValue()
+  for the same streamIndex and forCksum, but unlike protocolFrameValue()
+  this method is meant to be implemented without any heap allocations since
+  it is used when building every frame of a stream.
+
+  The default implementation uses protocolFrameValue() and copies the
+  result. A subclass should reimplement this method to write its fields
+  directly into the buffer
+*/
+int AbstractProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool forCksum) const
+{
+    QByteArray fv = protocolFrameValue(streamIndex, forCksum);
+
+    if ((offset + fv.size()) > bufMaxSize)
+        return -1;
+
+    memcpy(buf + offset, fv.constData(), fv.size());
+    return fv.size();
+}
+
 /*!
   Returns true if the protocol varies one or more of its fields at run-time,
   false otherwise
@@ -588,6 +677,24 @@ int AbstractProtocol::protocolFrameVariableCount() const
     return 1;
 }
 
+/*!
+  Returns true if the FrameValue of the field at the given index varies
+  at run-time, false otherwise
+
+  This is used by StreamBase to decide which fields of a variable protocol
+  need to be regenerated for every frame and which can be copied as-is from
+  a precomputed frame template. Checksum fields are handled separately by
+  the caller and need not be considered here.
+
+  The default implementation conservatively treats all fields of a variable
+  protocol as variable. A subclass with varying fields may reimplement this
+  to return true only for the fields that actually vary
+*/
+bool AbstractProtocol::isFieldFrameValueVariable(int /*index*/) const
+{
+    return isProtocolFrameValueVariable();
+}
+
 /*!
   Returns true if the payload content for a protocol varies at run-time,
   false otherwise
@@ -686,9 +793,13 @@ bool AbstractProtocol::protocolHasPayload() const
 quint32 AbstractProtocol::protocolFrameCksum(int streamIndex,
     CksumType cksumType) const
 {
-    static int recursionCount = 0;
     quint32 cksum = 0xFFFFFFFF;
 
+    if (!cksumRecursionCount.hasLocalData())
+        cksumRecursionCount.setLocalData(new int(0));
+
+    int &recursionCount = *cksumRecursionCount.localData();
+
     recursionCount++;
     Q_ASSERT_X(recursionCount < 10, "protocolFrameCksum", "potential infinite recursion - does a protocol checksum field not implement FieldBitSize?");
 
@@ -696,29 +807,23 @@ quint32 AbstractProtocol::protocolFrameCksum(int streamIndex,
     {
         case CksumIp:
         {
+            uchar buf[kCksumBufSize];
             QByteArray fv;
-            quint16 *ip;
-            quint32 len, sum = 0;
-
-            fv = protocolFrameValue(streamIndex, true);
-            ip = (quint16*) fv.constData();
-            len = fv.size();
-
-            while(len > 1)
+            quint16 sum;
+            int size;
+
+            // Serialize on the stack; fallback to a QByteArray only for
+            // protocols bigger than our buffer
+            size = writeProtocolFrameValue(buf, sizeof(buf), 0,
+                    streamIndex, true);
+            if (size >= 0)
+                sum = ipChecksumSum(buf, size);
+            else
             {
-                sum += *ip;
-                if(sum & 0x80000000)
-                    sum = (sum & 0xFFFF) + (sum >> 16);
-                ip++;
-                len -= 2;
+                fv = protocolFrameValue(streamIndex, true);
+                sum = ipChecksumSum((const uchar*) fv.constData(), fv.size());
             }
 
-            if (len)
-                sum += (unsigned short) *(unsigned char *)ip;
-
-            while(sum>>16)
-                sum = (sum & 0xFFFF) + (sum >> 16);
-
             cksum = qFromBigEndian((quint16) ~sum);
             break;
         }
@@ -735,10 +840,7 @@ quint32 AbstractProtocol::protocolFrameCksum(int streamIndex,
             cks = protocolFrameHeaderCksum(streamIndex, CksumIpPseudo);
             sum += (quint16) ~cks;
 
-            while(sum>>16)
-                sum = (sum & 0xFFFF) + (sum >> 16);
-
-            cksum = (~sum) & 0xFFFF;
+            cksum = (quint16) ~ipChecksumFold(sum);
             break;
         }    
         default:
@@ -774,7 +876,6 @@ quint32 AbstractProtocol::protocolFrameHeaderCksum(int streamIndex,
     {
         cksum = p->protocolFrameCksum(streamIndex, cksumType);
         sum += (quint16) ~cksum;
-        qDebug("%s: sum = %u, cksum = %u", __FUNCTION__, sum, cksum);
         if (cksumScope == CksumScopeAdjacentProtocol)
             goto out;
         p = p->prev;
@@ -787,10 +888,7 @@ quint32 AbstractProtocol::protocolFrameHeaderCksum(int streamIndex,
     }
 
 out:
-    while(sum>>16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    return (quint16) ~sum;
+    return (quint16) ~ipChecksumFold(sum);
 }
 
 /*!
@@ -832,10 +930,136 @@ quint32 AbstractProtocol::protocolFramePayloadCksum(int streamIndex,
     }
 
 out:
-    while(sum>>16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (quint16) ~ipChecksumFold(sum);
+}
+
+/*!
+  Returns the checksum of the requested type for the protocol computed over
+  an already assembled frame instead of serializing the protocol (and the
+  protocols following it) again
+
+  'frame' is the assembled frame of 'frameLen' bytes and 'offset' is the
+  offset of this protocol in the frame; the protocol's own checksum field
+  MUST be zero in the frame.
+
+  Only CksumIp (the protocol's own bytes) and CksumTcpUdp (the protocol's
+  own bytes and all bytes following it alongwith the pseudo header) are
+  computed over the frame; other types are delegated to protocolFrameCksum()
+*/
+quint32 AbstractProtocol::protocolFrameBufferCksum(const uchar *frame,
+        int frameLen, int offset, int streamIndex, CksumType cksumType) const
+{
+    switch(cksumType)
+    {
+        case CksumIp:
+        {
+            int size = qMin(protocolFrameSize(streamIndex), frameLen - offset);
+
+            return qFromBigEndian((quint16) ~ipChecksumSum(frame + offset,
+                        size));
+        }
+
+        case CksumTcpUdp:
+        {
+            quint16 cks;
+            quint32 sum;
+
+            sum = qFromBigEndian(ipChecksumSum(frame + offset,
+                        frameLen - offset));
+            cks = protocolFrameHeaderCksum(streamIndex, CksumIpPseudo);
+            sum += (quint16) ~cks;
+
+            return (quint16) ~ipChecksumFold(sum);
+        }
+
+        default:
+            break;
+    }
+
+    return protocolFrameCksum(streamIndex, cksumType);
+}
+
+/*!
+  Returns true if the protocol can fill its checksum field(s) over the
+  assembled frame using fixupProtocolFrameCksum(), false otherwise
+
+  When this returns true, StreamBase writes the protocol with its checksum
+  fields zeroed (forCksum = true) and calls fixupProtocolFrameCksum() after
+  all the protocols of the frame have been written - innermost protocol
+  first, so that the checksum of an outer protocol includes the final
+  checksums of the inner protocols.
+
+  The default implementation returns false. A subclass that reimplements
+  fixupProtocolFrameCksum() should return false when the checksum is
+  overridden by the user
+*/
+bool AbstractProtocol::canFixupProtocolFrameCksum() const
+{
+    return false;
+}
+
+/*!
+  Fills the protocol's checksum field(s) in the assembled frame 'frame' of
+  length 'frameLen' where the protocol is at offset 'offset'
 
-    return (quint16) ~sum;
+  Called by StreamBase only if canFixupProtocolFrameCksum() returns true.
+  Typically implemented using protocolFrameBufferCksum()
+
+  The default implementation does nothing
+*/
+void AbstractProtocol::fixupProtocolFrameCksum(uchar* /*frame*/,
+        int /*frameLen*/, int /*offset*/, int /*streamIndex*/) const
+{
+}
+
+/*!
+  Appends the fields of the protocol that vary from frame to frame to
+  'variation' - as fixed position fields alongwith the protocol's own
+  checksum fields covering them - for the protocol at 'offset' in the frame
+  and returns true; returns false (appending nothing) if the varying fields
+  cannot be described that way
+
+  StreamBase uses this to vary such protocols incrementally in the frame
+  template (see FrameVariation) instead of rewriting the whole protocol and
+  recomputing its checksums for every frame. The values of the fields
+  must be the same as those written by writeProtocolFrameValue() for every
+  frame index.
+
+  The default implementation returns false
+*/
+bool AbstractProtocol::appendProtocolFrameVariation(
+        FrameVariation& /*variation*/, int /*offset*/) const
+{
+    return false;
+}
+
+/*!
+  Returns the key of the random sequence of the field at 'index' - see
+  fieldFrameRandom()
+*/
+quint64 AbstractProtocol::fieldRandomKey(int index) const
+{
+    quint32 fieldKey = (protocolNumber() << 16) | (index & 0xFFFF);
+
+    if (mpStream)
+        return mpStream->randomKey(fieldKey);
+
+    return counterRng::key(0, fieldKey);
+}
+
+/*!
+  Returns a 64-bit random value for the field at 'index' for the frame
+  'streamIndex'
+
+  The value is computed from the stream id, the stream's random seed, the
+  protocol number, the field index and the frame index alone - so the same
+  frame always gets the same value and it is safe to call from multiple
+  threads. Subclasses should use this instead of qrand() for fields with a
+  random mode
+*/
+quint64 AbstractProtocol::fieldFrameRandom(int index, int streamIndex) const
+{
+    return counterRng::random(fieldRandomKey(index), streamIndex);
 }
 
 // Stein's binary GCD algo - from wikipedia
@@ -37,6 +37,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 class StreamBase;
 class ProtocolListIterator;
+class FrameVariation;
 
 class AbstractProtocol
 {
@@ -130,13 +131,17 @@ public:
 
     QByteArray protocolFrameValue(int streamIndex = 0,
         bool forCksum = false) const;
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
     virtual int protocolFrameSize(int streamIndex = 0) const;
+    virtual void protocolFrameSizeRange(int &minSize, int &maxSize) const;
     int protocolFrameOffset(int streamIndex = 0) const;
     int protocolFramePayloadSize(int streamIndex = 0) const;
 
     virtual bool isProtocolFrameValueVariable() const;
     virtual bool isProtocolFrameSizeVariable() const;
     virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
     bool isProtocolFramePayloadValueVariable() const;
     bool isProtocolFramePayloadSizeVariable() const;
     int protocolFramePayloadVariableCount() const;
@@ -151,6 +156,18 @@ public:
     quint32 protocolFramePayloadCksum(int streamIndex = 0,
         CksumType cksumType = CksumIp,
         CksumScope cksumScope = CksumScopeAllProtocols) const;
+    quint32 protocolFrameBufferCksum(const uchar *frame, int frameLen,
+        int offset, int streamIndex = 0, CksumType cksumType = CksumIp) const;
+
+    virtual bool canFixupProtocolFrameCksum() const;
+    virtual void fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex = 0) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+
+    quint64 fieldRandomKey(int index) const;
+    quint64 fieldFrameRandom(int index, int streamIndex = 0) const;
 
     static quint64 lcm(quint64 u, quint64 v);
     static quint64 gcd(quint64 u, quint64 v);
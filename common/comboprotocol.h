@@ -167,6 +167,15 @@ public:
                 protoA->protocolFrameVariableCount(),
                 protoB->protocolFrameVariableCount());
     }
+    virtual bool isFieldFrameValueVariable(int index) const
+    {
+        int cnt = protoA->fieldCount();
+
+        if (index < cnt)
+            return protoA->isFieldFrameValueVariable(index);
+        else
+            return protoB->isFieldFrameValueVariable(index - cnt);
+    }
 
     virtual quint32 protocolFrameCksum(int streamIndex = 0,
         CksumType cksumType = CksumIp) const
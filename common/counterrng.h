@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _COUNTER_RNG_H
+#define _COUNTER_RNG_H
+
+#include <QtGlobal>
+
+/*
+  Counter based pseudo random number generator (splitmix64)
+
+  Unlike qrand(), the n-th number of a sequence is computed directly from
+  the sequence key and n without generating the preceding numbers and
+  without any shared state - so random fields can be generated for any
+  frame index in O(1), are the same across runs and are safe to generate
+  from multiple threads
+*/
+namespace counterRng {
+
+const quint64 kGamma = Q_UINT64_C(0x9E3779B97F4A7C15);
+
+quint64 inline mix(quint64 z)
+{
+    z = (z ^ (z >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+// Derives a new sequence key from a key and a value
+quint64 inline key(quint64 key, quint64 value)
+{
+    return mix(key ^ mix(value + kGamma));
+}
+
+// Returns the counter'th number of the sequence identified by key
+quint64 inline random(quint64 key, quint64 counter)
+{
+    return mix(key + (counter + 1) * kGamma);
+}
+
+} // namespace counterRng
+#endif
@@ -186,3 +186,15 @@ bool Eth2Protocol::setFieldData(int index, const QVariant &value,
     }
     return isOk;
 }
+
+int Eth2Protocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    if ((offset + 2) > bufMaxSize)
+        return -1;
+
+    qToBigEndian(quint16(fieldData(eth2_type, FieldValue, streamIndex)
+                .toUInt()), buf + offset);
+
+    return 2;
+}
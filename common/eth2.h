@@ -59,6 +59,10 @@ public:
                int streamIndex = 0) const;
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
+
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
 private:
     OstProto::Eth2    data;
 };
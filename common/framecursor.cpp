@@ -0,0 +1,251 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "framecursor.h"
+
+#include "streambase.h"
+
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QRunnable>
+
+#include <string.h>
+
+// Max size of the read ahead buffer - see setReadAhead()
+static const int kMaxReadAheadSize = 4 << 20;
+
+/*
+ * Generates a range of frames of a stream for FrameCursor::readAhead() -
+ * frame i of the range is written at buf + i*stride and its length at
+ * lens[i]
+ */
+class FrameRangeTask : public QRunnable
+{
+public:
+    FrameRangeTask(const StreamBase *stream, int frameIndex, int count,
+            uchar *buf, int stride, int *lens, QSemaphore *done)
+        : mStream(stream), mFrameIndex(frameIndex), mCount(count),
+          mBuf(buf), mStride(stride), mLens(lens), mDone(done)
+    {
+    }
+
+    void run()
+    {
+        FrameCursor cursor(mStream, mFrameIndex, mStride);
+
+        for (int i = 0; i < mCount; i++)
+        {
+            int len = qMax(0, cursor.next());
+
+            memcpy(mBuf + i*mStride, cursor.frame(), len);
+            mLens[i] = len;
+        }
+
+        mDone->release();
+    }
+
+private:
+    const StreamBase *mStream;
+    int mFrameIndex;
+    int mCount;
+    uchar *mBuf;
+    int mStride;
+    int *mLens;
+    QSemaphore *mDone;
+};
+
+/*!
+  Creates a cursor positioned at frameIndex of the given stream with a
+  frame buffer of bufSize bytes - frames bigger than bufSize are not
+  generated
+*/
+FrameCursor::FrameCursor(const StreamBase *stream, int frameIndex,
+        int bufSize)
+    : mStream(stream), mFrameIndex(frameIndex), mFrameLen(0),
+      mTemplateGeneration(0), mReadAhead(0), mReadAheadPos(0),
+      mReadAheadCount(0), mReadAheadStride(0)
+{
+    mFrameBuf.resize(bufSize);
+}
+
+/*!
+  Positions the cursor so that the next frame yielded is frameIndex
+
+  Seek is O(1) - frames are generated directly for any index, so
+  independent ranges of a stream can be generated by separate cursors
+*/
+void FrameCursor::seek(int frameIndex)
+{
+    mFrameIndex = frameIndex;
+    mReadAheadPos = mReadAheadCount = 0;
+}
+
+/*!
+  Returns the index of the next frame that will be yielded
+*/
+int FrameCursor::frameIndex() const
+{
+    return mFrameIndex;
+}
+
+/*!
+  Generates the frame at the cursor position into the cursor's buffer,
+  advances the cursor and returns the frame length (0 if the frame could
+  not be generated); the frame is available via frame() until the next
+  call
+*/
+int FrameCursor::next()
+{
+    if (mReadAhead > 1)
+    {
+        if (mReadAheadPos >= mReadAheadCount)
+            readAhead();
+
+        mFrameLen = mReadAheadLens.at(mReadAheadPos++);
+        mFrameIndex++;
+
+        return mFrameLen;
+    }
+
+    mFrameLen = mStream->writeFrame((uchar*) mFrameBuf.data(),
+            mFrameBuf.size(), mFrameIndex, &mTemplateGeneration);
+    mFrameIndex++;
+
+    return mFrameLen;
+}
+
+/*!
+  Returns the last frame generated by next()
+*/
+const uchar* FrameCursor::frame() const
+{
+    if (mReadAhead > 1)
+        return (const uchar*) mReadAheadBuf.constData()
+                    + (mReadAheadPos - 1) * mReadAheadStride;
+
+    return (const uchar*) mFrameBuf.constData();
+}
+
+/*!
+  Returns the length of the last frame generated by next()
+*/
+int FrameCursor::frameLen() const
+{
+    return mFrameLen;
+}
+
+/*!
+  Generates upto count successive frames back to back into buf and stores
+  the length of each frame in frameLens (which must have room for count
+  entries); generation stops early if the next frame does not fit in
+  bufMaxSize. Returns the number of frames generated - the cursor is
+  advanced by the same number
+*/
+int FrameCursor::nextBatch(uchar *buf, int bufMaxSize, int count,
+        int *frameLens)
+{
+    int offset = 0;
+    int n;
+
+    for (n = 0; n < count; n++)
+    {
+        int len = next();
+
+        // Undo the next() - the frame is yielded again on the next call
+        if ((offset + len) > bufMaxSize)
+        {
+            mFrameIndex--;
+            if (mReadAhead > 1)
+                mReadAheadPos--;
+            break;
+        }
+
+        memcpy(buf + offset, frame(), len);
+        frameLens[n] = len;
+        offset += len;
+    }
+
+    return n;
+}
+
+/*!
+  Makes the cursor generate the next count frames at a time, split across
+  the threads of the global thread pool, instead of one frame per next() -
+  worthwhile only for streams with protocols that are costly to rewrite
+  (see StreamBase::isFrameCostly()) and many distinct frames. A count of
+  0 or 1 turns read ahead off
+
+  The frames are generated into a single buffer, each in a slot as big as
+  the biggest frame of the stream; count is reduced if the buffer would
+  exceed kMaxReadAheadSize
+
+  The protocols of the stream must support being written from multiple
+  threads at once
+*/
+void FrameCursor::setReadAhead(int count)
+{
+    int minLen, maxLen;
+
+    mStream->frameLenRange(minLen, maxLen);
+    mReadAheadStride = qBound(1, maxLen, mFrameBuf.size());
+
+    mReadAhead = qMin(count, kMaxReadAheadSize / mReadAheadStride);
+    mReadAheadPos = mReadAheadCount = 0;
+
+    if (mReadAhead > 1)
+    {
+        mReadAheadBuf.resize(mReadAhead * mReadAheadStride);
+        mReadAheadLens.resize(mReadAhead);
+    }
+    else
+    {
+        mReadAheadBuf.clear();
+        mReadAheadLens.clear();
+    }
+}
+
+void FrameCursor::readAhead()
+{
+    QThreadPool *pool = QThreadPool::globalInstance();
+    int tasks = qMax(1, qMin(pool->maxThreadCount(), mReadAhead / 64));
+    int perTask = (mReadAhead - 1 + tasks - 1) / tasks;
+    uchar *buf = (uchar*) mReadAheadBuf.data();
+    int *lens = mReadAheadLens.data();
+    QSemaphore done;
+    int n = 0;
+
+    // The first frame is generated right here so that anything that is
+    // computed lazily on generating a frame (e.g. the stream's frame
+    // template) is in place before the threads share the stream
+    lens[0] = qMax(0, mStream->writeFrame(buf, mReadAheadStride, mFrameIndex,
+                NULL));
+
+    for (int i = 1; i < mReadAhead; i += perTask)
+    {
+        pool->start(new FrameRangeTask(mStream, mFrameIndex + i,
+                    qMin(perTask, mReadAhead - i), buf + i*mReadAheadStride,
+                    mReadAheadStride, lens + i, &done));
+        n++;
+    }
+
+    done.acquire(n);
+
+    mReadAheadPos = 0;
+    mReadAheadCount = mReadAhead;
+}
@@ -0,0 +1,76 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _FRAME_CURSOR_H
+#define _FRAME_CURSOR_H
+
+#include <QByteArray>
+#include <QVector>
+
+class StreamBase;
+
+/*!
+  Yields the successive frames of a stream
+
+  The cursor keeps its own frame buffer - for streams that can be compiled
+  into a frame template (see StreamBase), the template is copied into the
+  buffer only once and for every successive frame only the protocols that
+  vary are rewritten in place.
+
+  The stream must not be modified while a cursor is in use - if it is, the
+  cursor notices the recompiled template and reloads it
+*/
+class FrameCursor
+{
+public:
+    FrameCursor(const StreamBase *stream, int frameIndex = 0,
+            int bufSize = kDefaultBufSize);
+
+    void seek(int frameIndex);
+    int frameIndex() const;
+
+    int next();
+    const uchar* frame() const;
+    int frameLen() const;
+
+    int nextBatch(uchar *buf, int bufMaxSize, int count, int *frameLens);
+
+    void setReadAhead(int count);
+
+    static const int kDefaultBufSize = 16384;
+
+private:
+    const StreamBase *mStream;
+    int mFrameIndex;
+    int mFrameLen;
+    uint mTemplateGeneration;
+    QByteArray mFrameBuf;
+
+    // Frames generated ahead in parallel - see setReadAhead()
+    void readAhead();
+
+    int mReadAhead;
+    int mReadAheadPos;
+    int mReadAheadCount;
+    int mReadAheadStride;
+    QByteArray mReadAheadBuf;
+    QVector<int> mReadAheadLens;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "framevariation.h"
+
+#include "counterrng.h"
+#include "ipchecksum.h"
+
+/*
+  Returns the one's complement sum of the bytes of value (size bytes, in
+  network byte order) as they would be summed as 16-bit words by a checksum
+  whose region starts parity bytes before an even boundary
+*/
+static quint64 wordSum(quint64 value, int size, int parity)
+{
+    quint64 sum = 0;
+
+    for (int i = size - 1; i >= 0; i--)
+    {
+        quint64 byte = value & 0xFF;
+
+        sum += ((i + parity) & 1) ? byte : (byte << 8);
+        value >>= 8;
+    }
+
+    return sum;
+}
+
+FrameVariation::FrameVariation()
+{
+}
+
+/*!
+  Removes all the fields
+*/
+void FrameVariation::clear()
+{
+    mFields.clear();
+}
+
+/*!
+  Returns true if there are no fields to vary
+*/
+bool FrameVariation::isNull() const
+{
+    return mFields.isEmpty();
+}
+
+int FrameVariation::fieldCount() const
+{
+    return mFields.size();
+}
+
+/*!
+  Adds a field of size bytes (network byte order) at offset in the frame
+  and returns its index; only the bits set in mask are varied - the field
+  value is base +/- (index % count) * step for increment/decrement mode and
+  base + (random % count) * step for random mode where index is the field
+  index described in the class description and random is the index'th
+  number of the counterRng sequence identified by randomKey. A count of 0
+  means the field index is used as is
+
+  Returns -1 if the field size is not supported
+*/
+int FrameVariation::addField(int offset, int size, quint64 mask, Mode mode,
+        quint64 base, quint64 count, quint64 step, quint64 divisor,
+        quint64 period, quint64 randomKey)
+{
+    Field field;
+
+    if ((offset < 0) || (size <= 0) || (size > kMaxFieldSize))
+        return -1;
+
+    field.offset = offset;
+    field.size = size;
+    field.mask = mask;
+    field.mode = mode;
+    field.base = base;
+    field.count = count;
+    field.step = step;
+    field.divisor = divisor ? divisor : 1;
+    field.period = period;
+    field.randomKey = randomKey;
+    field.cksumCount = 0;
+
+    mFields.append(field);
+
+    return mFields.size() - 1;
+}
+
+/*!
+  Adds a 16-bit internet checksum at cksumOffset whose checksummed region
+  starts at regionOffset (only the parity matters - a pseudo header may be
+  covered by specifying the start of the protocol that carries it) to the
+  checksums to be updated whenever the field is varied
+
+  Returns false if the field already has the maximum number of checksums
+*/
+bool FrameVariation::addFieldCksum(int field, int cksumOffset,
+        int regionOffset, bool isZeroCksumInvalid)
+{
+    Field &f = mFields[field];
+
+    if (f.cksumCount >= kMaxFieldCksums)
+        return false;
+
+    f.cksum[f.cksumCount].offset = cksumOffset;
+    f.cksum[f.cksumCount].regionOffset = regionOffset;
+    f.cksum[f.cksumCount].isZeroCksumInvalid = isZeroCksumInvalid;
+    f.cksumCount++;
+
+    return true;
+}
+
+/*!
+  Appends the fields of other - applied after the fields of this variation
+*/
+void FrameVariation::append(const FrameVariation &other)
+{
+    mFields += other.mFields;
+}
+
+quint64 FrameVariation::fieldValue(const Field &field,
+        quint64 frameIndex) const
+{
+    quint64 index;
+
+    if (field.period)
+        frameIndex %= field.period;
+
+    index = frameIndex / field.divisor;
+
+    if (field.mode == kRandom)
+        index = counterRng::random(field.randomKey, index);
+
+    if (field.count)
+        index %= field.count;
+
+    switch (field.mode)
+    {
+        case kIncrement:
+        case kRandom:
+            return field.base + index * field.step;
+        case kDecrement:
+            return field.base - index * field.step;
+        default:
+            Q_ASSERT(false); // Unreachable!
+            break;
+    }
+
+    return field.base;
+}
+
+/*!
+  Rewrites the fields in the frame with their values for frameIndex and
+  updates the checksums covering them
+
+  The checksums in the frame must be correct for the field values that
+  are currently in the frame - which is the case for a frame generated by
+  the stream or a frame previously varied by apply()
+*/
+void FrameVariation::apply(uchar *frame, int frameLen,
+        quint64 frameIndex) const
+{
+    for (int i = 0; i < mFields.size(); i++)
+    {
+        const Field &f = mFields.at(i);
+        uchar *p = frame + f.offset;
+        quint64 oldValue = 0;
+        quint64 newValue;
+        quint64 v;
+
+        if ((f.offset + f.size) > frameLen)
+            continue;
+
+        for (int j = 0; j < f.size; j++)
+            oldValue = (oldValue << 8) | p[j];
+
+        newValue = (oldValue & ~f.mask)
+                    | (fieldValue(f, frameIndex) & f.mask);
+        if (f.size < kMaxFieldSize)
+            newValue &= (Q_UINT64_C(1) << (f.size * 8)) - 1;
+        if (newValue == oldValue)
+            continue;
+
+        v = newValue;
+        for (int j = f.size - 1; j >= 0; j--)
+        {
+            p[j] = uchar(v);
+            v >>= 8;
+        }
+
+        for (int j = 0; j < f.cksumCount; j++)
+        {
+            const Cksum &c = f.cksum[j];
+            int parity = (f.offset - c.regionOffset) & 1;
+            uchar *q = frame + c.offset;
+            quint16 cksum;
+            quint32 sum;
+
+            if ((c.offset + 2) > frameLen)
+                continue;
+
+            // RFC 1624: HC' = ~(~HC + ~m + m')
+            cksum = (q[0] << 8) | q[1];
+            sum = quint16(~cksum);
+            sum += quint16(~ipChecksumFold(wordSum(oldValue, f.size, parity)));
+            sum += ipChecksumFold(wordSum(newValue, f.size, parity));
+            cksum = ~ipChecksumFold(sum);
+
+            if ((cksum == 0) && c.isZeroCksumInvalid)
+                cksum = 0xFFFF;
+
+            q[0] = uchar(cksum >> 8);
+            q[1] = uchar(cksum);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _FRAME_VARIATION_H
+#define _FRAME_VARIATION_H
+
+#include <QVector>
+
+/*!
+  A list of frame fields that vary from frame to frame, described by their
+  position in the frame and how their value is derived from the frame
+  index - instead of being generated by the protocols
+
+  apply() rewrites the fields of an already generated frame in place and
+  incrementally updates (RFC 1624) all the checksums covering them - so a
+  frame can be varied without regenerating it and the frames need not be
+  generated upfront: the transmitter can apply the variation to the
+  packets just before they are sent out
+
+  The value of a field is derived from its field index which is
+  ((frameIndex % period) / divisor) - a period of 0 meaning no period;
+  fields with the same divisor vary in lock-step (zipped), fields whose
+  divisor is the product of the counts of the preceding fields form a
+  cartesian product
+*/
+class FrameVariation
+{
+public:
+    enum Mode {
+        kIncrement,
+        kDecrement,
+        kRandom
+    };
+
+    FrameVariation();
+
+    void clear();
+    bool isNull() const;
+
+    int fieldCount() const;
+    int addField(int offset, int size, quint64 mask, Mode mode,
+            quint64 base, quint64 count, quint64 step, quint64 divisor = 1,
+            quint64 period = 0, quint64 randomKey = 0);
+    bool addFieldCksum(int field, int cksumOffset, int regionOffset,
+            bool isZeroCksumInvalid = false);
+    void append(const FrameVariation &other);
+
+    void apply(uchar *frame, int frameLen, quint64 frameIndex) const;
+
+    static const int kMaxFieldSize = 8;
+    static const int kMaxFieldCksums = 2;
+
+private:
+    //! A checksum covering a field
+    struct Cksum {
+        int offset;         //!< offset of the checksum in the frame
+        int regionOffset;   //!< start of the checksummed region in the frame
+        bool isZeroCksumInvalid; //!< send 0xFFFF instead of 0 e.g. UDP
+    };
+
+    struct Field {
+        int offset;
+        int size;
+        quint64 mask;
+        Mode mode;
+        quint64 base;
+        quint64 count;
+        quint64 step;
+        quint64 divisor;
+        quint64 period;
+        quint64 randomKey;
+        int cksumCount;
+        Cksum cksum[kMaxFieldCksums];
+    };
+
+    quint64 fieldValue(const Field &field, quint64 frameIndex) const;
+
+    QVector<Field> mFields;
+};
+
+#endif
@@ -209,3 +209,25 @@ int HexDumpProtocol::protocolFrameSize(int streamIndex) const
     return len;
 }
 
+void HexDumpProtocol::protocolFrameSizeRange(int &minSize,
+        int &maxSize) const
+{
+    // Exclude the padding, if any
+    minSize = maxSize = data.content().size();
+}
+
+int HexDumpProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    int len = data.content().size();
+    int size = protocolFrameSize(streamIndex);
+
+    if ((offset + size) > bufMaxSize)
+        return -1;
+
+    memcpy(buf + offset, data.content().data(), len);
+    if (size > len)
+        memset(buf + offset + len, 0, size - len);
+
+    return size;
+}
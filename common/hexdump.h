@@ -65,7 +65,11 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
     virtual int protocolFrameSize(int streamIndex = 0) const;
+    virtual void protocolFrameSizeRange(int &minSize, int &maxSize) const;
 
 private:
     OstProto::HexDump    data;
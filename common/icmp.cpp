@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 
 #include "icmp.h"
+#include "ipchecksum.h"
 #include "icmphelper.h"
 
 IcmpProtocol::IcmpProtocol(StreamBase *stream, AbstractProtocol *parent)
@@ -209,10 +210,7 @@ QVariant IcmpProtocol::fieldData(int index, FieldAttrib attrib,
                             sum += (quint16) ~cks;
                         }
 
-                        while(sum>>16)
-                            sum = (sum & 0xFFFF) + (sum >> 16);
-
-                        cksum = (~sum) & 0xFFFF;
+                        cksum = (quint16) ~ipChecksumFold(sum);
                     }
                     break;
                 default:
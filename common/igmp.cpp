@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 
 #include "igmp.h"
+#include "ipchecksum.h"
 #include "iputils.h"
 
 #include <QHostAddress>
@@ -127,7 +128,8 @@ QVariant IgmpProtocol::fieldData(int index, FieldAttrib attrib,
                 data.group_prefix(),
                 ipUtils::AddrMode(data.group_mode()),
                 data.group_count(),
-                streamIndex);
+                streamIndex,
+                fieldRandomKey(kGroupAddress));
 
             switch(attrib)
             {
@@ -355,10 +357,7 @@ quint16 IgmpProtocol::checksum(int streamIndex) const
     sum += (quint16) ~cks;
     cks = protocolFramePayloadCksum(streamIndex, CksumIp);
     sum += (quint16) ~cks;
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    cks = (~sum) & 0xFFFF;
+    cks = (quint16) ~ipChecksumFold(sum);
 
     return cks;
 }
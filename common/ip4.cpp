@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 
 #include "ip4.h"
+#include "ipchecksum.h"
 
 #include <QHostAddress>
 
@@ -429,7 +430,8 @@ QVariant Ip4Protocol::fieldData(int index, FieldAttrib attrib,
                     break;
                 case OstProto::Ip4::e_im_random_host:
                     subnet = data.src_ip() & data.src_ip_mask();
-                    host = (qrand() & ~data.src_ip_mask());
+                    host = (fieldFrameRandom(ip4_srcAddr, streamIndex)
+                            & ~data.src_ip_mask());
                     srcIp = subnet | host;
                     break;
                 default:
@@ -482,7 +484,8 @@ QVariant Ip4Protocol::fieldData(int index, FieldAttrib attrib,
                     break;
                 case OstProto::Ip4::e_im_random_host:
                     subnet = data.dst_ip() & data.dst_ip_mask();
-                    host = (qrand() & ~data.dst_ip_mask());
+                    host = (fieldFrameRandom(ip4_dstAddr, streamIndex)
+                            & ~data.dst_ip_mask());
                     dstIp = subnet | host;
                     break;
                 default:
@@ -813,6 +816,21 @@ int Ip4Protocol::protocolFrameVariableCount() const
     return count;
 }
 
+bool Ip4Protocol::isFieldFrameValueVariable(int index) const
+{
+    switch (index)
+    {
+        case ip4_srcAddr:
+            return (data.src_ip_mode() != OstProto::Ip4::e_im_fixed);
+        case ip4_dstAddr:
+            return (data.dst_ip_mode() != OstProto::Ip4::e_im_fixed);
+        default:
+            break;
+    }
+
+    return false;
+}
+
 quint32 Ip4Protocol::protocolFrameCksum(int streamIndex,
     CksumType cksumType) const
 {
@@ -820,18 +838,19 @@ quint32 Ip4Protocol::protocolFrameCksum(int streamIndex,
     {
         case CksumIpPseudo:
         {
+            quint32 srcIp, dstIp;
             quint32 sum;
 
-            sum = fieldData(ip4_srcAddr, FieldValue, streamIndex).toUInt() >> 16;
-            sum += fieldData(ip4_srcAddr, FieldValue, streamIndex).toUInt() & 0xFFFF;
-            sum += fieldData(ip4_dstAddr, FieldValue, streamIndex).toUInt() >> 16;
-            sum += fieldData(ip4_dstAddr, FieldValue, streamIndex).toUInt() & 0xFFFF;
+            srcIp = fieldData(ip4_srcAddr, FieldValue, streamIndex).toUInt();
+            dstIp = fieldData(ip4_dstAddr, FieldValue, streamIndex).toUInt();
+
+            sum = (srcIp >> 16) + (srcIp & 0xFFFF);
+            sum += (dstIp >> 16) + (dstIp & 0xFFFF);
 
             sum += fieldData(ip4_proto, FieldValue, streamIndex).toUInt() & 0x00FF;
             sum += (fieldData(ip4_totLen, FieldValue, streamIndex).toUInt() & 0xFFFF) - 20;
 
-            while(sum>>16)
-                sum = (sum & 0xFFFF) + (sum >> 16);
+            sum = ipChecksumFold(sum);
 
             // Above calculation done assuming 'big endian' 
             // - so convert to host order
@@ -844,3 +863,53 @@ quint32 Ip4Protocol::protocolFrameCksum(int streamIndex,
 
     return AbstractProtocol::protocolFrameCksum(streamIndex, cksumType);
 }
+
+int Ip4Protocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool forCksum) const
+{
+    uchar *p = buf + offset;
+    quint16 cksum;
+
+    if ((offset + 20) > bufMaxSize)
+        return -1;
+
+    p[0] = ((fieldData(ip4_ver, FieldValue, streamIndex).toUInt() & 0x0F) << 4)
+        | (fieldData(ip4_hdrLen, FieldValue, streamIndex).toUInt() & 0x0F);
+    p[1] = data.tos();
+    qToBigEndian(quint16(fieldData(ip4_totLen, FieldValue, streamIndex)
+                .toUInt()), p + 2);
+    qToBigEndian(quint16(data.id()), p + 4);
+    qToBigEndian(quint16(((data.flags() & 0x07) << 13)
+                | (data.frag_ofs() & 0x1FFF)), p + 6);
+    p[8] = data.ttl();
+    p[9] = fieldData(ip4_proto, FieldValue, streamIndex).toUInt();
+    qToBigEndian(quint32(fieldData(ip4_srcAddr, FieldValue, streamIndex)
+                .toUInt()), p + 12);
+    qToBigEndian(quint32(fieldData(ip4_dstAddr, FieldValue, streamIndex)
+                .toUInt()), p + 16);
+
+    if (forCksum)
+        cksum = 0;
+    else if (data.is_override_cksum())
+        cksum = data.cksum();
+    else
+        cksum = protocolFrameCksum(streamIndex, CksumIp);
+    qToBigEndian(cksum, p + 10);
+
+    return 20;
+}
+
+bool Ip4Protocol::canFixupProtocolFrameCksum() const
+{
+    return !data.is_override_cksum();
+}
+
+void Ip4Protocol::fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex) const
+{
+    if ((offset + 20) > frameLen)
+        return;
+
+    qToBigEndian(quint16(protocolFrameBufferCksum(frame, frameLen, offset,
+                    streamIndex, CksumIp)), frame + offset + 10);
+}
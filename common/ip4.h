@@ -85,8 +85,15 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+    virtual bool canFixupProtocolFrameCksum() const;
+    virtual void fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex = 0) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
 
     virtual quint32 protocolFrameCksum(int streamIndex = 0,
         CksumType cksumType = CksumIp) const;
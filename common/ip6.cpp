@@ -18,6 +18,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 
 #include "ip6.h"
+#include "counterrng.h"
+#include "ipchecksum.h"
 #include <QHostAddress>
 
 
@@ -306,54 +308,9 @@ QVariant Ip6Protocol::fieldData(int index, FieldAttrib attrib,
 
         case ip6_srcAddress:
         {
-            int u, p, q;
-            quint64 maskHi = 0, maskLo = 0;
-            quint64 prefixHi, prefixLo;
-            quint64 hostHi = 0, hostLo = 0;
             quint64 srcHi = 0, srcLo = 0;
 
-            switch(data.src_addr_mode())
-            {
-                case OstProto::Ip6::kFixed:
-                    srcHi = data.src_addr_hi();
-                    srcLo = data.src_addr_lo();
-                    break;
-                case OstProto::Ip6::kIncHost:
-                case OstProto::Ip6::kDecHost:
-                case OstProto::Ip6::kRandomHost:
-                    u = streamIndex % data.src_addr_count();
-                    if (data.src_addr_prefix() > 64) {
-                        p = 64;
-                        q = data.src_addr_prefix() - 64;
-                    } else {
-                        p = data.src_addr_prefix();
-                        q = 0;
-                    }
-                    if (p > 0) 
-                        maskHi = ~((quint64(1) << p) - 1);
-                    if (q > 0) 
-                        maskLo = ~((quint64(1) << q) - 1);
-                    prefixHi = data.src_addr_hi() & maskHi;
-                    prefixLo = data.src_addr_lo() & maskLo;
-                    if (data.src_addr_mode() == OstProto::Ip6::kIncHost) {
-                        hostHi = ((data.src_addr_hi() & ~maskHi) + u) & ~maskHi;
-                        hostLo = ((data.src_addr_lo() & ~maskLo) + u) & ~maskLo;
-                    } 
-                    else if (data.src_addr_mode() == OstProto::Ip6::kDecHost) {
-                        hostHi = ((data.src_addr_hi() & ~maskHi) - u) & ~maskHi;
-                        hostLo = ((data.src_addr_lo() & ~maskLo) - u) & ~maskLo;
-                    } 
-                    else if (data.src_addr_mode()==OstProto::Ip6::kRandomHost) {
-                        hostHi = qrand() & ~maskHi;
-                        hostLo = qrand() & ~maskLo;
-                    }
-                    srcHi = prefixHi | hostHi;
-                    srcLo = prefixLo | hostLo;
-                    break;
-                default:
-                    qWarning("Unhandled src_addr_mode = %d", 
-                            data.src_addr_mode());
-            }
+            srcAddr(streamIndex, srcHi, srcLo);
 
             switch(attrib)
             {
@@ -380,54 +337,9 @@ QVariant Ip6Protocol::fieldData(int index, FieldAttrib attrib,
 
         case ip6_dstAddress:
         {
-            int u, p, q;
-            quint64 maskHi = 0, maskLo = 0;
-            quint64 prefixHi, prefixLo;
-            quint64 hostHi = 0, hostLo = 0;
             quint64 dstHi = 0, dstLo = 0;
 
-            switch(data.dst_addr_mode())
-            {
-                case OstProto::Ip6::kFixed:
-                    dstHi = data.dst_addr_hi();
-                    dstLo = data.dst_addr_lo();
-                    break;
-                case OstProto::Ip6::kIncHost:
-                case OstProto::Ip6::kDecHost:
-                case OstProto::Ip6::kRandomHost:
-                    u = streamIndex % data.dst_addr_count();
-                    if (data.dst_addr_prefix() > 64) {
-                        p = 64;
-                        q = data.dst_addr_prefix() - 64;
-                    } else {
-                        p = data.dst_addr_prefix();
-                        q = 0;
-                    }
-                    if (p > 0) 
-                        maskHi = ~((quint64(1) << p) - 1);
-                    if (q > 0) 
-                        maskLo = ~((quint64(1) << q) - 1);
-                    prefixHi = data.dst_addr_hi() & maskHi;
-                    prefixLo = data.dst_addr_lo() & maskLo;
-                    if (data.dst_addr_mode() == OstProto::Ip6::kIncHost) {
-                        hostHi = ((data.dst_addr_hi() & ~maskHi) + u) & ~maskHi;
-                        hostLo = ((data.dst_addr_lo() & ~maskLo) + u) & ~maskLo;
-                    } 
-                    else if (data.dst_addr_mode() == OstProto::Ip6::kDecHost) {
-                        hostHi = ((data.dst_addr_hi() & ~maskHi) - u) & ~maskHi;
-                        hostLo = ((data.dst_addr_lo() & ~maskLo) - u) & ~maskLo;
-                    } 
-                    else if (data.dst_addr_mode()==OstProto::Ip6::kRandomHost) {
-                        hostHi = qrand() & ~maskHi;
-                        hostLo = qrand() & ~maskLo;
-                    }
-                    dstHi = prefixHi | hostHi;
-                    dstLo = prefixLo | hostLo;
-                    break;
-                default:
-                    qWarning("Unhandled dst_addr_mode = %d", 
-                            data.dst_addr_mode());
-            }
+            dstAddr(streamIndex, dstHi, dstLo);
 
             switch(attrib)
             {
@@ -776,31 +688,159 @@ quint32 Ip6Protocol::protocolFrameCksum(int streamIndex,
 {
     if (cksumType == CksumIpPseudo)
     {
-        QByteArray addr;
+        quint64 hi = 0, lo = 0;
         quint32 sum = 0;
 
-        addr = fieldData(ip6_srcAddress, FieldFrameValue, streamIndex)
-                .toByteArray();
-        Q_ASSERT(addr.size() == 16);
-        for (int i = 0; i < addr.size(); i+=2)
-            sum += (quint8(addr.at(i)) << 8) + quint8(addr.at(i+1));
+        srcAddr(streamIndex, hi, lo);
+        for (int i = 0; i < 64; i += 16)
+            sum += ((hi >> i) & 0xFFFF) + ((lo >> i) & 0xFFFF);
 
-        addr = fieldData(ip6_dstAddress, FieldFrameValue, streamIndex)
-                .toByteArray();
-        Q_ASSERT(addr.size() == 16);
-        for (int i = 0; i < addr.size(); i+=2)
-            sum += (quint8(addr.at(i)) << 8) + quint8(addr.at(i+1));
+        dstAddr(streamIndex, hi, lo);
+        for (int i = 0; i < 64; i += 16)
+            sum += ((hi >> i) & 0xFFFF) + ((lo >> i) & 0xFFFF);
 
         sum += fieldData(ip6_payloadLength, FieldValue, streamIndex)
                 .toUInt() & 0xFFFF;
         sum += fieldData(ip6_nextHeader, FieldValue, streamIndex)
                 .toUInt() & 0xFF;
 
-        while(sum>>16)
-            sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = ipChecksumFold(sum);
 
         return ~sum;
     }
     return AbstractProtocol::protocolFrameCksum(streamIndex, cksumType);
 }
 
+void Ip6Protocol::srcAddr(int streamIndex, quint64 &hi, quint64 &lo) const
+{
+    int u, p, q;
+    quint64 maskHi = 0, maskLo = 0;
+    quint64 prefixHi, prefixLo;
+    quint64 hostHi = 0, hostLo = 0;
+
+    switch(data.src_addr_mode())
+    {
+        case OstProto::Ip6::kFixed:
+            hi = data.src_addr_hi();
+            lo = data.src_addr_lo();
+            break;
+        case OstProto::Ip6::kIncHost:
+        case OstProto::Ip6::kDecHost:
+        case OstProto::Ip6::kRandomHost:
+            u = streamIndex % data.src_addr_count();
+            if (data.src_addr_prefix() > 64) {
+                p = 64;
+                q = data.src_addr_prefix() - 64;
+            } else {
+                p = data.src_addr_prefix();
+                q = 0;
+            }
+            if (p > 0) 
+                maskHi = ~((quint64(1) << p) - 1);
+            if (q > 0) 
+                maskLo = ~((quint64(1) << q) - 1);
+            prefixHi = data.src_addr_hi() & maskHi;
+            prefixLo = data.src_addr_lo() & maskLo;
+            if (data.src_addr_mode() == OstProto::Ip6::kIncHost) {
+                hostHi = ((data.src_addr_hi() & ~maskHi) + u) & ~maskHi;
+                hostLo = ((data.src_addr_lo() & ~maskLo) + u) & ~maskLo;
+            } 
+            else if (data.src_addr_mode() == OstProto::Ip6::kDecHost) {
+                hostHi = ((data.src_addr_hi() & ~maskHi) - u) & ~maskHi;
+                hostLo = ((data.src_addr_lo() & ~maskLo) - u) & ~maskLo;
+            } 
+            else if (data.src_addr_mode()==OstProto::Ip6::kRandomHost) {
+                quint64 r = fieldFrameRandom(ip6_srcAddress, streamIndex);
+                hostHi = r & ~maskHi;
+                hostLo = counterRng::mix(r) & ~maskLo;
+            }
+            hi = prefixHi | hostHi;
+            lo = prefixLo | hostLo;
+            break;
+        default:
+            qWarning("Unhandled src_addr_mode = %d", 
+                    data.src_addr_mode());
+    }
+}
+
+void Ip6Protocol::dstAddr(int streamIndex, quint64 &hi, quint64 &lo) const
+{
+    int u, p, q;
+    quint64 maskHi = 0, maskLo = 0;
+    quint64 prefixHi, prefixLo;
+    quint64 hostHi = 0, hostLo = 0;
+
+    switch(data.dst_addr_mode())
+    {
+        case OstProto::Ip6::kFixed:
+            hi = data.dst_addr_hi();
+            lo = data.dst_addr_lo();
+            break;
+        case OstProto::Ip6::kIncHost:
+        case OstProto::Ip6::kDecHost:
+        case OstProto::Ip6::kRandomHost:
+            u = streamIndex % data.dst_addr_count();
+            if (data.dst_addr_prefix() > 64) {
+                p = 64;
+                q = data.dst_addr_prefix() - 64;
+            } else {
+                p = data.dst_addr_prefix();
+                q = 0;
+            }
+            if (p > 0) 
+                maskHi = ~((quint64(1) << p) - 1);
+            if (q > 0) 
+                maskLo = ~((quint64(1) << q) - 1);
+            prefixHi = data.dst_addr_hi() & maskHi;
+            prefixLo = data.dst_addr_lo() & maskLo;
+            if (data.dst_addr_mode() == OstProto::Ip6::kIncHost) {
+                hostHi = ((data.dst_addr_hi() & ~maskHi) + u) & ~maskHi;
+                hostLo = ((data.dst_addr_lo() & ~maskLo) + u) & ~maskLo;
+            } 
+            else if (data.dst_addr_mode() == OstProto::Ip6::kDecHost) {
+                hostHi = ((data.dst_addr_hi() & ~maskHi) - u) & ~maskHi;
+                hostLo = ((data.dst_addr_lo() & ~maskLo) - u) & ~maskLo;
+            } 
+            else if (data.dst_addr_mode()==OstProto::Ip6::kRandomHost) {
+                quint64 r = fieldFrameRandom(ip6_dstAddress, streamIndex);
+                hostHi = r & ~maskHi;
+                hostLo = counterRng::mix(r) & ~maskLo;
+            }
+            hi = prefixHi | hostHi;
+            lo = prefixLo | hostLo;
+            break;
+        default:
+            qWarning("Unhandled dst_addr_mode = %d", 
+                    data.dst_addr_mode());
+    }
+}
+
+int Ip6Protocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    uchar *p = buf + offset;
+    quint64 hi = 0, lo = 0;
+
+    if ((offset + 40) > bufMaxSize)
+        return -1;
+
+    qToBigEndian(quint32(
+            ((fieldData(ip6_version, FieldValue, streamIndex).toUInt() & 0xF)
+                << 28)
+            | ((data.traffic_class() & 0xFF) << 20)
+            | (data.flow_label() & 0xFFFFF)), p);
+    qToBigEndian(quint16(fieldData(ip6_payloadLength, FieldValue, streamIndex)
+                .toUInt()), p + 4);
+    p[6] = fieldData(ip6_nextHeader, FieldValue, streamIndex).toUInt();
+    p[7] = data.hop_limit() & 0xFF;
+
+    srcAddr(streamIndex, hi, lo);
+    qToBigEndian(hi, p + 8);
+    qToBigEndian(lo, p + 16);
+
+    dstAddr(streamIndex, hi, lo);
+    qToBigEndian(hi, p + 24);
+    qToBigEndian(lo, p + 32);
+
+    return 40;
+}
@@ -100,12 +100,18 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual int protocolFrameVariableCount() const;
 
     virtual quint32 protocolFrameCksum(int streamIndex = 0,
             CksumType cksumType = CksumIp) const;
 private:
+    void srcAddr(int streamIndex, quint64 &hi, quint64 &lo) const;
+    void dstAddr(int streamIndex, quint64 &hi, quint64 &lo) const;
+
     OstProto::Ip6 data;
 };
 
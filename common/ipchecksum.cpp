@@ -0,0 +1,244 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "ipchecksum.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+        && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define IPCKSUM_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef quint64 (*SumFunc)(const uchar *buffer, uint length);
+
+static quint64 sumSelect(const uchar *buffer, uint length);
+static SumFunc sumFunc = sumSelect;
+
+/*
+  Adds the trailing bytes (less than 4) of the buffer to sum; a trailing
+  odd byte is padded with a zero byte as per RFC 1071
+*/
+static inline quint64 sumTail(const uchar *p, uint length, quint64 sum)
+{
+    if (length >= 2)
+    {
+        quint16 w;
+
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        length -= 2;
+    }
+
+    if (length)
+    {
+        quint16 w = 0;
+
+        *(uchar*)&w = *p;
+        sum += w;
+    }
+
+    return sum;
+}
+
+/*
+  Portable implementation - sums 32-bit words into a 64-bit accumulator
+  which can't overflow for any buffer length we deal with; the end-around
+  carries are all taken care of at the end by ipChecksumFold()
+*/
+static quint64 sumGeneric(const uchar *buffer, uint length)
+{
+    const uchar *p = buffer;
+    quint64 sum0 = 0, sum1 = 0;
+    quint32 w0, w1;
+
+    while (length >= 8)
+    {
+        memcpy(&w0, p, 4);
+        memcpy(&w1, p + 4, 4);
+        sum0 += w0;
+        sum1 += w1;
+        p += 8;
+        length -= 8;
+    }
+
+    if (length >= 4)
+    {
+        memcpy(&w0, p, 4);
+        sum0 += w0;
+        p += 4;
+        length -= 4;
+    }
+
+    return sumTail(p, length, sum0 + sum1);
+}
+
+#ifdef IPCKSUM_HAVE_X86_SIMD
+
+/*
+  SSE2 implementation - each 16 byte load is split into four 32-bit words
+  zero extended into two 64-bit lane vectors and added into two 64-bit
+  lane accumulators
+*/
+__attribute__((target("sse2")))
+static quint64 sumSse2(const uchar *buffer, uint length)
+{
+    const uchar *p = buffer;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    quint64 lanes[2];
+
+    while (length >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        length -= 16;
+    }
+
+    acc0 = _mm_add_epi64(acc0, acc1);
+    _mm_storeu_si128((__m128i*) lanes, acc0);
+
+    return sumGeneric(p, length) + lanes[0] + lanes[1];
+}
+
+/*
+  AVX2 implementation - same as the SSE2 one but with 32 byte loads and
+  two 32 byte loads per iteration to hide the add latency
+*/
+__attribute__((target("avx2")))
+static quint64 sumAvx2(const uchar *buffer, uint length)
+{
+    const uchar *p = buffer;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    quint64 lanes[4];
+
+    while (length >= 64)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*) p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*) (p + 32));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+        p += 64;
+        length -= 64;
+    }
+
+    if (length >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        length -= 32;
+    }
+
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    _mm256_storeu_si256((__m256i*) lanes, acc0);
+
+    return sumGeneric(p, length) + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+#endif
+
+/*
+  Selects the best implementation for the CPU we are running on the first
+  time a checksum is computed; concurrent first calls are harmless since
+  all of them select the same implementation
+*/
+static quint64 sumSelect(const uchar *buffer, uint length)
+{
+    SumFunc func = sumGeneric;
+
+#ifdef IPCKSUM_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        func = sumAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        func = sumSse2;
+#endif
+
+    sumFunc = func;
+    return func(buffer, length);
+}
+
+/*
+  Returns the (uncomplemented) one's complement sum of the 16-bit words of
+  the buffer folded to 16 bits
+*/
+quint16 ipChecksumSum(const uchar *buffer, uint length)
+{
+    return ipChecksumFold(sumFunc(buffer, length));
+}
+
+/*
+  Folds a 64-bit sum of 16-bit (or 32-bit) words to a 16-bit one's
+  complement sum by adding back the carries
+*/
+quint16 ipChecksumFold(quint64 sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return quint16(sum);
+}
+
+/*
+  Returns the checksum incrementally updated for a 16-bit field changed
+  from oldValue to newValue - RFC 1624 Eqn. 3: HC' = ~(~HC + ~m + m')
+
+  cksum, oldValue and newValue must all be in the same byte order
+*/
+quint16 ipChecksumUpdate(quint16 cksum, quint16 oldValue, quint16 newValue)
+{
+    quint32 sum;
+
+    sum = quint16(~cksum);
+    sum += quint16(~oldValue);
+    sum += newValue;
+
+    return quint16(~ipChecksumFold(sum));
+}
+
+/*
+  Same as ipChecksumUpdate() but for a 32-bit field e.g. an IPv4 address
+*/
+quint16 ipChecksumUpdate32(quint16 cksum, quint32 oldValue, quint32 newValue)
+{
+    quint32 sum;
+
+    sum = quint16(~cksum);
+    sum += quint16(~(oldValue >> 16)) + quint16(~(oldValue & 0xFFFF));
+    sum += (newValue >> 16) + (newValue & 0xFFFF);
+
+    return quint16(~ipChecksumFold(sum));
+}
@@ -0,0 +1,39 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _IP_CHECKSUM_H
+#define _IP_CHECKSUM_H
+
+#include <QtGlobal>
+
+/*
+  Internet checksum (RFC 1071) helpers
+
+  All sums are one's complement sums of 16-bit words in native (host)
+  byte order as read from the buffer i.e. the result needs to be
+  complemented and byte swapped (if required) by the caller to derive the
+  checksum in network byte order
+*/
+
+quint16 ipChecksumSum(const uchar *buffer, uint length);
+quint16 ipChecksumFold(quint64 sum);
+quint16 ipChecksumUpdate(quint16 cksum, quint16 oldValue, quint16 newValue);
+quint16 ipChecksumUpdate32(quint16 cksum, quint32 oldValue, quint32 newValue);
+
+#endif
@@ -20,6 +20,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #ifndef _IP_UTILS_H
 #define _IP_UTILS_H
 
+#include "counterrng.h"
+
 namespace ipUtils {
 enum AddrMode {
     kFixed = 0,
@@ -28,8 +30,12 @@ enum AddrMode {
     kRandom = 3
 };
 
+/*
+ * With kRandom, the host part of the address is the index-th number of
+ * the random sequence randomKey - see AbstractProtocol::fieldRandomKey()
+ */
 quint32 inline ipAddress(quint32 baseIp, int prefix, AddrMode mode, int count, 
-                    int index)
+                    int index, quint64 randomKey)
 {
     int u;
     quint32 mask = ((1<<prefix) - 1) << (32 - prefix);
@@ -56,7 +62,7 @@ quint32 inline ipAddress(quint32 baseIp, int prefix, AddrMode mode, int count,
         break;
     case kRandom:
         subnet = baseIp & mask;
-        host = (qrand() & ~mask);
+        host = (counterRng::random(randomKey, index) & ~mask);
         ip = subnet | host;
         break;
     default:
@@ -68,7 +74,8 @@ quint32 inline ipAddress(quint32 baseIp, int prefix, AddrMode mode, int count,
 }
 
 void inline ipAddress(quint64 baseIpHi, quint64 baseIpLo, int prefix, 
-        AddrMode mode, int count, int index, quint64 &ipHi, quint64 &ipLo)
+        AddrMode mode, int count, int index, quint64 randomKey,
+        quint64 &ipHi, quint64 &ipLo)
 {
     int u, p, q;
     quint64 maskHi = 0, maskLo = 0;
@@ -107,8 +114,9 @@ void inline ipAddress(quint64 baseIpHi, quint64 baseIpLo, int prefix,
                 hostLo = ((baseIpLo & ~maskLo) - u) & ~maskLo;
             } 
             else if (mode==kRandom) {
-                hostHi = qrand() & ~maskHi;
-                hostLo = qrand() & ~maskLo;
+                quint64 r = counterRng::random(randomKey, index);
+                hostHi = r & ~maskHi;
+                hostLo = counterRng::mix(r) & ~maskLo;
             }
             ipHi = prefixHi | hostHi;
             ipLo = prefixLo | hostLo;
@@ -19,7 +19,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "mac.h"
 
+#include "framevariation.h"
+
 #include <QRegExp>
+#include <limits.h>
 
 #define uintToMacStr(num)    \
     QString("%1").arg(num, 6*2, BASE_HEX, QChar('0')) \
@@ -91,6 +94,8 @@ AbstractProtocol::FieldFlags MacProtocol::fieldFlags(int index) const
         case mac_srcMacMode:
         case mac_srcMacCount:
         case mac_srcMacStep:
+        case mac_dstMacPreserveOui:
+        case mac_srcMacPreserveOui:
             flags &= ~FrameField;
             flags |= MetaField;
             break;
@@ -106,27 +111,7 @@ QVariant MacProtocol::fieldData(int index, FieldAttrib attrib,
     {
         case mac_dstAddr:
         {
-            int u;
-            quint64 dstMac = 0;
-
-            switch (data.dst_mac_mode())
-            {
-                case OstProto::Mac::e_mm_fixed:
-                    dstMac = data.dst_mac();
-                    break;
-                case OstProto::Mac::e_mm_inc:
-                    u = (streamIndex % data.dst_mac_count()) * 
-                        data.dst_mac_step(); 
-                    dstMac = data.dst_mac() + u;
-                    break;
-                case OstProto::Mac::e_mm_dec:
-                    u = (streamIndex % data.dst_mac_count()) * 
-                        data.dst_mac_step(); 
-                    dstMac = data.dst_mac() - u;
-                    break;
-                default:
-                    qWarning("Unhandled dstMac_mode %d", data.dst_mac_mode());
-            }
+            quint64 dstMac = macFrameValue(mac_dstAddr, streamIndex);
 
             switch(attrib)
             {
@@ -151,27 +136,7 @@ QVariant MacProtocol::fieldData(int index, FieldAttrib attrib,
         }
         case mac_srcAddr:
         {
-            int u;
-            quint64 srcMac = 0;
-
-            switch (data.src_mac_mode())
-            {
-                case OstProto::Mac::e_mm_fixed:
-                    srcMac = data.src_mac();
-                    break;
-                case OstProto::Mac::e_mm_inc:
-                    u = (streamIndex % data.src_mac_count()) * 
-                        data.src_mac_step(); 
-                    srcMac = data.src_mac() + u;
-                    break;
-                case OstProto::Mac::e_mm_dec:
-                    u = (streamIndex % data.src_mac_count()) * 
-                        data.src_mac_step(); 
-                    srcMac = data.src_mac() - u;
-                    break;
-                default:
-                    qWarning("Unhandled srcMac_mode %d", data.src_mac_mode());
-            }
+            quint64 srcMac = macFrameValue(mac_srcAddr, streamIndex);
 
             switch(attrib)
             {
@@ -238,6 +203,20 @@ QVariant MacProtocol::fieldData(int index, FieldAttrib attrib,
                 default: break;
             }
             break;
+        case mac_dstMacPreserveOui:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_mac_preserve_oui();
+                default: break;
+            }
+            break;
+        case mac_srcMacPreserveOui:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_mac_preserve_oui();
+                default: break;
+            }
+            break;
         default:
             break;
     }
@@ -317,6 +296,18 @@ bool MacProtocol::setFieldData(int index, const QVariant &value,
                 data.set_src_mac_step(step);
             break;
         }
+        case mac_dstMacPreserveOui:
+        {
+            isOk = true;
+            data.set_dst_mac_preserve_oui(value.toBool());
+            break;
+        }
+        case mac_srcMacPreserveOui:
+        {
+            isOk = true;
+            data.set_src_mac_preserve_oui(value.toBool());
+            break;
+        }
         default:
             qFatal("%s: unimplemented case %d in switch", __PRETTY_FUNCTION__,
                 index);
@@ -338,7 +329,7 @@ bool MacProtocol::isProtocolFrameValueVariable() const
 
 int MacProtocol::protocolFrameVariableCount() const
 {
-    int count = 1;
+    quint64 count = 1;
 
     if (data.dst_mac_mode() != OstProto::Mac::e_mm_fixed)
         count = AbstractProtocol::lcm(count, data.dst_mac_count());
@@ -346,6 +337,144 @@ int MacProtocol::protocolFrameVariableCount() const
     if (data.src_mac_mode() != OstProto::Mac::e_mm_fixed)
         count = AbstractProtocol::lcm(count, data.src_mac_count());
 
-    return count;
+    // Large ranges are expected to be varied while transmitting - see
+    // appendProtocolFrameVariation()
+    return int(qMin(count, quint64(INT_MAX)));
 }
 
+bool MacProtocol::isFieldFrameValueVariable(int index) const
+{
+    switch (index)
+    {
+        case mac_dstAddr:
+            return (data.dst_mac_mode() != OstProto::Mac::e_mm_fixed);
+        case mac_srcAddr:
+            return (data.src_mac_mode() != OstProto::Mac::e_mm_fixed);
+        default:
+            break;
+    }
+
+    return false;
+}
+
+int MacProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    uchar mac[8];
+
+    if ((offset + 12) > bufMaxSize)
+        return -1;
+
+    qToBigEndian(quint64(fieldData(mac_dstAddr, FieldValue, streamIndex)
+                .toULongLong()), mac);
+    memcpy(buf + offset, mac + 2, 6);
+    qToBigEndian(quint64(fieldData(mac_srcAddr, FieldValue, streamIndex)
+                .toULongLong()), mac);
+    memcpy(buf + offset + 6, mac + 2, 6);
+
+    return 12;
+}
+
+/*!
+  Adds the MAC addresses with a non-fixed mode to the variation - which lets
+  the transmitter generate address ranges of any size (2^24 and beyond)
+  without building a frame per address
+*/
+bool MacProtocol::appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const
+{
+    for (int index = mac_dstAddr; index <= mac_srcAddr; index++)
+    {
+        OstProto::Mac::MacAddrMode mode;
+        quint64 mac;
+        uint count, step;
+        bool preserveOui;
+
+        if (index == mac_dstAddr)
+        {
+            mode = data.dst_mac_mode();
+            mac = data.dst_mac();
+            count = data.dst_mac_count();
+            step = data.dst_mac_step();
+            preserveOui = data.dst_mac_preserve_oui();
+        }
+        else
+        {
+            mode = data.src_mac_mode();
+            mac = data.src_mac();
+            count = data.src_mac_count();
+            step = data.src_mac_step();
+            preserveOui = data.src_mac_preserve_oui();
+        }
+
+        if (mode == OstProto::Mac::e_mm_fixed)
+            continue;
+
+        variation.addField(offset + 6*index, 6,
+                preserveOui ? Q_UINT64_C(0xFFFFFF) : Q_UINT64_C(0xFFFFFFFFFFFF),
+                mode == OstProto::Mac::e_mm_dec ? FrameVariation::kDecrement
+                : mode == OstProto::Mac::e_mm_random ? FrameVariation::kRandom
+                : FrameVariation::kIncrement,
+                mac, count ? count : 1, step, 1, 0, fieldRandomKey(index));
+    }
+
+    return true;
+}
+
+/*!
+  Returns the value of the MAC address at 'index' for the frame
+  'streamIndex' as per its mode - if the OUI is to be preserved only the
+  lower 24 bits of the address are varied (and wrap around)
+*/
+quint64 MacProtocol::macFrameValue(int index, int streamIndex) const
+{
+    OstProto::Mac::MacAddrMode mode;
+    quint64 mac, mask;
+    quint64 count, step;
+
+    if (index == mac_dstAddr)
+    {
+        mode = data.dst_mac_mode();
+        mac = data.dst_mac();
+        count = data.dst_mac_count();
+        step = data.dst_mac_step();
+        mask = data.dst_mac_preserve_oui() ? Q_UINT64_C(0xFFFFFF)
+                : Q_UINT64_C(0xFFFFFFFFFFFF);
+    }
+    else
+    {
+        mode = data.src_mac_mode();
+        mac = data.src_mac();
+        count = data.src_mac_count();
+        step = data.src_mac_step();
+        mask = data.src_mac_preserve_oui() ? Q_UINT64_C(0xFFFFFF)
+                : Q_UINT64_C(0xFFFFFFFFFFFF);
+    }
+
+    if (count == 0)
+        count = 1;
+
+    switch (mode)
+    {
+        case OstProto::Mac::e_mm_fixed:
+            return mac;
+        case OstProto::Mac::e_mm_inc:
+            mac = (mac & ~mask)
+                    | ((mac + (uint(streamIndex) % count) * step) & mask);
+            break;
+        case OstProto::Mac::e_mm_dec:
+            mac = (mac & ~mask)
+                    | ((mac - (uint(streamIndex) % count) * step) & mask);
+            break;
+        case OstProto::Mac::e_mm_random:
+            mac = (mac & ~mask)
+                    | ((mac + (fieldFrameRandom(index, streamIndex) % count)
+                        * step) & mask);
+            break;
+        default:
+            qWarning("Unhandled mac mode %d", mode);
+            break;
+    }
+
+    return mac & Q_UINT64_C(0xFFFFFFFFFFFF);
+}
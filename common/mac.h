@@ -38,6 +38,8 @@ public:
         mac_srcMacMode,
         mac_srcMacCount,
         mac_srcMacStep,
+        mac_dstMacPreserveOui,
+        mac_srcMacPreserveOui,
 
         mac_fieldCount
     };
@@ -63,10 +65,19 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
 
 private:
+    quint64 macFrameValue(int index, int streamIndex) const;
+
     OstProto::Mac    data;
 };
 
@@ -187,6 +187,7 @@ QVariant MldProtocol::fieldData(int index, FieldAttrib attrib,
                     ipUtils::AddrMode(data.group_mode()),
                     data.group_count(),
                     streamIndex,
+                    fieldRandomKey(kGroupAddress),
                     grpHi, 
                     grpLo);
 
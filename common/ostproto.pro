@@ -43,6 +43,8 @@ HEADERS = \
     protocollist.h \
     protocollistiterator.h \
     streambase.h \
+    framecursor.h \
+    framevariation.h \
 
 HEADERS += \
     mac.h \
@@ -77,15 +79,19 @@ HEADERS += \
 SOURCES = \
     abstractprotocol.cpp \
     crc32c.cpp \
+    ipchecksum.cpp \
     protocolmanager.cpp \
     protocollist.cpp \
     protocollistiterator.cpp \
     streambase.cpp \
+    framecursor.cpp \
+    framevariation.cpp \
 
 SOURCES += \
     mac.cpp \
     vlan.cpp \
     svlan.cpp \
+    vlanstack.cpp \
     eth2.cpp \
     dot3.cpp \
     llc.cpp \
@@ -20,6 +20,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "payload.h"
 #include "streambase.h"
 
+#include "counterrng.h"
+
 PayloadProtocol::PayloadProtocol(StreamBase *stream, AbstractProtocol *parent)
     : AbstractProtocol(stream, parent)
 {
@@ -73,11 +75,16 @@ int PayloadProtocol::protocolFrameSize(int streamIndex) const
     if (len < 0)
         len = 0;
 
-    qDebug("%s: this = %p, streamIndex = %d, len = %d", __FUNCTION__, this,
-            streamIndex, len);
     return len;
 }
 
+void PayloadProtocol::protocolFrameSizeRange(int &minSize,
+        int &maxSize) const
+{
+    // Payload is padding
+    minSize = maxSize = 0;
+}
+
 int PayloadProtocol::fieldCount() const
 {
     return payload_fieldCount;
@@ -147,10 +154,19 @@ QVariant PayloadProtocol::fieldData(int index, FieldAttrib attrib,
                                 fv[i] = 0xFF - (i % (0xFF + 1));
                             break;
                         case OstProto::Payload::e_dp_random:
-                            //! \todo (HIGH) cksum is incorrect for random pattern
+                        {
+                            quint64 key = fieldFrameRandom(
+                                    payload_dataPattern, streamIndex);
+                            quint64 r = 0;
+
                             for (int i = 0; i < dataLen; i++)
-                                fv[i] =  qrand() % (0xFF + 1);
+                            {
+                                if ((i % 8) == 0)
+                                    r = counterRng::random(key, i / 8);
+                                fv[i] = uchar(r >> ((i % 8) * 8));
+                            }
                             break;
+                        }
                         default:
                             qWarning("Unhandled data pattern %d", 
                                 data.pattern_mode());
@@ -256,3 +272,59 @@ int PayloadProtocol::protocolFrameVariableCount() const
 
     return count;
 }
+
+int PayloadProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    uchar *p = buf + offset;
+    int dataLen;
+
+    dataLen = protocolFrameSize(streamIndex);
+
+    // Same as FieldFrameValue for payload_dataPattern (see the hack there)
+    if (dataLen <= 0)
+        dataLen = 1;
+
+    if ((offset + dataLen) > bufMaxSize)
+        return -1;
+
+    switch(data.pattern_mode())
+    {
+        case OstProto::Payload::e_dp_fixed_word:
+        {
+            uchar pattern[4];
+
+            qToBigEndian((quint32) data.pattern(), pattern);
+            for (int i = 0; i < dataLen; i++)
+                p[i] = pattern[i % 4];
+            break;
+        }
+        case OstProto::Payload::e_dp_inc_byte:
+            for (int i = 0; i < dataLen; i++)
+                p[i] = i % (0xFF + 1);
+            break;
+        case OstProto::Payload::e_dp_dec_byte:
+            for (int i = 0; i < dataLen; i++)
+                p[i] = 0xFF - (i % (0xFF + 1));
+            break;
+        case OstProto::Payload::e_dp_random:
+        {
+            quint64 key = fieldFrameRandom(payload_dataPattern, streamIndex);
+            quint64 r = 0;
+
+            for (int i = 0; i < dataLen; i++)
+            {
+                if ((i % 8) == 0)
+                    r = counterRng::random(key, i / 8);
+                p[i] = uchar(r >> ((i % 8) * 8));
+            }
+            break;
+        }
+        default:
+            qWarning("Unhandled data pattern %d", data.pattern_mode());
+            memset(p, 0, dataLen);
+            break;
+    }
+
+    return dataLen;
+}
@@ -51,6 +51,7 @@ public:
     virtual QString shortName() const;
 
     virtual int protocolFrameSize(int streamIndex = 0) const;
+    virtual void protocolFrameSizeRange(int &minSize, int &maxSize) const;
 
     virtual int    fieldCount() const;
 
@@ -60,6 +61,9 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual bool isProtocolFrameSizeVariable() const;
     virtual int protocolFrameVariableCount() const;
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "pcapfileformat.h"
 
+#include "framecursor.h"
 #include "pdmlreader.h"
 #include "ostprotolib.h"
 #include "streambase.h"
@@ -560,7 +561,6 @@ bool PcapFileFormat::saveStreams(const OstProto::StreamConfigList streams,
     QFile file(fileName);
     PcapFileHeader fileHdr;
     PcapPacketHeader pktHdr;
-    QByteArray pktBuf;
 
     if (!file.open(QIODevice::WriteOnly))
         goto _err_open;
@@ -583,8 +583,6 @@ bool PcapFileFormat::saveStreams(const OstProto::StreamConfigList streams,
     fd_ << fileHdr.snapLen;
     fd_ << fileHdr.network;
 
-    pktBuf.resize(kMaxSnapLen);
-
     emit status("Writing Packets...");
     emit target(streams.stream_size());
 
@@ -597,7 +595,8 @@ bool PcapFileFormat::saveStreams(const OstProto::StreamConfigList streams,
         s.setId(i);
         s.protoDataCopyFrom(streams.stream(i));
         // TODO: expand frameIndex for each stream
-        s.frameValue((uchar*)pktBuf.data(), pktBuf.size(), 0); 
+        FrameCursor cursor(&s, 0, kMaxSnapLen);
+        cursor.next();
 
         pktHdr.inclLen = s.frameProtocolLength(0); // FIXME: stream index = 0
         pktHdr.origLen = s.frameLen() - 4; // FCS; FIXME: Hardcoding
@@ -612,7 +611,7 @@ bool PcapFileFormat::saveStreams(const OstProto::StreamConfigList streams,
         fd_ << pktHdr.tsUsec;
         fd_ << pktHdr.inclLen;
         fd_ << pktHdr.origLen;
-        fd_.writeRawData(pktBuf.data(), pktHdr.inclLen);
+        fd_.writeRawData((const char*) cursor.frame(), pktHdr.inclLen);
 
         if (s.packetRate())
             pktHdr.tsUsec += quint32(1e6/s.packetRate());
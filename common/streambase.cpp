@@ -23,12 +23,24 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "protocollistiterator.h"
 #include "protocolmanager.h"
 
+#include "counterrng.h"
+
+#include <limits.h>
+
 extern ProtocolManager *OstProtocolManager;
 
 StreamBase::StreamBase() :
     mStreamId(new OstProto::StreamId),
     mCore(new OstProto::StreamCore),
-    mControl(new OstProto::StreamControl)
+    mControl(new OstProto::StreamControl),
+    mFlowSet(new OstProto::StreamFlowSet),
+    mReplay(new OstProto::StreamReplay),
+    mIsFrameTemplateValid(false),
+    mIsFrameTemplateUsable(false),
+    mFrameTemplateGeneration(0),
+    mIsFrameLayersUsable(false),
+    mFrameLayersLength(0),
+    mIsFrameVariationComplete(false)
 {
     AbstractProtocol *proto;
     ProtocolListIterator *iter;
@@ -71,6 +83,8 @@ StreamBase::~StreamBase()
 {
     currentFrameProtocols->destroy();
     delete currentFrameProtocols;
+    delete mReplay;
+    delete mFlowSet;
     delete mControl;
     delete mCore;
     delete mStreamId;
@@ -84,6 +98,8 @@ void StreamBase::protoDataCopyFrom(const OstProto::Stream &stream)
     mStreamId->CopyFrom(stream.stream_id());
     mCore->CopyFrom(stream.core());
     mControl->CopyFrom(stream.control());
+    mFlowSet->CopyFrom(stream.flow_set());
+    mReplay->CopyFrom(stream.replay());
 
     currentFrameProtocols->destroy();
     iter = createProtocolListIterator();
@@ -102,6 +118,8 @@ void StreamBase::protoDataCopyFrom(const OstProto::Stream &stream)
     }
 
     delete iter;
+
+    invalidateFrameTemplate();
 }
 
 void StreamBase::protoDataCopyInto(OstProto::Stream &stream) const
@@ -109,6 +127,14 @@ void StreamBase::protoDataCopyInto(OstProto::Stream &stream) const
     stream.mutable_stream_id()->CopyFrom(*mStreamId);
     stream.mutable_core()->CopyFrom(*mCore);
     stream.mutable_control()->CopyFrom(*mControl);
+    if (hasFlowSet())
+        stream.mutable_flow_set()->CopyFrom(*mFlowSet);
+    else
+        stream.clear_flow_set();
+    if (hasReplay())
+        stream.mutable_replay()->CopyFrom(*mReplay);
+    else
+        stream.clear_replay();
 
     stream.clear_protocol();
     foreach (const AbstractProtocol* proto, *currentFrameProtocols)
@@ -135,9 +161,42 @@ void StreamBase::setFrameProtocol(ProtocolList protocolList)
 
 ProtocolListIterator*  StreamBase::createProtocolListIterator() const
 {
+    // The caller may modify the protocol list via the iterator
+    invalidateFrameTemplate();
+
     return new ProtocolListIterator(*currentFrameProtocols);
 }
 
+/*!
+  Looks up the top level protocol 'proto' in the layer array and returns
+  its offset from the start of the frame and the size of all protocols
+  following it
+
+  Returns false if the layer array is not usable (the stream has not been
+  compiled or the protocol sizes vary from frame to frame) or if proto is
+  not a top level protocol - the caller should compute the values itself
+*/
+bool StreamBase::frameLayerPosition(const AbstractProtocol *proto,
+        int &offset, int &payloadSize) const
+{
+    if (!mIsFrameLayersUsable)
+        return false;
+
+    for (int i = 0; i < mFrameLayers.size(); i++)
+    {
+        const FrameLayer &layer = mFrameLayers.at(i);
+
+        if (layer.proto == proto)
+        {
+            offset = layer.offset;
+            payloadSize = mFrameLayersLength - layer.offset - layer.size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 quint32    StreamBase::id()
 {
     return mStreamId->id();
@@ -146,6 +205,8 @@ quint32    StreamBase::id()
 bool StreamBase::setId(quint32 id)
 {
     mStreamId->set_id(id);
+    // The stream id keys the random fields - see randomKey()
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -190,6 +251,7 @@ StreamBase::FrameLengthMode    StreamBase::lenMode() const
 bool StreamBase::setLenMode(FrameLengthMode    lenMode)
 {
     mCore->set_len_mode((OstProto::StreamCore::FrameLengthMode) lenMode); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -212,13 +274,8 @@ quint16    StreamBase::frameLen(int streamIndex) const
                 (frameLenMax() - frameLenMin() + 1));
             break;
         case OstProto::StreamCore::e_fl_random:
-            //! \todo (MED) This 'random' sequence is same across iterations
-            pktLen = 64; // to avoid the 'maybe used uninitialized' warning
-            qsrand(reinterpret_cast<ulong>(this));
-            for (int i = 0; i <= streamIndex; i++)
-                pktLen = qrand();
-            pktLen = frameLenMin() + (pktLen %
-                (frameLenMax() - frameLenMin() + 1));
+            pktLen = frameLenMin() + (counterRng::random(randomKey(0),
+                        streamIndex) % (frameLenMax() - frameLenMin() + 1));
             break;
         default:
             qWarning("Unhandled len mode %d. Using default 64", 
@@ -233,6 +290,7 @@ quint16    StreamBase::frameLen(int streamIndex) const
 bool StreamBase::setFrameLen(quint16 frameLen)
 {
     mCore->set_frame_len(frameLen);  
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -244,6 +302,7 @@ quint16    StreamBase::frameLenMin() const
 bool StreamBase::setFrameLenMin(quint16 frameLenMin)
 {
     mCore->set_frame_len_min(frameLenMin);  
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -255,6 +314,7 @@ quint16    StreamBase::frameLenMax() const
 bool StreamBase::setFrameLenMax(quint16 frameLenMax)
 {
     mCore->set_frame_len_max(frameLenMax);  
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -271,6 +331,72 @@ quint16 StreamBase::frameLenAvg() const
     return avgFrameLen;
 }
 
+/*!
+  Returns the minimum and maximum frame length across all the frames of the
+  stream - for increment/decrement modes, only the lengths actually used by
+  frameCount() frames are considered
+*/
+void StreamBase::frameLenRange(int &minLen, int &maxLen) const
+{
+    int range = frameLenMax() - frameLenMin() + 1;
+    int count = frameCount();
+
+    if ((count <= 0) || (count > range))
+        count = range;
+    if (count <= 0)
+        count = 1;
+
+    switch(lenMode())
+    {
+        case e_fl_fixed:
+            minLen = maxLen = frameLen();
+            break;
+        case e_fl_inc:
+            minLen = frameLenMin();
+            maxLen = frameLenMin() + count - 1;
+            break;
+        case e_fl_dec:
+            maxLen = frameLenMax();
+            minLen = frameLenMax() - (count - 1);
+            break;
+        case e_fl_random:
+            minLen = frameLenMin();
+            maxLen = frameLenMax();
+            break;
+        default:
+            minLen = maxLen = frameLen();
+            break;
+    }
+}
+
+quint32 StreamBase::randomSeed() const
+{
+    return mCore->random_seed();
+}
+
+bool StreamBase::setRandomSeed(quint32 seed)
+{
+    mCore->set_random_seed(seed);
+    invalidateFrameTemplate();
+    return true;
+}
+
+/*!
+  Returns the key of the random sequence for the given field key - the
+  sequence is unique for the stream id, random seed and field key
+
+  Use with counterRng::random() to get the random value for a frame index;
+  field key 0 is used by StreamBase for random frame lengths, protocols use
+  AbstractProtocol::fieldFrameRandom()
+*/
+quint64 StreamBase::randomKey(quint32 fieldKey) const
+{
+    quint64 key;
+
+    key = counterRng::key(mStreamId->id(), mCore->random_seed());
+    return counterRng::key(key, fieldKey);
+}
+
 StreamBase::SendUnit StreamBase::sendUnit() const
 {
     return (StreamBase::SendUnit) mControl->unit();
@@ -279,6 +405,7 @@ StreamBase::SendUnit StreamBase::sendUnit() const
 bool StreamBase::setSendUnit(SendUnit sendUnit)
 {
     mControl->set_unit((OstProto::StreamControl::SendUnit) sendUnit); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -313,6 +440,7 @@ quint32 StreamBase::numPackets() const
 bool StreamBase::setNumPackets(quint32 numPackets)
 {
     mControl->set_num_packets(numPackets); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -324,6 +452,7 @@ quint32 StreamBase::numBursts() const
 bool StreamBase::setNumBursts(quint32 numBursts)
 {
     mControl->set_num_bursts(numBursts); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -335,6 +464,7 @@ quint32 StreamBase::burstSize() const
 bool StreamBase::setBurstSize(quint32 packetsPerBurst)
 {
     mControl->set_packets_per_burst(packetsPerBurst); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -357,6 +487,7 @@ double StreamBase::burstRate() const
 bool StreamBase::setBurstRate(double burstsPerSec)
 {
     mControl->set_bursts_per_sec(burstsPerSec); 
+    invalidateFrameTemplate();
     return true;
 }
 
@@ -398,61 +529,170 @@ bool StreamBase::setAveragePacketRate(double packetsPerSec)
     return true;
 }
 
-bool StreamBase::isFrameVariable() const
+/*!
+  Returns true if the stream replays the packets of a pcap file on the
+  drone instead of generating them from its protocols - see replay()
+*/
+bool StreamBase::hasReplay() const
 {
-    ProtocolListIterator    *iter;
+    return mReplay->has_file_name() && !mReplay->file_name().empty();
+}
 
-    iter = createProtocolListIterator();
-    while (iter->hasNext())
+const OstProto::StreamReplay& StreamBase::replay() const
+{
+    return *mReplay;
+}
+
+/*!
+  Returns true if the stream has a flow set i.e. one or more of the flow
+  set ranges (src/dst IP, src/dst L4 port, VLAN id) are specified
+*/
+bool StreamBase::hasFlowSet() const
+{
+    return mFlowSet->has_src_ip() || mFlowSet->has_dst_ip()
+            || mFlowSet->has_src_port() || mFlowSet->has_dst_port()
+            || mFlowSet->has_vlan_id();
+}
+
+/*!
+  Returns the number of flows of the flow set - the explicitly specified
+  flow count or if not specified, the count of the biggest range for zipped
+  ranges or the product of the range counts for cartesian ranges
+
+  Returns 1 if the stream has no flow set
+*/
+quint64 StreamBase::flowCount() const
+{
+    const OstProto::StreamFlowRange *ranges[] = {
+        mFlowSet->has_src_ip() ? &mFlowSet->src_ip() : NULL,
+        mFlowSet->has_dst_ip() ? &mFlowSet->dst_ip() : NULL,
+        mFlowSet->has_src_port() ? &mFlowSet->src_port() : NULL,
+        mFlowSet->has_dst_port() ? &mFlowSet->dst_port() : NULL,
+        mFlowSet->has_vlan_id() ? &mFlowSet->vlan_id() : NULL
+    };
+    quint64 count = 1;
+
+    if (!hasFlowSet())
+        return 1;
+
+    if (mFlowSet->flow_count())
+        return qMin(quint64(mFlowSet->flow_count()), quint64(INT_MAX));
+
+    for (uint i = 0; i < sizeof(ranges)/sizeof(ranges[0]); i++)
     {
-        AbstractProtocol    *proto;
+        quint64 rangeCount;
 
-        proto = iter->next();
-        if (proto->isProtocolFrameValueVariable())
-            goto _exit;
+        if (!ranges[i])
+            continue;
+
+        rangeCount = qMax(quint64(ranges[i]->count()), quint64(1));
+        if (mFlowSet->order() == OstProto::StreamFlowSet::e_fo_cartesian)
+            count = qMin(count * qMin(rangeCount, quint64(INT_MAX)),
+                    quint64(INT_MAX));
+        else
+            count = qMax(count, qMin(rangeCount, quint64(INT_MAX)));
     }
-    delete iter;
-    return false;
 
-_exit:
-    delete iter;
-    return true;
+    return count;
 }
 
-bool StreamBase::isFrameSizeVariable() const
+/*!
+  Returns the fields of the stream that can be varied in place in a frame
+  generated by frameValue() to derive the frames at other frame indices -
+  or NULL if there are no such fields
+
+  These are the flow set fields and, if they are the only fields that vary
+  (see compileFrameTemplate()), the protocol fields varied incrementally.
+  frameValue() already applies the variation for the frame index; this is
+  meant for transmitters that vary the packets while transmitting instead
+  of building all the frames upfront - see AbstractPort
+*/
+const FrameVariation* StreamBase::frameVariation() const
 {
-    ProtocolListIterator    *iter;
+    if (!mIsFrameTemplateValid)
+        compileFrameTemplate();
 
-    iter = createProtocolListIterator();
-    while (iter->hasNext())
+    return mFrameVariation.isNull() ? NULL : &mFrameVariation;
+}
+
+/*!
+  Returns the number of frames that need to be built upfront if the frames
+  are varied with frameVariation() while transmitting - 1 if the variation
+  covers all the protocol fields that vary, frameProtocolVariableCount()
+  otherwise
+*/
+int StreamBase::frameVariationBaseCount() const
+{
+    if (!mIsFrameTemplateValid)
+        compileFrameTemplate();
+
+    return mIsFrameVariationComplete ? 1 : frameProtocolVariableCount();
+}
+
+bool StreamBase::isFrameVariable() const
+{
+    return isFrameProtocolVariable() || (flowCount() > 1);
+}
+
+/*!
+  Returns true if any of the protocols of the stream has fields that vary
+  from frame to frame - flows of the flow set, if any, are not considered
+*/
+bool StreamBase::isFrameProtocolVariable() const
+{
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
     {
-        AbstractProtocol    *proto;
+        if (proto->isProtocolFrameValueVariable())
+            return true;
+    }
 
-        proto = iter->next();
+    return false;
+}
+
+bool StreamBase::isFrameSizeVariable() const
+{
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+    {
         if (proto->isProtocolFrameSizeVariable())
-            goto _exit;
+            return true;
     }
-    delete iter;
+
     return false;
+}
 
-_exit:
-    delete iter;
-    return true;
+/*!
+  Returns true if any of the protocols is costly to generate per frame -
+  such as a user script which is run for every frame
+*/
+bool StreamBase::isFrameCostly() const
+{
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+    {
+        if (proto->protocolNumber()
+                == OstProto::Protocol::kUserScriptFieldNumber)
+            return true;
+    }
+
+    return false;
 }
 
 int StreamBase::frameVariableCount() const
 {
-    ProtocolListIterator    *iter;
+    return qMin(AbstractProtocol::lcm(frameProtocolVariableCount(),
+                flowCount()), quint64(INT_MAX));
+}
+
+/*!
+  Returns the number of frames after which the protocol field values
+  repeat - flows of the flow set, if any, are not considered
+*/
+int StreamBase::frameProtocolVariableCount() const
+{
     quint64 frameCount = 1;
 
-    iter = createProtocolListIterator();
-    while (iter->hasNext())
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
     {
-        AbstractProtocol    *proto;
-        int count;
-
-        proto = iter->next();
-        count = proto->protocolFrameVariableCount();
+        int count = proto->protocolFrameVariableCount();
 
         // correct count for mis-behaving protocols
         if (count <= 0)
@@ -460,7 +700,6 @@ int StreamBase::frameVariableCount() const
 
         frameCount = AbstractProtocol::lcm(frameCount, count);
     }
-    delete iter;
 
     return frameCount;
 }
@@ -470,15 +709,12 @@ int StreamBase::frameVariableCount() const
 int StreamBase::frameProtocolLength(int frameIndex) const
 {
     int len = 0;
-    ProtocolListIterator *iter = createProtocolListIterator();
 
-    while (iter->hasNext())
-    {
-        AbstractProtocol *proto = iter->next();
+    if (mIsFrameLayersUsable)
+        return mFrameLayersLength;
 
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
         len += proto->protocolFrameSize(frameIndex);
-    }
-    delete iter;
 
     return len;
 }
@@ -498,6 +734,23 @@ int StreamBase::frameCount() const
 }
 
 int StreamBase::frameValue(uchar *buf, int bufMaxSize, int frameIndex) const
+{
+    return writeFrame(buf, bufMaxSize, frameIndex, NULL);
+}
+
+/*!
+  Writes the frame at frameIndex into buf and returns its length
+
+  If templateGeneration is not NULL, buf is assumed to already contain the
+  frame template if *templateGeneration matches the current template - in
+  which case only the patches are written; *templateGeneration is updated
+  to reflect the contents of buf. This is used by FrameCursor to rewrite
+  only the varying bytes of successive frames in the same buffer
+
+  The flow set fields, if any, are applied last over the complete frame
+*/
+int StreamBase::writeFrame(uchar *buf, int bufMaxSize, int frameIndex,
+        uint *templateGeneration) const
 {
     int        pktLen, len = 0;
 
@@ -509,49 +762,544 @@ int StreamBase::frameValue(uchar *buf, int bufMaxSize, int frameIndex) const
     if ((pktLen < 0) || (pktLen > bufMaxSize))
         return 0;
 
-    ProtocolListIterator    *iter;
+    if (!mIsFrameTemplateValid)
+        compileFrameTemplate();
 
-    iter = createProtocolListIterator();
-    while (iter->hasNext())
+    if (mIsFrameTemplateUsable && (mFrameTemplate.size() < bufMaxSize))
     {
-        AbstractProtocol    *proto;
-        QByteArray            ba;
+        // The flow set fields are varied incrementally over the template
+        // values, so the template is always copied for such streams
+        if (!templateGeneration
+                || (*templateGeneration != mFrameTemplateGeneration)
+                || !mFlowVariation.isNull())
+        {
+            memcpy(buf, mFrameTemplate.constData(), mFrameTemplate.size());
+            if (templateGeneration)
+                *templateGeneration = mFrameTemplateGeneration;
+        }
+
+        for (int i = 0; i < mFramePatches.size(); i++)
+        {
+            const FrameLayer &patch = mFramePatches.at(i);
+
+            patch.proto->writeProtocolFrameValue(buf, bufMaxSize,
+                    patch.offset, frameIndex);
+        }
+
+        if (!mProtocolVariation.isNull())
+            mProtocolVariation.apply(buf, mFrameTemplate.size(), frameIndex);
+
+        // Checksums are filled last, innermost protocol first
+        for (int i = mCksumPatches.size() - 1; i >= 0; i--)
+        {
+            const FrameLayer &patch = mCksumPatches.at(i);
+            bool deferCksum = patch.proto->canFixupProtocolFrameCksum();
+
+            patch.proto->writeProtocolFrameValue(buf, bufMaxSize,
+                    patch.offset, frameIndex, deferCksum);
+            if (deferCksum)
+                patch.proto->fixupProtocolFrameCksum(buf,
+                        mFrameTemplate.size(), patch.offset, frameIndex);
+        }
 
-        proto = iter->next();
-        ba = proto->protocolFrameValue(frameIndex);
+        if (!mFlowVariation.isNull())
+            mFlowVariation.apply(buf, pktLen, frameIndex);
 
-        if (len + ba.size() < bufMaxSize)
-            memcpy(buf+len, ba.constData(), ba.size());
-        len += ba.size();
+        return pktLen;
     }
-    delete iter;
+
+    if (templateGeneration)
+        *templateGeneration = 0;
+
+    // Protocols which can fill their checksum over the assembled frame are
+    // written with a zero checksum and fixed up after the whole frame is
+    // written - innermost protocol first
+    FrameLayer fixups[kMaxCksumFixups];
+    int fixupCount = 0;
+
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+    {
+        bool deferCksum = (fixupCount < kMaxCksumFixups)
+                            && proto->canFixupProtocolFrameCksum();
+        int size;
+
+        size = proto->writeProtocolFrameValue(buf, bufMaxSize, len,
+                frameIndex, deferCksum);
+        if (size < 0)
+            size = proto->protocolFrameSize(frameIndex);
+        else if (deferCksum)
+        {
+            fixups[fixupCount].proto = proto;
+            fixups[fixupCount].offset = len;
+            fixups[fixupCount].size = size;
+            fixupCount++;
+        }
+        len += size;
+    }
+
+    for (int i = fixupCount - 1; i >= 0; i--)
+        fixups[i].proto->fixupProtocolFrameCksum(buf, qMin(len, bufMaxSize),
+                fixups[i].offset, frameIndex);
 
     // Pad with zero, if required
     if (len < pktLen)
         memset(buf+len, 0, pktLen-len);
 
+    if (!mFlowVariation.isNull())
+        mFlowVariation.apply(buf, pktLen, frameIndex);
+
     return pktLen;
 }
 
-bool StreamBase::preflightCheck(QString &result) const
+/*!
+  Compiles the stream's frames into a template - the bytes that are the same
+  for all frames of the stream - and a list of the protocols with fields
+  that vary from frame to frame which need to be rewritten in place for
+  every frame; protocols with checksum fields which depend on the varying
+  fields are kept in a separate list so that they can be rewritten after
+  all the other protocols
+
+  If the only protocols that vary are those that can describe their
+  varying fields as a FrameVariation (see
+  AbstractProtocol::appendProtocolFrameVariation()), the fields are varied
+  incrementally instead and only the checksums of the protocols preceding
+  them - which may cover them - are recomputed
+
+  Only streams with a fixed frame length and fixed protocol sizes can be
+  compiled into a template; for other streams, frameValue() builds each
+  frame from scratch. The layer array (see updateFrameLayers()) is rebuilt
+  alongwith the template.
+
+  The template is compiled on first use and is invalidated by the stream
+  setters, StreamBase::protoDataCopyFrom() and any change to the protocol
+  list made via a ProtocolListIterator. Protocol data modified in place -
+  via AbstractProtocol::protoDataCopyFrom(), setFieldData() or a protocol
+  config widget - is not tracked; the caller must then call
+  invalidateFrameTemplate() on the owning stream
+
+  The flow set, if any, is compiled alongwith - see compileFrameVariation()
+*/
+void StreamBase::compileFrameTemplate() const
 {
-    bool pass = true;
-    int count = isFrameSizeVariable() ? frameCount() : 1;
+    bool isVariable;
+    bool isRewriteNeeded = false;
+    int variationOffset = -1;
+    int pktLen;
+
+    mFrameTemplate.clear();
+    mFramePatches.clear();
+    mCksumPatches.clear();
+    mProtocolVariation.clear();
+    mIsFrameTemplateUsable = false;
+    mIsFrameTemplateValid = true;
+    mFrameTemplateGeneration++;
+
+    updateFrameLayers();
+    compileFrameVariation();
 
-    for (int i = 0; i < count; i++)
+    mIsFrameVariationComplete = false;
+    mFrameVariation = mFlowVariation;
+
+    if ((lenMode() != e_fl_fixed) || !mIsFrameLayersUsable)
+        return;
+
+    pktLen = frameLen() - kFcsSize;
+    if (pktLen < 0)
+        return;
+
+    isVariable = isFrameProtocolVariable();
+
+    for (int j = 0; j < mFrameLayers.size(); j++)
     {
-        if (frameLen(i) < (frameProtocolLength(i) + kFcsSize))
+        const FrameLayer &patch = mFrameLayers.at(j);
+        const AbstractProtocol *proto = patch.proto;
+        int size = patch.size;
+
+        // If none of the fields vary, there are no patches and the
+        // template is the complete frame
+        if (isVariable)
         {
-            result += QString("One or more frames may be truncated - "
-                "frame length should be at least %1.\n")
-                .arg(frameProtocolLength(i) + kFcsSize);
-            pass = false;
+            bool hasVariableField = false;
+            bool hasCksumField = false;
+
+            for (int i = 0; i < proto->fieldCount(); i++)
+            {
+                AbstractProtocol::FieldFlags flags = proto->fieldFlags(i);
+
+                if (!flags.testFlag(AbstractProtocol::FrameField))
+                    continue;
+
+                if (flags.testFlag(AbstractProtocol::CksumField))
+                    hasCksumField = true;
+                else if (proto->isFieldFrameValueVariable(i))
+                    hasVariableField = true;
+            }
+
+            if (hasVariableField)
+            {
+                if (proto->appendProtocolFrameVariation(mProtocolVariation,
+                            patch.offset))
+                {
+                    if (variationOffset < 0)
+                        variationOffset = patch.offset;
+                }
+                else
+                    isRewriteNeeded = true;
+            }
+
+            if (hasCksumField)
+                mCksumPatches.append(patch);
+            else if (hasVariableField)
+                mFramePatches.append(patch);
+        }
+
+        mFrameTemplate.resize(patch.offset + size);
+        if (proto->writeProtocolFrameValue((uchar*) mFrameTemplate.data(),
+                    mFrameTemplate.size(), patch.offset) != size)
+        {
+            qDebug("%s: protocol %d size mismatch", __FUNCTION__,
+                    proto->protocolNumber());
+            return;
+        }
+    }
+
+    if (isRewriteNeeded)
+    {
+        // The checksums of the varied protocols may depend on the
+        // protocols being rewritten - so rewrite them too
+        mProtocolVariation.clear();
+    }
+    else if (!mProtocolVariation.isNull())
+    {
+        QVector<FrameLayer> cksumPatches;
+
+        // All the patches are varied incrementally
+        mFramePatches.clear();
+        for (int i = 0; i < mCksumPatches.size(); i++)
+        {
+            if (mCksumPatches.at(i).offset < variationOffset)
+                cksumPatches.append(mCksumPatches.at(i));
+        }
+        mCksumPatches = cksumPatches;
+    }
+
+    // Pad with zero, if required
+    if (mFrameTemplate.size() < pktLen)
+        mFrameTemplate.append(QByteArray(pktLen - mFrameTemplate.size(), 0));
+
+    mIsFrameTemplateUsable = true;
+
+    if (mFramePatches.isEmpty() && mCksumPatches.isEmpty())
+    {
+        mIsFrameVariationComplete = true;
+        mFrameVariation = mProtocolVariation;
+        mFrameVariation.append(mFlowVariation);
+    }
+
+    qDebug("%s: template %d bytes, %d patches, %d cksum patches, "
+            "%d varied fields", __FUNCTION__, mFrameTemplate.size(),
+            mFramePatches.size(), mCksumPatches.size(),
+            mProtocolVariation.fieldCount());
+}
+
+/*!
+  Rebuilds the flat layer array - the top level protocols of the frame in
+  order with their offsets and sizes - so that protocol offsets and payload
+  sizes can be looked up instead of walking the protocol list and asking
+  every protocol for its size on every call
+
+  The array is usable only if none of the protocol sizes vary from frame to
+  frame
+*/
+void StreamBase::updateFrameLayers() const
+{
+    int offset = 0;
+
+    mFrameLayers.clear();
+    mFrameLayersLength = 0;
+    mIsFrameLayersUsable = false;
+
+    if (isFrameSizeVariable())
+        return;
+
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+    {
+        FrameLayer layer;
+
+        layer.proto = proto;
+        layer.offset = offset;
+        layer.size = proto->protocolFrameSize();
+        mFrameLayers.append(layer);
+
+        offset += layer.size;
+    }
+
+    mFrameLayersLength = offset;
+    mIsFrameLayersUsable = true;
+}
+
+/*!
+  Compiles the flow set of the stream into frame variation fields at the
+  position of the protocols in the layer array - IP addresses go into the
+  innermost IPv4/IPv6 header preceding the first TCP/UDP header (for IPv6,
+  the lower 64 bits of the address), ports into the first TCP/UDP header
+  and the VLAN id into the first VLAN tag
+
+  The checksums covering a flow set field - IPv4 header checksum and the
+  TCP/UDP checksum which includes the addresses via the pseudo header - are
+  updated alongwith the field unless the checksum is overridden by the user
+
+  Only the protocols at the same offset in every frame can carry the
+  fields - all of them for a fixed size protocol stack, else those before
+  the first protocol of variable size; so a payload that follows the frame
+  length is fine. A field with no protocol to go into is ignored - the
+  reason is in mFlowSetWarnings for preflightCheck()
+*/
+void StreamBase::compileFrameVariation() const
+{
+    const OstProto::StreamFlowRange *ranges[] = {
+        mFlowSet->has_src_ip() ? &mFlowSet->src_ip() : NULL,
+        mFlowSet->has_dst_ip() ? &mFlowSet->dst_ip() : NULL,
+        mFlowSet->has_src_port() ? &mFlowSet->src_port() : NULL,
+        mFlowSet->has_dst_port() ? &mFlowSet->dst_port() : NULL,
+        mFlowSet->has_vlan_id() ? &mFlowSet->vlan_id() : NULL
+    };
+    int l4 = -1, ip = -1, vlan = -1;
+    int ipOfs = 0, l4Ofs = 0, l4CksumOfs = -1;
+    bool isIp6 = false, isUdp = false;
+    bool hasIpCksum = false;
+    quint64 divisor = 1;
+    quint64 period;
+    QVector<FrameLayer> layers;
+
+    mFlowVariation.clear();
+    mFlowSetWarnings.clear();
+
+    if (!hasFlowSet())
+        return;
+
+    period = flowCount();
+
+    if (mIsFrameLayersUsable)
+        layers = mFrameLayers;
+    else
+    {
+        int offset = 0;
+
+        foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+        {
+            FrameLayer layer;
+
+            if (proto->isProtocolFrameSizeVariable())
+                break;
+
+            layer.proto = proto;
+            layer.offset = offset;
+            layer.size = proto->protocolFrameSize();
+            layers.append(layer);
+
+            offset += layer.size;
+        }
+    }
+
+    // Locate the protocols carrying the flow set fields
+    for (int i = 0; i < layers.size(); i++)
+    {
+        switch (layers.at(i).proto->protocolNumber())
+        {
+        case OstProto::Protocol::kVlanFieldNumber:
+        case OstProto::Protocol::kSvlanFieldNumber:
+            if (vlan < 0)
+                vlan = i;
+            break;
+        case OstProto::Protocol::kIp4FieldNumber:
+        case OstProto::Protocol::kIp6FieldNumber:
+            ip = i;
+            break;
+        case OstProto::Protocol::kTcpFieldNumber:
+        case OstProto::Protocol::kUdpFieldNumber:
+            l4 = i;
+            break;
+        default:
+            break;
+        }
+
+        if (l4 >= 0)
+            break;
+    }
+
+    if (ip >= 0)
+    {
+        const AbstractProtocol *proto = layers.at(ip).proto;
+
+        ipOfs = layers.at(ip).offset;
+        isIp6 = (proto->protocolNumber()
+                    == OstProto::Protocol::kIp6FieldNumber);
+        hasIpCksum = !isIp6 && proto->canFixupProtocolFrameCksum();
+    }
+
+    if (l4 >= 0)
+    {
+        const AbstractProtocol *proto = layers.at(l4).proto;
+
+        l4Ofs = layers.at(l4).offset;
+        isUdp = (proto->protocolNumber()
+                    == OstProto::Protocol::kUdpFieldNumber);
+        if (proto->canFixupProtocolFrameCksum())
+            l4CksumOfs = l4Ofs + (isUdp ? 6 : 16);
+    }
+
+    for (uint i = 0; i < sizeof(ranges)/sizeof(ranges[0]); i++)
+    {
+        const OstProto::StreamFlowRange *range = ranges[i];
+        quint64 count;
+        int field;
+
+        if (!range)
+            continue;
+
+        count = qMax(quint64(range->count()), quint64(1));
+
+        switch (i)
+        {
+        case 0: // src ip
+        case 1: // dst ip
+            if (ip < 0)
+            {
+                mFlowSetWarnings += "Flow set addresses ignored - no IP "
+                    "header at a fixed offset in every frame.\n";
+                continue;
+            }
+            if (isIp6)
+                field = mFlowVariation.addField(ipOfs + (i ? 32 : 16), 8,
+                        ~Q_UINT64_C(0), FrameVariation::kIncrement,
+                        range->start(), count, range->step(), divisor, period);
+            else
+                field = mFlowVariation.addField(ipOfs + (i ? 16 : 12), 4,
+                        0xFFFFFFFF, FrameVariation::kIncrement,
+                        range->start(), count, range->step(), divisor, period);
+            if (hasIpCksum)
+                mFlowVariation.addFieldCksum(field, ipOfs + 10, ipOfs);
+            // pseudo header - parity is same as that of the IP header
+            if (l4CksumOfs >= 0)
+                mFlowVariation.addFieldCksum(field, l4CksumOfs, ipOfs,
+                        isUdp);
+            break;
+
+        case 2: // src port
+        case 3: // dst port
+            if (l4 < 0)
+            {
+                mFlowSetWarnings += "Flow set ports ignored - no TCP/UDP "
+                    "header at a fixed offset in every frame.\n";
+                continue;
+            }
+            field = mFlowVariation.addField(l4Ofs + (i - 2) * 2, 2, 0xFFFF,
+                    FrameVariation::kIncrement, range->start(), count,
+                    range->step(), divisor, period);
+            if (l4CksumOfs >= 0)
+                mFlowVariation.addFieldCksum(field, l4CksumOfs, l4Ofs,
+                        isUdp);
+            break;
+
+        case 4: // vlan id
+            if (vlan < 0)
+            {
+                mFlowSetWarnings += "Flow set VLAN id ignored - no VLAN "
+                    "tag at a fixed offset in every frame.\n";
+                continue;
+            }
+            mFlowVariation.addField(layers.at(vlan).offset + 2, 2,
+                    0x0FFF, FrameVariation::kIncrement, range->start(),
+                    count, range->step(), divisor, period);
+            break;
+
+        default:
+            Q_ASSERT(false); // Unreachable!
+            break;
         }
 
-        if (frameLen(i) > 1522)
+        // Cartesian product - each range varies only after all the
+        // combinations of the preceding ranges are exhausted
+        if (mFlowSet->order() == OstProto::StreamFlowSet::e_fo_cartesian)
+            divisor = qMin(divisor * count, quint64(INT_MAX));
+    }
+
+    if (!mFlowSetWarnings.isEmpty())
+        qWarning("%s: %s", __FUNCTION__, qPrintable(mFlowSetWarnings));
+
+    qDebug("%s: %d flow set fields, %llu flows", __FUNCTION__,
+            mFlowVariation.fieldCount(), period);
+}
+
+/*!
+  Drops the compiled frame template so that it is recompiled on next use
+
+  Must be called after modifying any of the stream's protocols in place -
+  see compileFrameTemplate()
+*/
+void StreamBase::invalidateFrameTemplate() const
+{
+    mIsFrameTemplateValid = false;
+    mIsFrameLayersUsable = false;
+    mFrameTemplateGeneration++;
+}
+
+/*!
+  Returns a number that changes whenever the frames of the stream may have
+  changed - protocols that cache values per frame index can compare it
+  with the number at the time of caching to know when to drop the cache
+*/
+uint StreamBase::frameGeneration() const
+{
+    return mFrameTemplateGeneration;
+}
+
+/*!
+  Checks the stream for frames which may be truncated or are jumbo frames
+
+  The check is done analytically using the frame length range and the
+  protocol size ranges - so it doesn't depend on the number of frames
+*/
+bool StreamBase::preflightCheck(QString &result) const
+{
+    bool pass = true;
+    int minLen, maxLen;
+    int protoLen = 0;
+
+    frameLenRange(minLen, maxLen);
+
+    foreach (const AbstractProtocol* proto, *currentFrameProtocols)
+    {
+        int minSize, maxSize;
+
+        proto->protocolFrameSizeRange(minSize, maxSize);
+        protoLen += maxSize;
+    }
+
+    if (minLen < (protoLen + kFcsSize))
+    {
+        result += QString("One or more frames may be truncated - "
+            "frame length should be at least %1.\n")
+            .arg(protoLen + kFcsSize);
+        pass = false;
+    }
+
+    if (maxLen > 1522)
+    {
+        result += QString("Jumbo frames may be truncated or dropped "
+            "if not supported by the hardware\n");
+        pass = false;
+    }
+
+    if (hasFlowSet())
+    {
+        if (!mIsFrameTemplateValid)
+            compileFrameTemplate();
+
+        if (!mFlowSetWarnings.isEmpty())
         {
-            result += QString("Jumbo frames may be truncated or dropped "
-                "if not supported by the hardware\n");
+            result += mFlowSetWarnings;
             pass = false;
         }
     }
@@ -20,12 +20,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #ifndef _STREAM_BASE_H
 #define _STREAM_BASE_H
 
+#include <QByteArray>
 #include <QString>
 #include <QLinkedList>
+#include <QVector>
 
+#include "framevariation.h"
 #include "protocol.pb.h"
 
 const int kFcsSize = 4;
+const int kMaxCksumFixups = 8;
 
 class AbstractProtocol;
 class ProtocolList;
@@ -37,9 +41,48 @@ private:
     OstProto::StreamId         *mStreamId;
     OstProto::StreamCore     *mCore;
     OstProto::StreamControl    *mControl;
+    OstProto::StreamFlowSet    *mFlowSet;
+    OstProto::StreamReplay    *mReplay;
 
     ProtocolList            *currentFrameProtocols;
 
+    //! A top level protocol of the frame alongwith its position
+    struct FrameLayer {
+        const AbstractProtocol *proto;
+        int offset;     //!< offset of protocol from start of frame
+        int size;       //!< size of protocol
+    };
+
+    // Compiled frame template - see compileFrameTemplate()
+    mutable bool                    mIsFrameTemplateValid;
+    mutable bool                    mIsFrameTemplateUsable;
+    mutable uint                    mFrameTemplateGeneration;
+    mutable QByteArray              mFrameTemplate;
+    mutable QVector<FrameLayer>     mFramePatches;
+    mutable QVector<FrameLayer>     mCksumPatches;
+    mutable FrameVariation          mProtocolVariation;
+
+    // Flat layer array - valid only for fixed size protocol stacks
+    mutable bool                    mIsFrameLayersUsable;
+    mutable int                     mFrameLayersLength;
+    mutable QVector<FrameLayer>     mFrameLayers;
+
+    // Flow set fields - compiled alongwith the frame template
+    mutable FrameVariation          mFlowVariation;
+    mutable QString                 mFlowSetWarnings;   //!< fields ignored
+
+    // Variation that can be applied while transmitting - see frameVariation()
+    mutable bool                    mIsFrameVariationComplete;
+    mutable FrameVariation          mFrameVariation;
+
+    void compileFrameTemplate() const;
+    void updateFrameLayers() const;
+    void compileFrameVariation() const;
+    int writeFrame(uchar *buf, int bufMaxSize, int frameIndex,
+            uint *templateGeneration) const;
+
+    friend class FrameCursor;
+
 public:
     StreamBase();
     ~StreamBase();
@@ -48,6 +91,9 @@ public:
     void protoDataCopyInto(OstProto::Stream &stream) const;
 
     ProtocolListIterator* createProtocolListIterator() const;
+    void invalidateFrameTemplate() const;
+    bool frameLayerPosition(const AbstractProtocol *proto, int &offset,
+            int &payloadSize) const;
 
     //! \todo (LOW) should we have a copy constructor??
 
@@ -108,6 +154,11 @@ public:
     bool setFrameLenMax(quint16 frameLenMax);
 
     quint16 frameLenAvg() const;
+    void frameLenRange(int &minLen, int &maxLen) const;
+
+    quint32 randomSeed() const;
+    bool setRandomSeed(quint32 seed);
+    quint64 randomKey(quint32 fieldKey) const;
 
     SendUnit sendUnit() const;
     bool setSendUnit(SendUnit sendUnit);
@@ -136,12 +187,24 @@ public:
     double averagePacketRate() const;
     bool setAveragePacketRate(double packetsPerSec);
 
+    bool hasReplay() const;
+    const OstProto::StreamReplay& replay() const;
+
+    bool hasFlowSet() const;
+    quint64 flowCount() const;
+    const FrameVariation* frameVariation() const;
+    int frameVariationBaseCount() const;
+
     bool isFrameVariable() const;
+    bool isFrameProtocolVariable() const;
     bool isFrameSizeVariable() const;
+    bool isFrameCostly() const;
     int frameVariableCount() const;
+    int frameProtocolVariableCount() const;
     int frameProtocolLength(int frameIndex) const;
     int frameCount() const;
     int frameValue(uchar *buf, int bufMaxSize, int frameIndex) const;
+    uint frameGeneration() const;
     bool preflightCheck(QString &result) const;
 
     static bool StreamLessThan(StreamBase* stream1, StreamBase* stream2);
@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "tcp.h"
 
+#include "framevariation.h"
+
 
 TcpProtocol::TcpProtocol(StreamBase *stream, AbstractProtocol *parent)
     : AbstractProtocol(stream, parent)
@@ -113,6 +115,12 @@ AbstractProtocol::FieldFlags TcpProtocol::fieldFlags(int index) const
         case tcp_is_override_dst_port:
         case tcp_is_override_hdrlen:
         case tcp_is_override_cksum:
+        case tcp_src_port_mode:
+        case tcp_src_port_count:
+        case tcp_src_port_step:
+        case tcp_dst_port_mode:
+        case tcp_dst_port_count:
+        case tcp_dst_port_step:
             flags &= ~FrameField;
             flags |= MetaField;
             break;
@@ -144,6 +152,8 @@ QVariant TcpProtocol::fieldData(int index, FieldAttrib attrib,
                         srcPort = data.src_port();
                     else
                         srcPort = payloadProtocolId(ProtocolIdTcpUdp);
+                    srcPort = portFrameValue(tcp_src_port, srcPort,
+                            streamIndex);
                     break;
                 default:
                     srcPort = 0; // avoid the 'maybe used unitialized' warning
@@ -182,6 +192,8 @@ QVariant TcpProtocol::fieldData(int index, FieldAttrib attrib,
                         dstPort = data.dst_port();
                     else
                         dstPort = payloadProtocolId(ProtocolIdTcpUdp);
+                    dstPort = portFrameValue(tcp_dst_port, dstPort,
+                            streamIndex);
                     break;
                 default:
                     dstPort = 0; // avoid the 'maybe used unitialized' warning
@@ -462,6 +474,48 @@ QVariant TcpProtocol::fieldData(int index, FieldAttrib attrib,
             }
             break;
         }
+        case tcp_src_port_mode:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_mode();
+                default: break;
+            }
+            break;
+        case tcp_src_port_count:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_count();
+                default: break;
+            }
+            break;
+        case tcp_src_port_step:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_step();
+                default: break;
+            }
+            break;
+        case tcp_dst_port_mode:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_mode();
+                default: break;
+            }
+            break;
+        case tcp_dst_port_count:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_count();
+                default: break;
+            }
+            break;
+        case tcp_dst_port_step:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_step();
+                default: break;
+            }
+            break;
         default:
             qFatal("%s: unimplemented case %d in switch", __PRETTY_FUNCTION__,
                 index);
@@ -577,6 +631,52 @@ bool TcpProtocol::setFieldData(int index, const QVariant &value,
             isOk = true;
             break;
         }
+        case tcp_src_port_mode:
+        {
+            uint mode = value.toUInt(&isOk);
+            if (isOk && data.PortMode_IsValid(mode))
+                data.set_src_port_mode(OstProto::Tcp::PortMode(mode));
+            else
+                isOk = false;
+            break;
+        }
+        case tcp_src_port_count:
+        {
+            uint count = value.toUInt(&isOk);
+            if (isOk)
+                data.set_src_port_count(count);
+            break;
+        }
+        case tcp_src_port_step:
+        {
+            uint step = value.toUInt(&isOk);
+            if (isOk)
+                data.set_src_port_step(step);
+            break;
+        }
+        case tcp_dst_port_mode:
+        {
+            uint mode = value.toUInt(&isOk);
+            if (isOk && data.PortMode_IsValid(mode))
+                data.set_dst_port_mode(OstProto::Tcp::PortMode(mode));
+            else
+                isOk = false;
+            break;
+        }
+        case tcp_dst_port_count:
+        {
+            uint count = value.toUInt(&isOk);
+            if (isOk)
+                data.set_dst_port_count(count);
+            break;
+        }
+        case tcp_dst_port_step:
+        {
+            uint step = value.toUInt(&isOk);
+            if (isOk)
+                data.set_dst_port_step(step);
+            break;
+        }
 
         default:
             qFatal("%s: unimplemented case %d in switch", __PRETTY_FUNCTION__,
@@ -590,6 +690,10 @@ _exit:
 
 bool TcpProtocol::isProtocolFrameValueVariable() const
 {
+    if ((data.src_port_mode() != OstProto::Tcp::e_pm_fixed)
+            || (data.dst_port_mode() != OstProto::Tcp::e_pm_fixed))
+        return true;
+
     if (data.is_override_cksum())
         return false;
     else
@@ -598,9 +702,172 @@ bool TcpProtocol::isProtocolFrameValueVariable() const
 
 int TcpProtocol::protocolFrameVariableCount() const
 {
+    int count = 1;
+
+    if (data.src_port_mode() != OstProto::Tcp::e_pm_fixed)
+        count = AbstractProtocol::lcm(count, data.src_port_count());
+
+    if (data.dst_port_mode() != OstProto::Tcp::e_pm_fixed)
+        count = AbstractProtocol::lcm(count, data.dst_port_count());
+
     if (data.is_override_cksum())
-        return 1;
+        return count;
 
-    return protocolFramePayloadVariableCount();
+    return AbstractProtocol::lcm(count, protocolFramePayloadVariableCount());
 }
 
+bool TcpProtocol::isFieldFrameValueVariable(int index) const
+{
+    switch (index)
+    {
+        case tcp_src_port:
+            return (data.src_port_mode() != OstProto::Tcp::e_pm_fixed);
+        case tcp_dst_port:
+            return (data.dst_port_mode() != OstProto::Tcp::e_pm_fixed);
+        default:
+            break;
+    }
+
+    return false;
+}
+
+/*!
+  Varies the src/dst ports as per their mode - the checksum is updated
+  incrementally unless overridden
+*/
+bool TcpProtocol::appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const
+{
+    for (int index = tcp_src_port; index <= tcp_dst_port; index++)
+    {
+        OstProto::Tcp::PortMode mode;
+        quint16 port;
+        uint count, step;
+        int field;
+
+        if (index == tcp_src_port)
+        {
+            mode = data.src_port_mode();
+            port = data.is_override_src_port() ? data.src_port()
+                    : payloadProtocolId(ProtocolIdTcpUdp);
+            count = data.src_port_count();
+            step = data.src_port_step();
+        }
+        else
+        {
+            mode = data.dst_port_mode();
+            port = data.is_override_dst_port() ? data.dst_port()
+                    : payloadProtocolId(ProtocolIdTcpUdp);
+            count = data.dst_port_count();
+            step = data.dst_port_step();
+        }
+
+        if (mode == OstProto::Tcp::e_pm_fixed)
+            continue;
+
+        field = variation.addField(offset + 2*index, 2, 0xFFFF,
+                mode == OstProto::Tcp::e_pm_dec ? FrameVariation::kDecrement
+                : mode == OstProto::Tcp::e_pm_random ? FrameVariation::kRandom
+                : FrameVariation::kIncrement,
+                port, count ? count : 1, step, 1, 0, fieldRandomKey(index));
+        if (!data.is_override_cksum())
+            variation.addFieldCksum(field, offset + 16, offset);
+    }
+
+    return true;
+}
+
+/*!
+  Returns the value of the src or dst port (index) for the frame
+  streamIndex derived from 'port' as per the port mode
+*/
+quint16 TcpProtocol::portFrameValue(int index, quint16 port,
+        int streamIndex) const
+{
+    OstProto::Tcp::PortMode mode;
+    uint count, step;
+
+    if (index == tcp_src_port)
+    {
+        mode = data.src_port_mode();
+        count = data.src_port_count();
+        step = data.src_port_step();
+    }
+    else
+    {
+        mode = data.dst_port_mode();
+        count = data.dst_port_count();
+        step = data.dst_port_step();
+    }
+
+    if (count == 0)
+        count = 1;
+
+    switch (mode)
+    {
+        case OstProto::Tcp::e_pm_fixed:
+            break;
+        case OstProto::Tcp::e_pm_inc:
+            port += (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Tcp::e_pm_dec:
+            port -= (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Tcp::e_pm_random:
+            port += (fieldFrameRandom(index, streamIndex) % count) * step;
+            break;
+        default:
+            qWarning("Unhandled port mode = %d", mode);
+            break;
+    }
+
+    return port;
+}
+
+int TcpProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool forCksum) const
+{
+    uchar *p = buf + offset;
+    quint16 cksum;
+
+    if ((offset + 20) > bufMaxSize)
+        return -1;
+
+    qToBigEndian(quint16(fieldData(tcp_src_port, FieldValue, streamIndex)
+                .toUInt()), p);
+    qToBigEndian(quint16(fieldData(tcp_dst_port, FieldValue, streamIndex)
+                .toUInt()), p + 2);
+    qToBigEndian(quint32(data.seq_num()), p + 4);
+    qToBigEndian(quint32(data.ack_num()), p + 8);
+    p[12] = ((fieldData(tcp_hdrlen, FieldValue, streamIndex).toUInt() & 0x0F)
+                << 4)
+        | (data.hdrlen_rsvd() & 0x0F);
+    p[13] = data.flags() & 0x3F;
+    qToBigEndian(quint16(data.window()), p + 14);
+    qToBigEndian(quint16(data.urg_ptr()), p + 18);
+
+    if (forCksum)
+        cksum = 0;
+    else if (data.is_override_cksum())
+        cksum = data.cksum();
+    else
+        cksum = protocolFrameCksum(streamIndex, CksumTcpUdp);
+    qToBigEndian(cksum, p + 16);
+
+    return 20;
+}
+
+bool TcpProtocol::canFixupProtocolFrameCksum() const
+{
+    return !data.is_override_cksum();
+}
+
+void TcpProtocol::fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex) const
+{
+    if ((offset + 20) > frameLen)
+        return;
+
+    qToBigEndian(quint16(protocolFrameBufferCksum(frame, frameLen, offset,
+                    streamIndex, CksumTcpUdp)), frame + offset + 16);
+}
@@ -52,6 +52,13 @@ public:
         tcp_is_override_hdrlen,
         tcp_is_override_cksum,
 
+        tcp_src_port_mode,
+        tcp_src_port_count,
+        tcp_src_port_step,
+        tcp_dst_port_mode,
+        tcp_dst_port_count,
+        tcp_dst_port_step,
+
         tcp_fieldCount
     };
 
@@ -79,10 +86,22 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+    virtual bool canFixupProtocolFrameCksum() const;
+    virtual void fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex = 0) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
 
 private:
+    quint16 portFrameValue(int index, quint16 port, int streamIndex) const;
+
     OstProto::Tcp    data;
 };
 
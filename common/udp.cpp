@@ -19,6 +19,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "udp.h"
 
+#include "framevariation.h"
+
+// A computed checksum of 0 goes out as all ones - 0 means no checksum
+// (RFC 768)
+static inline quint16 nonZeroCksum(quint16 cksum)
+{
+    return cksum ? cksum : 0xFFFF;
+}
+
 UdpProtocol::UdpProtocol(StreamBase *stream, AbstractProtocol *parent)
     : AbstractProtocol(stream, parent)
 {
@@ -104,6 +113,12 @@ AbstractProtocol::FieldFlags UdpProtocol::fieldFlags(int index) const
         case udp_isOverrideDstPort:
         case udp_isOverrideTotLen:
         case udp_isOverrideCksum:
+        case udp_srcPortMode:
+        case udp_srcPortCount:
+        case udp_srcPortStep:
+        case udp_dstPortMode:
+        case udp_dstPortCount:
+        case udp_dstPortStep:
             flags &= ~FrameField;
             flags |= MetaField;
             break;
@@ -135,6 +150,8 @@ QVariant UdpProtocol::fieldData(int index, FieldAttrib attrib,
                         srcPort = data.src_port();
                     else
                         srcPort = payloadProtocolId(ProtocolIdTcpUdp);
+                    srcPort = portFrameValue(udp_srcPort, srcPort,
+                            streamIndex);
                     break;
                 default:
                     srcPort = 0; // avoid the 'maybe used unitialized' warning
@@ -173,6 +190,8 @@ QVariant UdpProtocol::fieldData(int index, FieldAttrib attrib,
                         dstPort = data.dst_port();
                     else
                         dstPort = payloadProtocolId(ProtocolIdTcpUdp);
+                    dstPort = portFrameValue(udp_dstPort, dstPort,
+                            streamIndex);
                     break;
                 default:
                     dstPort = 0; // avoid the 'maybe used unitialized' warning
@@ -253,8 +272,8 @@ QVariant UdpProtocol::fieldData(int index, FieldAttrib attrib,
                     if (data.is_override_cksum())
                         cksum = data.cksum();
                     else
-                        cksum = protocolFrameCksum(streamIndex, CksumTcpUdp);
-                    qDebug("UDP cksum = %hu", cksum);
+                        cksum = nonZeroCksum(protocolFrameCksum(streamIndex,
+                                    CksumTcpUdp));
                     break;
                 }
                 default:
@@ -332,6 +351,48 @@ QVariant UdpProtocol::fieldData(int index, FieldAttrib attrib,
             }
             break;
         }
+        case udp_srcPortMode:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_mode();
+                default: break;
+            }
+            break;
+        case udp_srcPortCount:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_count();
+                default: break;
+            }
+            break;
+        case udp_srcPortStep:
+            switch(attrib)
+            {
+                case FieldValue: return data.src_port_step();
+                default: break;
+            }
+            break;
+        case udp_dstPortMode:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_mode();
+                default: break;
+            }
+            break;
+        case udp_dstPortCount:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_count();
+                default: break;
+            }
+            break;
+        case udp_dstPortStep:
+            switch(attrib)
+            {
+                case FieldValue: return data.dst_port_step();
+                default: break;
+            }
+            break;
 
         default:
             qFatal("%s: unimplemented case %d in switch", __PRETTY_FUNCTION__,
@@ -376,6 +437,52 @@ bool UdpProtocol::setFieldData(int index, const QVariant& value,
             isOk = true;
             break;
         }
+        case udp_srcPortMode:
+        {
+            uint mode = value.toUInt(&isOk);
+            if (isOk && data.PortMode_IsValid(mode))
+                data.set_src_port_mode(OstProto::Udp::PortMode(mode));
+            else
+                isOk = false;
+            break;
+        }
+        case udp_srcPortCount:
+        {
+            uint count = value.toUInt(&isOk);
+            if (isOk)
+                data.set_src_port_count(count);
+            break;
+        }
+        case udp_srcPortStep:
+        {
+            uint step = value.toUInt(&isOk);
+            if (isOk)
+                data.set_src_port_step(step);
+            break;
+        }
+        case udp_dstPortMode:
+        {
+            uint mode = value.toUInt(&isOk);
+            if (isOk && data.PortMode_IsValid(mode))
+                data.set_dst_port_mode(OstProto::Udp::PortMode(mode));
+            else
+                isOk = false;
+            break;
+        }
+        case udp_dstPortCount:
+        {
+            uint count = value.toUInt(&isOk);
+            if (isOk)
+                data.set_dst_port_count(count);
+            break;
+        }
+        case udp_dstPortStep:
+        {
+            uint step = value.toUInt(&isOk);
+            if (isOk)
+                data.set_dst_port_step(step);
+            break;
+        }
         case udp_srcPort:
         {
             uint srcPort = value.toUInt(&isOk);
@@ -416,6 +523,10 @@ _exit:
 
 bool UdpProtocol::isProtocolFrameValueVariable() const
 {
+    if ((data.src_port_mode() != OstProto::Udp::e_pm_fixed)
+            || (data.dst_port_mode() != OstProto::Udp::e_pm_fixed))
+        return true;
+
     if (data.is_override_totlen() && data.is_override_cksum())
         return false;
     else
@@ -424,8 +535,166 @@ bool UdpProtocol::isProtocolFrameValueVariable() const
 
 int UdpProtocol::protocolFrameVariableCount() const
 {
+    int count = 1;
+
+    if (data.src_port_mode() != OstProto::Udp::e_pm_fixed)
+        count = AbstractProtocol::lcm(count, data.src_port_count());
+
+    if (data.dst_port_mode() != OstProto::Udp::e_pm_fixed)
+        count = AbstractProtocol::lcm(count, data.dst_port_count());
+
     if (data.is_override_totlen() && data.is_override_cksum())
-        return 1;
+        return count;
+
+    return AbstractProtocol::lcm(count, protocolFramePayloadVariableCount());
+}
+
+bool UdpProtocol::isFieldFrameValueVariable(int index) const
+{
+    switch (index)
+    {
+        case udp_srcPort:
+            return (data.src_port_mode() != OstProto::Udp::e_pm_fixed);
+        case udp_dstPort:
+            return (data.dst_port_mode() != OstProto::Udp::e_pm_fixed);
+        default:
+            break;
+    }
+
+    return false;
+}
+
+/*!
+  Varies the src/dst ports as per their mode - the checksum is updated
+  incrementally unless overridden
+*/
+bool UdpProtocol::appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const
+{
+    for (int index = udp_srcPort; index <= udp_dstPort; index++)
+    {
+        OstProto::Udp::PortMode mode;
+        quint16 port;
+        uint count, step;
+        int field;
+
+        if (index == udp_srcPort)
+        {
+            mode = data.src_port_mode();
+            port = data.is_override_src_port() ? data.src_port()
+                    : payloadProtocolId(ProtocolIdTcpUdp);
+            count = data.src_port_count();
+            step = data.src_port_step();
+        }
+        else
+        {
+            mode = data.dst_port_mode();
+            port = data.is_override_dst_port() ? data.dst_port()
+                    : payloadProtocolId(ProtocolIdTcpUdp);
+            count = data.dst_port_count();
+            step = data.dst_port_step();
+        }
+
+        if (mode == OstProto::Udp::e_pm_fixed)
+            continue;
+
+        field = variation.addField(offset + 2*index, 2, 0xFFFF,
+                mode == OstProto::Udp::e_pm_dec ? FrameVariation::kDecrement
+                : mode == OstProto::Udp::e_pm_random ? FrameVariation::kRandom
+                : FrameVariation::kIncrement,
+                port, count ? count : 1, step, 1, 0, fieldRandomKey(index));
+        if (!data.is_override_cksum())
+            variation.addFieldCksum(field, offset + 6, offset, true);
+    }
+
+    return true;
+}
+
+/*!
+  Returns the value of the src or dst port (index) for the frame
+  streamIndex derived from 'port' as per the port mode
+*/
+quint16 UdpProtocol::portFrameValue(int index, quint16 port,
+        int streamIndex) const
+{
+    OstProto::Udp::PortMode mode;
+    uint count, step;
+
+    if (index == udp_srcPort)
+    {
+        mode = data.src_port_mode();
+        count = data.src_port_count();
+        step = data.src_port_step();
+    }
+    else
+    {
+        mode = data.dst_port_mode();
+        count = data.dst_port_count();
+        step = data.dst_port_step();
+    }
+
+    if (count == 0)
+        count = 1;
+
+    switch (mode)
+    {
+        case OstProto::Udp::e_pm_fixed:
+            break;
+        case OstProto::Udp::e_pm_inc:
+            port += (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Udp::e_pm_dec:
+            port -= (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Udp::e_pm_random:
+            port += (fieldFrameRandom(index, streamIndex) % count) * step;
+            break;
+        default:
+            qWarning("Unhandled port mode = %d", mode);
+            break;
+    }
+
+    return port;
+}
+
+int UdpProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool forCksum) const
+{
+    uchar *p = buf + offset;
+    quint16 cksum;
+
+    if ((offset + 8) > bufMaxSize)
+        return -1;
+
+    qToBigEndian(quint16(fieldData(udp_srcPort, FieldValue, streamIndex)
+                .toUInt()), p);
+    qToBigEndian(quint16(fieldData(udp_dstPort, FieldValue, streamIndex)
+                .toUInt()), p + 2);
+    qToBigEndian(quint16(fieldData(udp_totLen, FieldValue, streamIndex)
+                .toUInt()), p + 4);
+
+    if (forCksum)
+        cksum = 0;
+    else if (data.is_override_cksum())
+        cksum = data.cksum();
+    else
+        cksum = nonZeroCksum(protocolFrameCksum(streamIndex, CksumTcpUdp));
+    qToBigEndian(cksum, p + 6);
+
+    return 8;
+}
+
+bool UdpProtocol::canFixupProtocolFrameCksum() const
+{
+    return !data.is_override_cksum();
+}
+
+void UdpProtocol::fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex) const
+{
+    if ((offset + 8) > frameLen)
+        return;
 
-    return protocolFramePayloadVariableCount();
+    qToBigEndian(nonZeroCksum(protocolFrameBufferCksum(frame, frameLen,
+                    offset, streamIndex, CksumTcpUdp)), frame + offset + 6);
 }
@@ -38,6 +38,13 @@ public:
         udp_isOverrideTotLen,
         udp_isOverrideCksum,
 
+        udp_srcPortMode,
+        udp_srcPortCount,
+        udp_srcPortStep,
+        udp_dstPortMode,
+        udp_dstPortCount,
+        udp_dstPortStep,
+
         udp_fieldCount
     };
 
@@ -65,10 +72,22 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+    virtual bool canFixupProtocolFrameCksum() const;
+    virtual void fixupProtocolFrameCksum(uchar *frame, int frameLen,
+        int offset, int streamIndex = 0) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+
     virtual bool isProtocolFrameValueVariable() const;
     virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
 
 private:
+    quint16 portFrameValue(int index, quint16 port, int streamIndex) const;
+
     OstProto::Udp    data;
 };
 
@@ -19,26 +19,49 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "userscript.h"
 
+#include "streambase.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+// Max bytes of script results remembered - counting kMemoEntrySize bytes
+// of bookkeeping per result alongwith the frame value bytes
+static const int kMaxMemoBytes = 4 << 20;
+static const int kMemoEntrySize = 32;
+
+// Frames requested per protocolFrameValues() call
+static const int kFrameValuesBatchSize = 256;
+
 //
 // -------------------- UserScriptProtocol --------------------
 //
 
 UserScriptProtocol::UserScriptProtocol(StreamBase *stream, AbstractProtocol *parent)
     : AbstractProtocol(stream, parent),
-        userProtocol_(this)
+        userProtocol_(this), threadEngineReaper_(this)
 {
     isScriptValid_ = false;
+    hasFrameValuesFunction_ = false;
     errorLineNumber_ = 0;
+    memoGeneration_ = 0;
+    memoBytes_ = 0;
+    programGeneration_ = 0;
+    ownerThread_ = QThread::currentThread();
 
-    userProtocolScriptValue_ = engine_.newQObject(&userProtocol_);
-    engine_.globalObject().setProperty("protocol", userProtocolScriptValue_);
-
-    QScriptValue meta = engine_.newQMetaObject(userProtocol_.metaObject());
-    engine_.globalObject().setProperty("Protocol", meta);
+    userProtocolScriptValue_ = initEngine(&engine_, &userProtocol_);
 }
 
 UserScriptProtocol::~UserScriptProtocol()
 {
+    QMutexLocker locker(&threadEngineMutex_);
+
+    // A thread finishing right now must not drop an engine deleted here
+    foreach (QThread *thread, threadEngines_.keys())
+        QObject::disconnect(thread, SIGNAL(finished()),
+                &threadEngineReaper_, SLOT(reap()));
+
+    qDeleteAll(threadEngines_);
+    threadEngines_.clear();
 }
 
 AbstractProtocol* UserScriptProtocol::createInstance(StreamBase *stream,
@@ -79,13 +102,14 @@ QString UserScriptProtocol::shortName() const
 
 quint32 UserScriptProtocol::protocolId(ProtocolIdType type) const
 {
+    QScriptEngine *engine;
     QScriptValue userFunction;
     QScriptValue userValue;
 
     if (!isScriptValid_)
         goto _do_default;
 
-    userFunction = userProtocolScriptValue_.property("protocolId");
+    userFunction = scriptProtocol(engine).property("protocolId");
 
     if (!userFunction.isValid())
         goto _do_default;
@@ -93,7 +117,7 @@ quint32 UserScriptProtocol::protocolId(ProtocolIdType type) const
     Q_ASSERT(userFunction.isFunction());
 
     userValue = userFunction.call(QScriptValue(),
-        QScriptValueList() << QScriptValue(&engine_, type));
+        QScriptValueList() << QScriptValue(engine, type));
 
     Q_ASSERT(userValue.isValid());
     Q_ASSERT(userValue.isNumber());
@@ -130,14 +154,36 @@ QVariant UserScriptProtocol::fieldData(int index, FieldAttrib attrib,
             if (!isScriptValid_)
                 return QByteArray();
 
-            QScriptValue userFunction = userProtocolScriptValue_.property(
+            int memoIdx;
+            QScriptEngine *engine;
+
+            memoMutex_.lock();
+            memoIdx = memoIndex(streamIndex,
+                    userProtocol_.isProtocolFrameValueVariable());
+            if (frameValueMemo_.contains(memoIdx))
+            {
+                QByteArray fv = frameValueMemo_.value(memoIdx);
+                memoMutex_.unlock();
+                return fv;
+            }
+            memoMutex_.unlock();
+
+            if (userProtocol_.isProtocolFrameValueVariable()
+                    && prefetchFrameValues(streamIndex))
+            {
+                QMutexLocker locker(&memoMutex_);
+                if (frameValueMemo_.contains(memoIdx))
+                    return frameValueMemo_.value(memoIdx);
+            }
+
+            QScriptValue userFunction = scriptProtocol(engine).property(
                     "protocolFrameValue");
 
             Q_ASSERT(userFunction.isValid());
             Q_ASSERT(userFunction.isFunction());
 
             QScriptValue userValue = userFunction.call(QScriptValue(),
-                QScriptValueList() << QScriptValue(&engine_, streamIndex));
+                QScriptValueList() << QScriptValue(engine, streamIndex));
 
             Q_ASSERT(userValue.isValid());
             Q_ASSERT(userValue.isArray());
@@ -151,6 +197,11 @@ QVariant UserScriptProtocol::fieldData(int index, FieldAttrib attrib,
             for (int i = 0; i < pktBuf.size(); i++)
                 fv[i] = pktBuf.at(i) & 0xFF;
 
+            memoMutex_.lock();
+            frameValueMemo_.insert(memoIdx, fv);
+            memoBytes_ += kMemoEntrySize + fv.size();
+            memoMutex_.unlock();
+
             return fv;
         }
         default:
@@ -198,17 +249,44 @@ int UserScriptProtocol::protocolFrameSize(int streamIndex) const
     if (!isScriptValid_)
         return 0;
 
-    QScriptValue userFunction = userProtocolScriptValue_.property(
+    int memoIdx;
+    QScriptEngine *engine;
+
+    memoMutex_.lock();
+    memoIdx = memoIndex(streamIndex,
+            userProtocol_.isProtocolFrameSizeVariable());
+    if (frameSizeMemo_.contains(memoIdx))
+    {
+        int size = frameSizeMemo_.value(memoIdx);
+        memoMutex_.unlock();
+        return size;
+    }
+    memoMutex_.unlock();
+
+    if (userProtocol_.isProtocolFrameSizeVariable()
+            && prefetchFrameValues(streamIndex))
+    {
+        QMutexLocker locker(&memoMutex_);
+        if (frameSizeMemo_.contains(memoIdx))
+            return frameSizeMemo_.value(memoIdx);
+    }
+
+    QScriptValue userFunction = scriptProtocol(engine).property(
             "protocolFrameSize");
 
     Q_ASSERT(userFunction.isValid());
     Q_ASSERT(userFunction.isFunction());
 
     QScriptValue userValue = userFunction.call(QScriptValue(), 
-            QScriptValueList() << QScriptValue(&engine_, streamIndex));
+            QScriptValueList() << QScriptValue(engine, streamIndex));
 
     Q_ASSERT(userValue.isNumber());
 
+    memoMutex_.lock();
+    frameSizeMemo_.insert(memoIdx, userValue.toInt32());
+    memoBytes_ += kMemoEntrySize;
+    memoMutex_.unlock();
+
     return userValue.toInt32();
 }
 
@@ -230,13 +308,14 @@ int UserScriptProtocol::protocolFrameVariableCount() const
 quint32 UserScriptProtocol::protocolFrameCksum(int streamIndex,
         CksumType cksumType) const
 {
+    QScriptEngine *engine;
     QScriptValue userFunction;
     QScriptValue userValue;
 
     if (!isScriptValid_)
         goto _do_default;
 
-    userFunction = userProtocolScriptValue_.property("protocolFrameCksum");
+    userFunction = scriptProtocol(engine).property("protocolFrameCksum");
 
     qDebug("userscript protoFrameCksum(): isValid:%d/isFunc:%d",
         userFunction.isValid(), userFunction.isFunction());
@@ -247,8 +326,8 @@ quint32 UserScriptProtocol::protocolFrameCksum(int streamIndex,
     Q_ASSERT(userFunction.isFunction());
 
     userValue = userFunction.call(QScriptValue(),
-            QScriptValueList() << QScriptValue(&engine_, streamIndex)
-            << QScriptValue(&engine_, cksumType));
+            QScriptValueList() << QScriptValue(engine, streamIndex)
+            << QScriptValue(engine, cksumType));
 
     Q_ASSERT(userValue.isValid());
     Q_ASSERT(userValue.isNumber());
@@ -259,13 +338,39 @@ _do_default:
     return AbstractProtocol::protocolFrameCksum(streamIndex, cksumType);
 }
 
+/*!
+  Compiles and evaluates the user script and validates the functions it
+  defines
+
+  The script is compiled only if it has changed since the last time; the
+  remembered results of the script's frame functions are dropped in any
+  case
+*/
 void UserScriptProtocol::evaluateUserScript() const
 {
     QScriptValue    userFunction;
     QScriptValue    userValue;
     QString         property;
+    QString         program = fieldData(userScript_program, FieldValue)
+                                .toString();
+
+    memoMutex_.lock();
+    frameValueMemo_.clear();
+    frameSizeMemo_.clear();
+    memoBytes_ = 0;
+    memoMutex_.unlock();
+
+    if (!program_.isNull() && (program_.sourceCode() == program))
+    {
+        qDebug("userscript unchanged - not evaluated again");
+        return;
+    }
+
+    program_ = QScriptProgram(program);
+    programGeneration_++;
 
     isScriptValid_ = false;
+    hasFrameValuesFunction_ = false;
     errorLineNumber_ = userScriptLineCount();
 
     // Reset all properties including the dynamic ones
@@ -274,8 +379,9 @@ void UserScriptProtocol::evaluateUserScript() const
     userProtocolScriptValue_.setProperty("protocolFrameSize", QScriptValue());
     userProtocolScriptValue_.setProperty("protocolFrameCksum", QScriptValue());
     userProtocolScriptValue_.setProperty("protocolId", QScriptValue());
+    userProtocolScriptValue_.setProperty("protocolFrameValues", QScriptValue());
 
-    engine_.evaluate(fieldData(userScript_program, FieldValue).toString());
+    engine_.evaluate(program_);
     if (engine_.hasUncaughtException())
         goto _error_exception;
 
@@ -413,6 +519,42 @@ _skip_cksum:
 
 
 _skip_protocol_id:
+    // Validate protocolFrameValues() [optional]
+    property = QString("protocolFrameValues");
+    userFunction = userProtocolScriptValue_.property(property);
+
+    qDebug("userscript property %s: isValid:%d/isFunc:%d", 
+            property.toAscii().constData(),
+            userFunction.isValid(), userFunction.isFunction());
+
+    if (!userFunction.isValid())
+        goto _skip_frame_values;
+
+    if (!userFunction.isFunction())
+    {
+        errorText_ = property + QString(" is not a function");
+        goto _error_exit;
+    }
+
+    userValue = userFunction.call(QScriptValue(),
+            QScriptValueList() << QScriptValue(&engine_, 0)
+            << QScriptValue(&engine_, 1));
+    if (engine_.hasUncaughtException())
+        goto _error_exception;
+
+    qDebug("userscript property %s return value: isValid:%d/isArray:%d",
+            property.toAscii().constData(),
+            userValue.isValid(), userValue.isArray());
+
+    if (!userValue.isArray())
+    {
+        errorText_ = property + QString(" does not return an array");
+        goto _error_exit;
+    }
+
+    hasFrameValuesFunction_ = true;
+
+_skip_frame_values:
     errorText_ = QString("");
     isScriptValid_ = true;
     return;
@@ -441,12 +583,214 @@ QString UserScriptProtocol::userScriptErrorText() const
     return errorText_;
 }
 
+/*!
+  Returns the index into the memo tables for the frame streamIndex - the
+  same for all the frames if the script result doesn't vary
+
+  The tables are dropped if the stream may have changed since they were
+  filled (the script may depend on the other protocols of the stream) or
+  if they have grown beyond kMaxMemoBytes
+
+  The caller must hold memoMutex_
+*/
+int UserScriptProtocol::memoIndex(int streamIndex, bool isVariable) const
+{
+    uint generation = mpStream ? mpStream->frameGeneration() : 0;
+
+    if ((generation != memoGeneration_) || (memoBytes_ >= kMaxMemoBytes))
+    {
+        frameValueMemo_.clear();
+        frameSizeMemo_.clear();
+        memoBytes_ = 0;
+        memoGeneration_ = generation;
+    }
+
+    return isVariable ? streamIndex : 0;
+}
+
+/*!
+  Fetches the frame values of a batch of frames starting at streamIndex
+  with a single call to the script's protocolFrameValues(start, count) (if
+  defined) into the memo tables - the sizes are the lengths of the values
+
+  protocolFrameValues() returns an array of upto count frame values, each
+  an array of bytes like the one returned by protocolFrameValue(). Returns
+  false if nothing was fetched
+*/
+bool UserScriptProtocol::prefetchFrameValues(int streamIndex) const
+{
+    QScriptEngine *engine;
+    QScriptValue userFunction;
+    QScriptValue userValue;
+    int count;
+
+    if (!hasFrameValuesFunction_)
+        return false;
+
+    // Drops the memo tables if they are stale
+    memoMutex_.lock();
+    memoIndex(streamIndex, true);
+    memoMutex_.unlock();
+
+    userFunction = scriptProtocol(engine).property("protocolFrameValues");
+    userValue = userFunction.call(QScriptValue(),
+            QScriptValueList() << QScriptValue(engine, streamIndex)
+            << QScriptValue(engine, kFrameValuesBatchSize));
+
+    if (engine->hasUncaughtException() || !userValue.isArray())
+    {
+        qWarning("userscript protocolFrameValues(%d, %d) failed - %s",
+                streamIndex, kFrameValuesBatchSize,
+                qPrintable(engine->uncaughtException().toString()));
+        engine->clearExceptions();
+        return false;
+    }
+
+    count = qMin(userValue.property("length").toInt32(),
+                kFrameValuesBatchSize);
+
+    QMutexLocker locker(&memoMutex_);
+    for (int i = 0; i < count; i++)
+    {
+        QByteArray fv;
+        QList<int> pktBuf;
+
+        qScriptValueToSequence(userValue.property(i), pktBuf);
+
+        fv.resize(pktBuf.size());
+        for (int j = 0; j < pktBuf.size(); j++)
+            fv[j] = pktBuf.at(j) & 0xFF;
+
+        if (userProtocol_.isProtocolFrameValueVariable())
+        {
+            frameValueMemo_.insert(streamIndex + i, fv);
+            memoBytes_ += kMemoEntrySize + fv.size();
+        }
+        if (userProtocol_.isProtocolFrameSizeVariable())
+        {
+            frameSizeMemo_.insert(streamIndex + i, fv.size());
+            memoBytes_ += kMemoEntrySize;
+        }
+    }
+
+    return (count > 0);
+}
+
+/*!
+  Returns the script's "protocol" object (and its engine in engine) to be
+  used by the calling thread
+
+  A script engine can be used by only one thread at a time, so threads
+  other than the one owning the protocol get an engine of their own -
+  created the first time the thread needs it and loaded with the same
+  script, again if the script has changed since; the engine is dropped
+  when the thread finishes - see ThreadEngineReaper
+*/
+QScriptValue UserScriptProtocol::scriptProtocol(QScriptEngine *&engine) const
+{
+    QThread *thread = QThread::currentThread();
+    ThreadEngine *te;
+
+    if (thread == ownerThread_)
+    {
+        engine = &engine_;
+        return userProtocolScriptValue_;
+    }
+
+    threadEngineMutex_.lock();
+    te = threadEngines_.value(thread);
+    if (te && (te->programGeneration != programGeneration_))
+    {
+        delete te;
+        te = NULL;
+    }
+    if (!te)
+    {
+        te = new ThreadEngine(const_cast<UserScriptProtocol*>(this));
+        te->userProtocolScriptValue = initEngine(&te->engine,
+                &te->userProtocol);
+        te->programGeneration = programGeneration_;
+
+        // Not program_ itself - a QScriptProgram keeps the code compiled
+        // for the last engine that evaluated it (and recompiles it for
+        // any other), so sharing it would race with the other threads
+        // for nothing
+        te->engine.evaluate(QScriptProgram(program_.sourceCode()));
+        if (te->engine.hasUncaughtException())
+        {
+            qWarning("userscript evaluation failed in thread %p - %s",
+                    thread, qPrintable(
+                        te->engine.uncaughtException().toString()));
+            te->engine.clearExceptions();
+        }
+        threadEngines_.insert(thread, te);
+
+        // Runs in the finishing thread itself - see ThreadEngineReaper
+        QObject::connect(thread, SIGNAL(finished()),
+                &threadEngineReaper_, SLOT(reap()),
+                Qt::ConnectionType(Qt::DirectConnection
+                    | Qt::UniqueConnection));
+    }
+    threadEngineMutex_.unlock();
+
+    engine = &te->engine;
+    return te->userProtocolScriptValue;
+}
+
+/*!
+  Deletes the script engine of thread, if any
+*/
+void UserScriptProtocol::dropThreadEngine(QThread *thread) const
+{
+    QMutexLocker locker(&threadEngineMutex_);
+
+    delete threadEngines_.take(thread);
+}
+
+/*!
+  Sets up the globals expected by a user script in engine - returns the
+  script value of the "protocol" global
+*/
+QScriptValue UserScriptProtocol::initEngine(QScriptEngine *engine,
+        UserProtocol *userProtocol)
+{
+    QScriptValue protocol = engine->newQObject(userProtocol);
+    QScriptValue meta = engine->newQMetaObject(userProtocol->metaObject());
+
+    engine->globalObject().setProperty("protocol", protocol);
+    engine->globalObject().setProperty("Protocol", meta);
+
+    return protocol;
+}
+
 int UserScriptProtocol::userScriptLineCount() const
 {
     return fieldData(userScript_program, FieldValue).toString().count(
             QChar('\n')) + 1;
 }
 
+//
+// -------------------- ThreadEngineReaper --------------------
+//
+
+ThreadEngineReaper::ThreadEngineReaper(UserScriptProtocol *protocol)
+    : protocol_(protocol)
+{
+}
+
+/*!
+  Connected to the finished() signal of every thread that has a script
+  engine of its own, so that the engine is deleted in that thread when
+  it finishes
+*/
+void ThreadEngineReaper::reap()
+{
+    QThread *thread = qobject_cast<QThread*>(sender());
+
+    if (thread)
+        protocol_->dropThreadEngine(thread);
+}
+
 //
 // -------------------- UserProtocol --------------------
 //
@@ -23,11 +23,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "abstractprotocol.h"
 #include "userscript.pb.h"
 
+#include <QHash>
+#include <QMutex>
 #include <QScriptEngine>
+#include <QScriptProgram>
 #include <QScriptValue>
 
+class QThread;
 class UserScriptProtocol;
 
+/*
+  Drops the script engine of a thread when the thread finishes - see
+  UserScriptProtocol::scriptProtocol()
+*/
+class ThreadEngineReaper : public QObject
+{
+    Q_OBJECT;
+
+public:
+    ThreadEngineReaper(UserScriptProtocol *protocol);
+
+private slots:
+    void reap();
+
+private:
+    UserScriptProtocol *protocol_;
+};
+
 class UserProtocol : public QObject
 {
     Q_OBJECT;
@@ -146,15 +168,51 @@ public:
     QString userScriptErrorText() const;
 
 private:
+    // Engine with its own copy of the script for a thread other than the
+    // one that owns the protocol - see scriptProtocol()
+    struct ThreadEngine
+    {
+        ThreadEngine(AbstractProtocol *parent)
+            : userProtocol(parent), programGeneration(0) {}
+
+        QScriptEngine   engine;
+        UserProtocol    userProtocol;
+        QScriptValue    userProtocolScriptValue;
+        uint            programGeneration;
+    };
+
     int userScriptLineCount() const;
+    int memoIndex(int streamIndex, bool isVariable) const;
+    bool prefetchFrameValues(int streamIndex) const;
+    QScriptValue scriptProtocol(QScriptEngine *&engine) const;
+    void dropThreadEngine(QThread *thread) const;
+
+    friend class ThreadEngineReaper;
+    static QScriptValue initEngine(QScriptEngine *engine,
+            UserProtocol *userProtocol);
 
     OstProto::UserScript    data;
 
     mutable QScriptEngine   engine_;
+    mutable QScriptProgram  program_;
     mutable UserProtocol    userProtocol_;
     mutable QScriptValue    userProtocolScriptValue_;
+    mutable uint            programGeneration_;
+
+    QThread                                 *ownerThread_;
+    mutable QMutex                          threadEngineMutex_;
+    mutable QHash<QThread*, ThreadEngine*>  threadEngines_;
+    mutable ThreadEngineReaper              threadEngineReaper_;
+
+    // Results of the script's frame functions by frame index - see memoIndex()
+    mutable QMutex                  memoMutex_;
+    mutable uint                    memoGeneration_;
+    mutable int                     memoBytes_;
+    mutable QHash<int, QByteArray>  frameValueMemo_;
+    mutable QHash<int, int>         frameSizeMemo_;
 
     mutable bool            isScriptValid_;
+    mutable bool            hasFrameValuesFunction_;
     mutable int             errorLineNumber_;
     mutable QString         errorText_;
 };
@@ -19,6 +19,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "vlan.h"
 
+#include "framevariation.h"
+
+#include <limits.h>
+
 VlanProtocol::VlanProtocol(StreamBase *stream, AbstractProtocol *parent)
     : AbstractProtocol(stream, parent)
 {
@@ -83,6 +87,9 @@ AbstractProtocol::FieldFlags VlanProtocol::fieldFlags(int index) const
 
         // meta-fields
         case vlan_isOverrideTpid:
+        case vlan_vlanIdMode:
+        case vlan_vlanIdCount:
+        case vlan_vlanIdStep:
             flags &= ~FrameField;
             flags |= MetaField;
             break;
@@ -169,7 +176,7 @@ QVariant VlanProtocol::fieldData(int index, FieldAttrib attrib,
 
         case vlan_vlanId:
         {
-            quint16 vlanId = (data.vlan_tag() & 0x0FFF);
+            quint16 vlanId = vlanIdFrameValue(streamIndex);
 
             switch(attrib)
             {
@@ -202,6 +209,27 @@ QVariant VlanProtocol::fieldData(int index, FieldAttrib attrib,
                 default: break;
             }
             break;
+        case vlan_vlanIdMode:
+            switch(attrib)
+            {
+                case FieldValue: return data.vlan_id_mode();
+                default: break;
+            }
+            break;
+        case vlan_vlanIdCount:
+            switch(attrib)
+            {
+                case FieldValue: return data.vlan_id_count();
+                default: break;
+            }
+            break;
+        case vlan_vlanIdStep:
+            switch(attrib)
+            {
+                case FieldValue: return data.vlan_id_step();
+                default: break;
+            }
+            break;
         default:
             break;
     }
@@ -259,6 +287,29 @@ bool VlanProtocol::setFieldData(int index, const QVariant &value,
                 data.set_is_override_tpid(override);
             break;
         }
+        case vlan_vlanIdMode:
+        {
+            uint mode = value.toUInt(&isOk);
+            if (isOk && data.VlanIdMode_IsValid(mode))
+                data.set_vlan_id_mode((OstProto::Vlan::VlanIdMode) mode);
+            else
+                isOk = false;
+            break;
+        }
+        case vlan_vlanIdCount:
+        {
+            uint count = value.toUInt(&isOk);
+            if (isOk)
+                data.set_vlan_id_count(count);
+            break;
+        }
+        case vlan_vlanIdStep:
+        {
+            uint step = value.toUInt(&isOk);
+            if (isOk)
+                data.set_vlan_id_step(step);
+            break;
+        }
         default:
             qFatal("%s: unimplemented case %d in switch", __PRETTY_FUNCTION__,
                 index);
@@ -268,3 +319,109 @@ bool VlanProtocol::setFieldData(int index, const QVariant &value,
 _exit:
     return isOk;
 }
+
+int VlanProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool /*forCksum*/) const
+{
+    quint16 tag;
+
+    if ((offset + 4) > bufMaxSize)
+        return -1;
+
+    tag = ((fieldData(vlan_prio, FieldValue, streamIndex).toUInt() & 0x07)
+                << 13)
+        | ((fieldData(vlan_cfiDei, FieldValue, streamIndex).toUInt() & 0x01)
+                << 12)
+        | (fieldData(vlan_vlanId, FieldValue, streamIndex).toUInt() & 0x0FFF);
+
+    qToBigEndian(quint16(fieldData(vlan_tpid, FieldValue, streamIndex)
+                .toUInt()), buf + offset);
+    qToBigEndian(tag, buf + offset + 2);
+
+    return 4;
+}
+
+bool VlanProtocol::appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const
+{
+    return appendVlanIdVariation(variation, offset, 1);
+}
+
+/*!
+  Adds the VLAN Id to the variation if it is not fixed - the VLAN Id of
+  frame index n is that of the frame index n/divisor as returned by
+  fieldData(), which lets a protocol that carries more than one tag vary
+  them as nested loops (see VlanStackProtocol)
+*/
+bool VlanProtocol::appendVlanIdVariation(FrameVariation &variation,
+        int offset, quint64 divisor) const
+{
+    OstProto::Vlan::VlanIdMode mode = data.vlan_id_mode();
+    int field;
+
+    if (mode == OstProto::Vlan::e_vm_fixed)
+        return true;
+
+    field = variation.addField(offset + 2, 2, 0x0FFF,
+            mode == OstProto::Vlan::e_vm_dec ? FrameVariation::kDecrement
+            : mode == OstProto::Vlan::e_vm_random ? FrameVariation::kRandom
+            : FrameVariation::kIncrement,
+            data.vlan_tag() & 0x0FFF,
+            data.vlan_id_count() ? data.vlan_id_count() : 1,
+            data.vlan_id_step(), divisor, 0, fieldRandomKey(vlan_vlanId));
+
+    return (field >= 0);
+}
+
+bool VlanProtocol::isProtocolFrameValueVariable() const
+{
+    return (data.vlan_id_mode() != OstProto::Vlan::e_vm_fixed);
+}
+
+int VlanProtocol::protocolFrameVariableCount() const
+{
+    if (data.vlan_id_mode() == OstProto::Vlan::e_vm_fixed)
+        return 1;
+
+    return qMax(1, int(qMin(data.vlan_id_count(), uint(INT_MAX))));
+}
+
+bool VlanProtocol::isFieldFrameValueVariable(int index) const
+{
+    if (index == vlan_vlanId)
+        return (data.vlan_id_mode() != OstProto::Vlan::e_vm_fixed);
+
+    return false;
+}
+
+/*!
+  Returns the VLAN Id of the frame 'streamIndex' as per the VLAN Id mode -
+  the 12 bit Id wraps around
+*/
+quint16 VlanProtocol::vlanIdFrameValue(int streamIndex) const
+{
+    uint vlanId = data.vlan_tag() & 0x0FFF;
+    uint count = data.vlan_id_count() ? data.vlan_id_count() : 1;
+    uint step = data.vlan_id_step();
+
+    switch (data.vlan_id_mode())
+    {
+        case OstProto::Vlan::e_vm_fixed:
+            break;
+        case OstProto::Vlan::e_vm_inc:
+            vlanId += (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Vlan::e_vm_dec:
+            vlanId -= (uint(streamIndex) % count) * step;
+            break;
+        case OstProto::Vlan::e_vm_random:
+            vlanId += (fieldFrameRandom(vlan_vlanId, streamIndex) % count)
+                        * step;
+            break;
+        default:
+            qWarning("Unhandled vlanId mode = %d", data.vlan_id_mode());
+            break;
+    }
+
+    return vlanId & 0x0FFF;
+}
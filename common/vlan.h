@@ -35,6 +35,9 @@ public:
 
         // meta-fields
         vlan_isOverrideTpid,
+        vlan_vlanIdMode,
+        vlan_vlanIdCount,
+        vlan_vlanIdStep,
 
         vlan_fieldCount
     };
@@ -60,7 +63,21 @@ public:
     virtual bool setFieldData(int index, const QVariant &value, 
             FieldAttrib attrib = FieldValue);
 
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+    bool appendVlanIdVariation(FrameVariation &variation, int offset,
+        quint64 divisor) const;
+
+    virtual bool isProtocolFrameValueVariable() const;
+    virtual int protocolFrameVariableCount() const;
+    virtual bool isFieldFrameValueVariable(int index) const;
+
 protected:
+    quint16 vlanIdFrameValue(int streamIndex) const;
+
     OstProto::Vlan    data;
 };
 
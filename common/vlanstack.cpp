@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "vlanstack.h"
+
+#include <limits.h>
+
+VlanStackProtocol::VlanStackProtocol(StreamBase *stream,
+        AbstractProtocol *parent)
+    : ComboProtocol<OstProto::Protocol::kVlanStackFieldNumber,
+        SVlanProtocol, VlanProtocol>(stream, parent)
+{
+}
+
+VlanStackProtocol::~VlanStackProtocol()
+{
+}
+
+AbstractProtocol* VlanStackProtocol::createInstance(StreamBase *stream,
+        AbstractProtocol *parent)
+{
+    return new VlanStackProtocol(stream, parent);
+}
+
+QVariant VlanStackProtocol::fieldData(int index, FieldAttrib attrib,
+        int streamIndex) const
+{
+    int cnt = protoA->fieldCount();
+
+    if (index < cnt)
+        return protoA->fieldData(index, attrib, outerStreamIndex(streamIndex));
+    else
+        return protoB->fieldData(index - cnt, attrib, streamIndex);
+}
+
+int VlanStackProtocol::writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex, bool forCksum) const
+{
+    int sizeA, sizeB;
+
+    sizeA = protoA->writeProtocolFrameValue(buf, bufMaxSize, offset,
+                outerStreamIndex(streamIndex), forCksum);
+    if (sizeA < 0)
+        return -1;
+
+    sizeB = protoB->writeProtocolFrameValue(buf, bufMaxSize, offset + sizeA,
+                streamIndex, forCksum);
+    if (sizeB < 0)
+        return -1;
+
+    return sizeA + sizeB;
+}
+
+bool VlanStackProtocol::appendProtocolFrameVariation(
+        FrameVariation &variation, int offset) const
+{
+    return protoA->appendVlanIdVariation(variation, offset,
+                protoB->protocolFrameVariableCount())
+        && protoB->appendVlanIdVariation(variation, offset + 4, 1);
+}
+
+/*!
+  Returns the product (not the LCM) of the tag counts - capped to INT_MAX
+*/
+int VlanStackProtocol::protocolFrameVariableCount() const
+{
+    quint64 count = quint64(protoA->protocolFrameVariableCount())
+                        * protoB->protocolFrameVariableCount();
+
+    return int(qMin(count, quint64(INT_MAX)));
+}
+
+/*!
+  Returns the frame index to be used for the outer tag - the outer tag
+  changes only after the inner tag has gone through all its values
+*/
+int VlanStackProtocol::outerStreamIndex(int streamIndex) const
+{
+    return streamIndex / protoB->protocolFrameVariableCount();
+}
@@ -24,7 +24,34 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "svlan.h"
 #include "vlan.h"
 
-typedef ComboProtocol<OstProto::Protocol::kVlanStackFieldNumber, 
-    SVlanProtocol, VlanProtocol> VlanStackProtocol;
+/*
+ * The outer (SVlan) and inner (Vlan) tag Ids are varied as nested loops -
+ * the inner Id goes through all of its values for every value of the outer
+ * Id - so that one stream can sweep all the outer x inner combinations
+ */
+class VlanStackProtocol : public ComboProtocol<
+    OstProto::Protocol::kVlanStackFieldNumber, SVlanProtocol, VlanProtocol>
+{
+public:
+    VlanStackProtocol(StreamBase *stream, AbstractProtocol *parent = 0);
+    virtual ~VlanStackProtocol();
+
+    static AbstractProtocol* createInstance(StreamBase *stream,
+        AbstractProtocol *parent = 0);
+
+    virtual QVariant fieldData(int index, FieldAttrib attrib,
+        int streamIndex = 0) const;
+
+    virtual int writeProtocolFrameValue(uchar *buf, int bufMaxSize,
+        int offset, int streamIndex = 0, bool forCksum = false) const;
+
+    virtual bool appendProtocolFrameVariation(FrameVariation &variation,
+        int offset) const;
+
+    virtual int protocolFrameVariableCount() const;
+
+private:
+    int outerStreamIndex(int streamIndex) const;
+};
 
 #endif
@@ -23,14 +23,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "../common/streambase.h"
 #include "../common/abstractprotocol.h"
+#include "../common/framecursor.h"
+#include "../common/framevariation.h"
+#include "pcapreplayfile.h"
 
 #include <QString>
 #include <QIODevice>
+#include <QThread>
 
 #include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 
+// Streams with costly protocols and at least these many distinct frames
+// are generated by several threads at once, these many frames at a time
+static const ulong kMinParallelFrames = 1024;
+static const int kParallelFrameChunk = 4096;
+
 AbstractPort::AbstractPort(int id, const char *device)
 {
     isUsable_ = true;
@@ -76,6 +85,34 @@ bool AbstractPort::modify(const OstProto::Port &port)
     if (port.has_transmit_mode())
         data_.set_transmit_mode(port.transmit_mode());
 
+    if (port.has_is_qdisc_bypass())
+        data_.set_is_qdisc_bypass(port.is_qdisc_bypass());
+
+    if (port.has_capture_threads())
+        data_.set_capture_threads(port.capture_threads());
+
+    if (port.has_tx_spin_threshold())
+        data_.set_tx_spin_threshold(port.tx_spin_threshold());
+
+    if (port.has_is_txtime_pacing())
+        data_.set_is_txtime_pacing(port.is_txtime_pacing());
+
+    if (port.has_packet_monitor())
+    {
+        bool val = port.packet_monitor();
+
+        if (setPacketMonitor(val))
+            data_.set_packet_monitor(val);
+    }
+
+    if (port.has_is_xdp())
+    {
+        bool val = port.is_xdp();
+
+        if (setXdp(val))
+            data_.set_is_xdp(val);
+    }
+
     return ret;
 }    
 
@@ -140,6 +177,70 @@ void AbstractPort::addNote(QString note)
     data_.set_notes(notes.toStdString());
 }
 
+/*!
+  Removes a note added earlier with addNote() - does nothing if there's
+  no such note
+*/
+void AbstractPort::removeNote(QString note)
+{
+    QString notes = QString::fromStdString(data_.notes());
+
+    if (note.isEmpty())
+        return;
+
+    notes.remove(QString("<li>%1</li>").arg(note));
+    if (!notes.contains("<li>"))
+        notes.clear();
+
+    data_.set_notes(notes.toStdString());
+}
+
+/*!
+  Appends the packets of the (opened) replay file with the timestamp of the
+  first packet being sec/nsec which are advanced past the last packet; takes
+  ownership of replay
+
+  The default implementation copies each packet into the packet list with
+  appendToPacketList() - packets bigger than kMaxReplayPktSize can't be
+  held by the packet list and are skipped. Ports that can transmit straight
+  from the replay file should reimplement this
+*/
+bool AbstractPort::appendReplayToPacketList(PcapReplayFile *replay,
+        long &sec, long &nsec)
+{
+    PcapReplayFile::Packet packet;
+    quint64 skipped = 0;
+    bool isOk = true;
+
+    replay->rewind();
+    while (replay->nextPacket(packet))
+    {
+        nsec += packet.nsecGap % ulong(1e9);
+        sec += packet.nsecGap / ulong(1e9);
+        while (nsec >= long(1e9))
+        {
+            sec++;
+            nsec -= long(1e9);
+        }
+
+        if (packet.length > kMaxReplayPktSize)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (!appendToPacketList(sec, nsec, packet.data, packet.length))
+            isOk = false;
+    }
+
+    if (skipped)
+        qWarning("port %d: skipped %llu replay packets bigger than %d bytes",
+                id(), skipped, kMaxReplayPktSize);
+
+    delete replay;
+    return isOk;
+}
+
 void AbstractPort::updatePacketList()
 {
     switch(data_.transmit_mode())
@@ -172,6 +273,7 @@ void AbstractPort::updatePacketListSequential()
     {
         if (streamList_[i]->isEnabled())
         {
+            FrameCursor cursor(streamList_[i], 0, kMaxPktSize);
             int len = 0;
             ulong n, x, y;
             ulong burstSize;
@@ -184,6 +286,19 @@ void AbstractPort::updatePacketListSequential()
             quint64 npy1 = 0, npy2 = 0;
             quint64 loopDelay;
             ulong frameVariableCount = streamList_[i]->frameVariableCount();
+            const FrameVariation *variation =
+                streamList_[i]->frameVariation();
+            bool isVariationLazy = false;
+
+            // If the port can vary the packets while transmitting, the
+            // frames covered by the variation are not built upfront -
+            // only the frames that vary otherwise are
+            if (variation && setPacketListFrameVariation(variation))
+            {
+                isVariationLazy = true;
+                frameVariableCount =
+                    streamList_[i]->frameVariationBaseCount();
+            }
 
             // We derive n, x, y such that
             // n * x + y = total number of packets to be sent
@@ -251,26 +366,48 @@ void AbstractPort::updatePacketListSequential()
             qDebug("npx2 = %" PRIu64, npx2);
             qDebug("npy2 = %" PRIu64 "\n", npy2);
 
+            // A replay stream's packets are from its pcap file and not its
+            // protocols
+            if (streamList_[i]->hasReplay())
+            {
+                PcapReplayFile *replay = new PcapReplayFile;
+                QString error;
+
+                if (replay->open(streamList_[i]->replay(), error))
+                    appendReplayToPacketList(replay, sec, nsec);
+                else
+                {
+                    qWarning("%s: stream %u: %s", __FUNCTION__,
+                            streamList_[i]->id(), qPrintable(error));
+                    delete replay;
+                }
+                n = x = y = 0;
+            }
+
             if (n > 1)
                 loopNextPacketSet(x, n, 0, loopDelay);
             else if (n == 0)
                 x = 0;
 
+            if ((frameVariableCount >= kMinParallelFrames)
+                    && streamList_[i]->isFrameCostly()
+                    && (QThread::idealThreadCount() > 1))
+                cursor.setReadAhead(int(qMin(ulong(kParallelFrameChunk),
+                                x + y)));
+
             for (uint j = 0; j < (x+y); j++)
             {
                 
+                // Only the varying bytes are rewritten for every frame
                 if (j == 0 || frameVariableCount > 1)
-                {
-                    len = streamList_[i]->frameValue(
-                            pktBuf_, sizeof(pktBuf_), j);
-                }
+                    len = cursor.next();
                 if (len <= 0)
                     continue;
 
                 qDebug("q(%d, %d) sec = %lu nsec = %lu",
                         i, j, sec, nsec);
 
-                appendToPacketList(sec, nsec, pktBuf_, len); 
+                appendToPacketList(sec, nsec, cursor.frame(), len); 
 
                 if ((j > 0) && (((j+1) % burstSize) == 0))
                 {
@@ -296,6 +433,9 @@ void AbstractPort::updatePacketListSequential()
                 }
             }
 
+            if (isVariationLazy)
+                setPacketListFrameVariation(NULL);
+
             switch(streamList_[i]->nextWhat())
             {
                 case ::OstProto::StreamControl::e_nw_stop:
@@ -348,7 +488,7 @@ void AbstractPort::updatePacketListInterleaved()
     QList<ulong> pktCount, burstCount;
     QList<ulong> burstSize;
     QList<bool> isVariable;
-    QList<QByteArray> pktBuf;
+    QList<FrameCursor*> cursors;
     QList<ulong> pktLen;
 
     qDebug("In %s", __FUNCTION__);
@@ -363,6 +503,13 @@ void AbstractPort::updatePacketListInterleaved()
         if (!streamList_[i]->isEnabled())
             continue;
 
+        if (streamList_[i]->hasReplay())
+        {
+            qWarning("%s: replay stream %u not supported in interleaved "
+                    "mode - skipped", __FUNCTION__, streamList_[i]->id());
+            continue;
+        }
+
         double numBursts = 0;
         double numPackets = 0;
 
@@ -460,19 +607,16 @@ void AbstractPort::updatePacketListInterleaved()
         pktCount.append(0);
         burstCount.append(0);
 
+        cursors.append(new FrameCursor(streamList_[i], 0, kMaxPktSize));
         if (streamList_[i]->isFrameVariable())
         {
             isVariable.append(true);
-            pktBuf.append(QByteArray());
             pktLen.append(0);
         }
         else
         {
             isVariable.append(false);
-            pktBuf.append(QByteArray());
-            pktBuf.last().resize(kMaxPktSize);
-            pktLen.append(streamList_[i]->frameValue(
-                    (uchar*)pktBuf.last().data(), pktBuf.last().size(), 0));
+            pktLen.append(cursors.last()->next());
         }
 
         numStreams++;
@@ -481,7 +625,7 @@ void AbstractPort::updatePacketListInterleaved()
     qDebug("minGap   = %" PRIu64, minGap);
     qDebug("duration = %" PRIu64, duration);
 
-    uchar* buf;
+    const uchar* buf;
     int len;
     quint64 durSec = duration/ulong(1e9);
     quint64 durNsec = duration % ulong(1e9);
@@ -501,15 +645,12 @@ void AbstractPort::updatePacketListInterleaved()
             {
                 if (isVariable.at(i))
                 {
-                    buf = pktBuf_;
-                    len = streamList_[i]->frameValue(pktBuf_, sizeof(pktBuf_), 
-                            pktCount[i]);
+                    cursors[i]->seek(pktCount.at(i));
+                    len = cursors[i]->next();
                 }
                 else
-                {
-                    buf = (uchar*) pktBuf.at(i).data();
                     len = pktLen.at(i);
-                }
+                buf = cursors[i]->frame();
 
                 if (len <= 0)
                     continue;
@@ -556,6 +697,7 @@ void AbstractPort::updatePacketListInterleaved()
     }
     qDebug("loop Delay = %" PRId64 "/%" PRId64, delaySec, delayNsec);
     setPacketListLoopMode(true, delaySec, delayNsec); 
+    qDeleteAll(cursors);
     isSendQueueDirty_ = false;
 }
 
@@ -591,4 +733,14 @@ void AbstractPort::stats(PortStats *stats)
     stats->rxFrameErrors = (stats_.rxFrameErrors >= epochStats_.rxFrameErrors) ?
                         stats_.rxFrameErrors - epochStats_.rxFrameErrors :
                         stats_.rxFrameErrors + (maxStatsValue_ - epochStats_.rxFrameErrors);
+
+    stats->captureDrops = (stats_.captureDrops >= epochStats_.captureDrops) ?
+                        stats_.captureDrops - epochStats_.captureDrops :
+                        stats_.captureDrops + (maxStatsValue_ - epochStats_.captureDrops);
+
+    // Updated by the transmit thread - see PcapPort::PortTransmitter
+    pacingStatsMutex_.lock();
+    stats->txPacingOvershootAvg = stats_.txPacingOvershootAvg;
+    stats->txPacingOvershootMax = stats_.txPacingOvershootMax;
+    pacingStatsMutex_.unlock();
 }
@@ -21,11 +21,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #define _SERVER_ABSTRACT_PORT_H
 
 #include <QList>
+#include <QMutex>
 #include <QtGlobal>
 
 #include "../common/protocol.pb.h"
 
 class StreamBase;
+class FrameVariation;
+class PcapReplayFile;
 class QIODevice;
 
 class AbstractPort
@@ -43,6 +46,11 @@ public:
         quint64    rxFifoErrors;
         quint64    rxFrameErrors;
 
+        quint64    captureDrops;
+
+        quint64    txPacingOvershootAvg;    // nsecs
+        quint64    txPacingOvershootMax;    // nsecs
+
         quint64    txPkts;
         quint64    txBytes;
         quint64    txPps;
@@ -65,6 +73,8 @@ public:
     virtual OstProto::LinkState linkState() { return linkState_; }
     virtual bool hasExclusiveControl() = 0;
     virtual bool setExclusiveControl(bool exclusive) = 0;
+    virtual bool setPacketMonitor(bool /*enable*/) { return false; }
+    virtual bool setXdp(bool /*enable*/) { return false; }
 
     int streamCount() { return streamList_.size(); }
     StreamBase* streamAtIndex(int index);
@@ -82,6 +92,12 @@ public:
             int length) = 0;
     virtual void setPacketListLoopMode(bool loop, 
             quint64 secDelay, quint64 nsecDelay) = 0;
+    // Packets appended hereafter are varied while transmitting (if the
+    // port supports it) - see updatePacketListSequential()
+    virtual bool setPacketListFrameVariation(
+            const FrameVariation* /*variation*/) { return false; }
+    virtual bool appendReplayToPacketList(PcapReplayFile *replay,
+            long &sec, long &nsec);
     virtual void updatePacketList();
 
     virtual void startTransmit() = 0;
@@ -98,6 +114,7 @@ public:
 
 protected:
     void addNote(QString note);
+    void removeNote(QString note);
 
     void updatePacketListSequential();
     void updatePacketListInterleaved();
@@ -110,12 +127,13 @@ protected:
     quint64 maxStatsValue_;
     struct PortStats    stats_;
     //! \todo Need lock for stats access/update
+    QMutex pacingStatsMutex_;   //!< for the txPacingOvershoot stats only
 
 protected:
     bool    isSendQueueDirty_;
 
     static const int kMaxPktSize = 16384;
-    uchar   pktBuf_[kMaxPktSize];
+    static const int kMaxReplayPktSize = 65535;
 
     /*! \note StreamBase::id() and index into streamList[] are NOT same! */
     QList<StreamBase*>  streamList_;
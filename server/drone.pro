@@ -31,6 +31,16 @@ win32 {
 
 QMAKE_CXXFLAGS += -D__STDC_LIMIT_MACROS
 
+# AF_XDP ports need the kernel headers for it with need_wakeup (Linux 5.4+)
+linux:system(grep -qs XDP_USE_NEED_WAKEUP /usr/include/linux/if_xdp.h) {
+    DEFINES += HAVE_AF_XDP
+}
+
+# io_uring for capture file writes (Linux 5.1+)
+linux:exists(/usr/include/linux/io_uring.h) {
+    DEFINES += HAVE_IO_URING
+}
+
 LIBS += -lm
 LIBS += -lprotobuf
 LIBS += -L../dpdkadapter -ldpdkadapter
@@ -48,9 +58,12 @@ SOURCES += \
     drone.cpp \
     portmanager.cpp \
     abstractport.cpp \
+    packetarena.cpp \
+    pcapreplayfile.cpp \
     pcapport.cpp \
     bsdport.cpp \
     linuxport.cpp \
+    xdpport.cpp \
     winpcapport.cpp \
     dpdkport.cpp
 
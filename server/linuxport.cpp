@@ -24,33 +24,64 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include <QByteArray>
 #include <QHash>
 #include <QTime>
+#include <QVector>
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <net/if.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include <linux/net_tstamp.h>
 #include <linux/rtnetlink.h>
 
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
 QList<LinuxPort*> LinuxPort::allPorts_;
 LinuxPort::StatsMonitor *LinuxPort::monitor_;
 
 const quint32 kMaxValue32 = 0xffffffff;
 
 LinuxPort::LinuxPort(int id, const char *device)
-    : PcapPort(id, device) 
+    : PcapPort(id, device, false) 
 {
+    BatchTransmitter *transmitter;
+
     isPromisc_ = true;
     clearPromisc_ = false;
+    isPacketMonitored_ = false;
 
-    // We don't need per port Rx/Tx monitors for Linux
-    delete monitorRx_;
-    delete monitorTx_;
-    monitorRx_ = monitorTx_ = NULL;
+    // We don't need per port Rx/Tx monitors for Linux unless asked for -
+    // see setPacketMonitor()
+
+    delete transmitter_;
+    transmitter_ = transmitter = new BatchTransmitter(device);
+
+    // With no packet socket, pcap can't do any better
+    if (!transmitter->hasSocket())
+        isUsable_ = false;
+
+    delete capturer_;
+    capturer_ = new RingCapturer(device, &stats_);
 
     // We have one monitor for both Rx/Tx of all ports
     if (!monitor_)
@@ -69,6 +100,10 @@ LinuxPort::~LinuxPort()
 {
     qDebug("In %s", __FUNCTION__);
 
+    // An unusable port is deleted right away - the stats monitor must
+    // not see it
+    allPorts_.removeOne(this);
+
     if (monitor_->isRunning())
     {
         monitor_->stop();
@@ -129,6 +164,1570 @@ bool LinuxPort::setExclusiveControl(bool /*exclusive*/)
     return false;
 }
 
+static const char *kTxMonitorNote = "<i>Tx Frames/Bytes</i>: Only "
+        "Ostinato Tx pkts (Tx by others NOT included)";
+
+/*!
+  Starts (or stops) counting the port's rx/tx packets by capturing them
+  with pcap Rx/Tx monitors instead of using the kernel counters of the
+  port - costs two threads and a copy of every packet, so it's off by
+  default; the pkt/byte rates are not available while on
+*/
+bool LinuxPort::setPacketMonitor(bool enable)
+{
+    if (enable == (monitorRx_ != NULL))
+        return true;
+
+    // The transmitter's stats may be switched below
+    if (isTransmitOn())
+    {
+        qWarning("%s: can't change packet monitoring of %s while "
+                "transmitting", __FUNCTION__, name());
+        return false;
+    }
+
+    if (enable)
+    {
+        monitorRx_ = new PortMonitor(name(), kDirectionRx, &stats_);
+        monitorTx_ = new PortMonitor(name(), kDirectionTx, &stats_);
+
+        if (!monitorRx_->handle() || !monitorTx_->handle())
+        {
+            qWarning("%s: unable to monitor %s", __FUNCTION__, name());
+            delete monitorRx_;
+            delete monitorTx_;
+            monitorRx_ = monitorTx_ = NULL;
+            return false;
+        }
+
+        // The stats monitor leaves the rx/tx counters alone hereafter
+        isPacketMonitored_ = true;
+        stats_.rxPps = stats_.rxBps = 0;
+        stats_.txPps = stats_.txBps = 0;
+
+        // Same as PcapPort::init() - a tx monitor that sees rx packets too
+        // can't count tx, the transmitter counts what it sends instead
+        if (!monitorTx_->isDirectional())
+        {
+            transmitter_->useExternalStats(&stats_);
+            addNote(kTxMonitorNote);
+        }
+
+        monitorRx_->start();
+        monitorTx_->start();
+    }
+    else
+    {
+        monitorRx_->stop();
+        monitorTx_->stop();
+        monitorRx_->wait();
+        monitorTx_->wait();
+        delete monitorRx_;
+        delete monitorTx_;
+        monitorRx_ = monitorTx_ = NULL;
+
+        transmitter_->useExternalStats(NULL);
+        removeNote(kTxMonitorNote);
+        isPacketMonitored_ = false;
+    }
+
+    return true;
+}
+
+void LinuxPort::startTransmit()
+{
+    static_cast<BatchTransmitter*>(transmitter_)->setQdiscBypass(
+            data_.is_qdisc_bypass());
+    setupTxTimePacing();
+    static_cast<BatchTransmitter*>(transmitter_)->setupRing();
+
+    PcapPort::startTransmit();
+}
+
+/*
+ * Returns the clock to use for the SO_TXTIME departure times of packets on
+ * device - that of the etf or fq qdisc on it (with its name in qdisc);
+ * returns -1 if there's no such qdisc
+ */
+static int txTimeClock(const char *device, QByteArray *qdisc)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct tcmsg tcm;
+    } req;
+    int ifIndex = if_nametoindex(device);
+    int clock = -1;
+    bool done = false;
+    QByteArray buf(32*1024, '\0');
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (fd < 0)
+    {
+        qWarning("%s: unable to open netlink socket: %s", __FUNCTION__,
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = RTM_GETQDISC;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.tcm.tcm_family = AF_UNSPEC;
+    req.tcm.tcm_ifindex = ifIndex;
+
+    if (send(fd, &req, sizeof(req), 0) < 0)
+    {
+        qWarning("%s: unable to send GETQDISC request: %s", __FUNCTION__,
+                strerror(errno));
+        goto _exit;
+    }
+
+    // etf may be a child of mqprio/taprio, so all the qdiscs are looked at
+    while (!done)
+    {
+        struct nlmsghdr *nlm = (struct nlmsghdr*) buf.data();
+        int len = recv(fd, buf.data(), buf.size(), 0);
+
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            qWarning("%s: netlink recv error: %s", __FUNCTION__,
+                    strerror(errno));
+            goto _exit;
+        }
+
+        for (; NLMSG_OK(nlm, (uint)len); nlm = NLMSG_NEXT(nlm, len))
+        {
+            struct tcmsg *tcm;
+            struct rtattr *rta;
+            int rtaLen;
+
+            if ((nlm->nlmsg_type == NLMSG_DONE)
+                    || (nlm->nlmsg_type == NLMSG_ERROR))
+            {
+                done = true;
+                break;
+            }
+
+            tcm = (struct tcmsg*) NLMSG_DATA(nlm);
+            if (tcm->tcm_ifindex != ifIndex)
+                continue;
+
+            rta = (struct rtattr*) ((char*)tcm + NLMSG_ALIGN(sizeof(*tcm)));
+            rtaLen = nlm->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm));
+            for (; RTA_OK(rta, rtaLen); rta = RTA_NEXT(rta, rtaLen))
+            {
+                const char *kind = (const char*) RTA_DATA(rta);
+
+                if (rta->rta_type != TCA_KIND)
+                    continue;
+
+                // etf is almost always set up with clockid CLOCK_TAI
+                // (and rejects packets with any other); fq only works with
+                // CLOCK_MONOTONIC
+                if (strcmp(kind, "etf") == 0)
+                    clock = CLOCK_TAI;
+                else if ((strcmp(kind, "fq") == 0) && (clock < 0))
+                    clock = CLOCK_MONOTONIC;
+                else
+                    break;
+
+                *qdisc = kind;
+                break;
+            }
+        }
+    }
+
+_exit:
+    close(fd);
+    return clock;
+}
+
+/*!
+  Sets up the transmitter to pace the packets with SO_TXTIME if asked for
+  and possible - i.e. the qdisc of the port isn't bypassed and is one that
+  honours the departure time of the packets (etf or fq); else the packets
+  are paced as usual by udelay(). Which one it is goes in the port notes
+*/
+void LinuxPort::setupTxTimePacing()
+{
+    BatchTransmitter *transmitter =
+            static_cast<BatchTransmitter*>(transmitter_);
+    QByteArray qdisc;
+    int clock = -1;
+
+    removeNote(txPacingNote_);
+    txPacingNote_.clear();
+
+    if (!data_.is_txtime_pacing())
+    {
+        transmitter->setTxTime(-1);
+        return;
+    }
+
+    if (data_.is_qdisc_bypass())
+        txPacingNote_ = "<i>Tx Pacing</i>: by Ostinato - SO_TXTIME pacing "
+                        "needs the qdisc, which is bypassed";
+    else if ((clock = txTimeClock(name(), &qdisc)) < 0)
+        txPacingNote_ = "<i>Tx Pacing</i>: by Ostinato - SO_TXTIME pacing "
+                        "needs an etf or fq qdisc on the port";
+    else if (!transmitter->setTxTime(clock))
+    {
+        clock = -1;
+        txPacingNote_ = "<i>Tx Pacing</i>: by Ostinato - SO_TXTIME not "
+                        "supported";
+    }
+    else
+        txPacingNote_ = QString("<i>Tx Pacing</i>: by kernel - SO_TXTIME "
+                        "with %1 qdisc").arg(QString(qdisc));
+
+    if (clock < 0)
+        transmitter->setTxTime(-1);
+
+    qDebug("%s: %s", name(), qPrintable(txPacingNote_));
+    addNote(txPacingNote_);
+}
+
+void LinuxPort::startCapture()
+{
+    static_cast<RingCapturer*>(capturer_)->setThreadCount(
+            data_.capture_threads());
+
+    PcapPort::startCapture();
+}
+
+// Returns time diff in usecs between end and start
+static long inline udiffTimeStamp(const struct timespec *start,
+        const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)*long(1e6)
+            + (end->tv_nsec - start->tv_nsec)/1000;
+}
+
+LinuxPort::BatchTransmitter::BatchTransmitter(const char *device)
+    : PortTransmitter(device), device_(device)
+{
+    ring_ = NULL;
+    ringFd_ = -1;
+    isQdiscBypass_ = false;
+    isRingTried_ = false;
+    txTimeClock_ = -1;
+    frameCount_ = (kBlockSize/kFrameSize) * kBlockCount;
+    frameIndex_ = 0;
+    pending_ = 0;
+    msgs_ = new struct mmsghdr[kMaxBatch];
+    iovs_ = new struct iovec[kMaxBatch];
+    cmsgs_ = new char[kMaxBatch*CMSG_SPACE(sizeof(quint64))];
+    memset(msgs_, 0, kMaxBatch*sizeof(struct mmsghdr));
+    memset(cmsgs_, 0, kMaxBatch*CMSG_SPACE(sizeof(quint64)));
+    for (int i = 0; i < kMaxBatch; i++)
+    {
+        msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Packets due within the timer slack of the thread are batched - a
+    // sleep wouldn't be any more accurate than that anyway
+    timerSlack_ = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0) / 1000;
+    if (timerSlack_ < 0)
+        timerSlack_ = 0;
+
+    fd_ = openSocket();
+    if (fd_ < 0)
+    {
+        qWarning("%s: packet socket not available for %s, using pcap: %s",
+                __FUNCTION__, device, strerror(errno));
+        return;
+    }
+
+    qDebug("%s: %s: timer slack %ld usec", __FUNCTION__, device,
+            timerSlack_);
+}
+
+LinuxPort::BatchTransmitter::~BatchTransmitter()
+{
+    releaseRing();
+    if (fd_ >= 0)
+        close(fd_);
+    delete[] msgs_;
+    delete[] iovs_;
+    delete[] cmsgs_;
+}
+
+/*!
+  Returns a new packet socket bound to the port or -1 on error (with errno
+  set). Protocol 0 - the socket is only for transmit, never sees any rx
+*/
+int LinuxPort::BatchTransmitter::openSocket()
+{
+    struct sockaddr_ll addr;
+    int fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_ifindex = if_nametoindex(device_.constData());
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+/*!
+  Sets up the TX ring, if not already done - called just before transmit
+  starts so that ports which never transmit (or transmit only with
+  SO_TXTIME, see usingRing()) don't hold the memory of a ring
+
+  The ring is on a socket of its own - once a socket has a TX ring, the
+  kernel sends only what's in the ring and ignores the buffer passed to
+  send(). Packets too big for a ring frame go out on the plain socket
+  fd_ instead
+
+  The ring is tried only once (till released by setTxTime()); sendmmsg()
+  is used if it isn't available
+*/
+void LinuxPort::BatchTransmitter::setupRing()
+{
+    struct tpacket_req req;
+    int version = TPACKET_V2;
+    int loss = 1;
+    void *ring;
+
+    if ((fd_ < 0) || isRingTried_ || (txTimeClock_ >= 0))
+        return;
+
+    isRingTried_ = true;
+
+    ringFd_ = openSocket();
+    if (ringFd_ < 0)
+        goto _no_ring;
+
+    if (setsockopt(ringFd_, SOL_PACKET, PACKET_VERSION,
+                &version, sizeof(version)) < 0)
+        goto _no_ring;
+
+    // Skip malformed frames instead of stalling the ring on them
+    if (setsockopt(ringFd_, SOL_PACKET, PACKET_LOSS,
+                &loss, sizeof(loss)) < 0)
+        qDebug("%s: PACKET_LOSS failed: %s", __FUNCTION__, strerror(errno));
+
+    setQdiscBypass(ringFd_, isQdiscBypass_);
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = kBlockSize;
+    req.tp_block_nr = kBlockCount;
+    req.tp_frame_size = kFrameSize;
+    req.tp_frame_nr = frameCount_;
+    if (setsockopt(ringFd_, SOL_PACKET, PACKET_TX_RING,
+                &req, sizeof(req)) < 0)
+        goto _no_ring;
+
+    ring = mmap(NULL, kBlockSize*kBlockCount, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ringFd_, 0);
+    if (ring == MAP_FAILED)
+        goto _no_ring;
+    ring_ = (uchar*) ring;
+    frameIndex_ = 0;
+
+    qDebug("%s: %s: TX ring of %d frames", __FUNCTION__,
+            device_.constData(), frameCount_);
+    return;
+
+_no_ring:
+    qWarning("%s: TX ring not available for %s, using sendmmsg: %s",
+            __FUNCTION__, device_.constData(), strerror(errno));
+    if (ringFd_ >= 0)
+        close(ringFd_);
+    ringFd_ = -1;
+}
+
+/*!
+  Tears down the TX ring, if any, and closes its socket
+*/
+void LinuxPort::BatchTransmitter::releaseRing()
+{
+    if (ring_)
+    {
+        struct tpacket_req req;
+
+        munmap(ring_, kBlockSize*kBlockCount);
+        ring_ = NULL;
+
+        memset(&req, 0, sizeof(req));
+        if (setsockopt(ringFd_, SOL_PACKET, PACKET_TX_RING,
+                    &req, sizeof(req)) < 0)
+            qDebug("%s: PACKET_TX_RING release failed: %s", __FUNCTION__,
+                    strerror(errno));
+    }
+
+    if (ringFd_ >= 0)
+        close(ringFd_);
+    ringFd_ = -1;
+    isRingTried_ = false;
+}
+
+/*!
+  Sets whether the packets skip the qdisc layer of the kernel
+  (PACKET_QDISC_BYPASS) - faster, but the packets are neither shaped nor
+  seen by packet sockets such as tcpdump on the port
+*/
+void LinuxPort::BatchTransmitter::setQdiscBypass(bool bypass)
+{
+    isQdiscBypass_ = bypass;
+
+    if (fd_ < 0)
+        return;
+
+    setQdiscBypass(fd_, bypass);
+    if (ringFd_ >= 0)
+        setQdiscBypass(ringFd_, bypass);
+}
+
+void LinuxPort::BatchTransmitter::setQdiscBypass(int fd, bool bypass)
+{
+#ifdef PACKET_QDISC_BYPASS
+    int val = bypass ? 1 : 0;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+                &val, sizeof(val)) < 0)
+        qWarning("%s: PACKET_QDISC_BYPASS failed: %s", __FUNCTION__,
+                strerror(errno));
+#else
+    if (bypass)
+        qWarning("%s: PACKET_QDISC_BYPASS not supported", __FUNCTION__);
+#endif
+}
+
+/*!
+  Sets the clock of the departure times (SO_TXTIME) of the packets - the
+  one the qdisc of the port paces them with. Returns false if not possible
+
+  Pass -1 to pace the packets with udelay() instead (the default). The
+  socket option itself can't be undone, but packets without a departure
+  time are sent right away anyway
+
+  The packets with a departure time go out with sendmmsg() on the plain
+  socket - never the ring socket, whose send() ignores the buffer passed
+  to it. A ring set up by an earlier transmit is released as it won't be
+  used; setupRing() sets it up again if SO_TXTIME is turned off later
+*/
+bool LinuxPort::BatchTransmitter::setTxTime(int clock)
+{
+    txTimeClock_ = -1;
+
+    if (clock < 0)
+        return true;
+
+    if (fd_ < 0)
+        return false;
+
+#ifdef SO_TXTIME
+    struct sock_txtime txTime;
+
+    txTime.clockid = clock;
+    txTime.flags = 0;
+    if (setsockopt(fd_, SOL_SOCKET, SO_TXTIME, &txTime, sizeof(txTime)) < 0)
+    {
+        qWarning("%s: SO_TXTIME failed: %s", __FUNCTION__, strerror(errno));
+        return false;
+    }
+
+    txTimeClock_ = clock;
+    releaseRing();
+    return true;
+#else
+    qWarning("%s: SO_TXTIME not supported", __FUNCTION__);
+    return false;
+#endif
+}
+
+/*!
+  Same as PortTransmitter::sendQueueTransmit() but with the packets sent
+  in batches - a packet due within the timer slack of the one before it
+  joins the same batch, so back to back packets go out with one syscall.
+  The batch is handed over to the kernel when the next packet is due
+  later, the batch is full or the send queue is done with
+*/
+int LinuxPort::BatchTransmitter::sendQueueTransmit(pcap_send_queue *queue,
+        long &overHead, int sync, PacketVariation *variation)
+{
+    const int kMaxFrameLen = kFrameSize - TPACKET2_HDRLEN
+                                + sizeof(struct sockaddr_ll);
+    struct timespec ovrStart, ovrEnd;
+    struct timeval ts;
+    struct pcap_pkthdr *hdr = (struct pcap_pkthdr*) queue->buffer;
+    char *end = queue->buffer + queue->len;
+
+    if (fd_ < 0)
+        return PortTransmitter::sendQueueTransmit(queue, overHead, sync,
+                variation);
+
+    if (sync && (txTimeClock_ >= 0))
+        return txTimeTransmit(queue, overHead, variation);
+
+    ts = hdr->ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ovrStart);
+    while((char*) hdr < end)
+    {
+        uchar *pkt = (uchar*)hdr + sizeof(*hdr);
+        int pktLen = hdr->caplen;
+
+        if (sync)
+        {
+            long usec = (hdr->ts.tv_sec - ts.tv_sec) * 1000000 +
+                (hdr->ts.tv_usec - ts.tv_usec);
+
+            clock_gettime(CLOCK_MONOTONIC, &ovrEnd);
+
+            overHead -= udiffTimeStamp(&ovrStart, &ovrEnd);
+            usec += overHead;
+
+            // A packet due within the slack is batched with the ones before
+            // it and overHead goes positive - we're ahead of schedule by that
+            // much; otherwise the batch is due before this packet and the
+            // time taken to send it is part of the wait
+            if (usec > timerSlack_)
+            {
+                if (pending_)
+                {
+                    ovrStart = ovrEnd;
+                    flush();
+                    clock_gettime(CLOCK_MONOTONIC, &ovrEnd);
+                    usec -= udiffTimeStamp(&ovrStart, &ovrEnd);
+                }
+
+                if (usec > 0)
+                {
+                    udelay(usec);
+                    overHead = 0;
+                }
+                else
+                    overHead = usec;
+            }
+            else
+                overHead = usec;
+
+            ts = hdr->ts;
+            clock_gettime(CLOCK_MONOTONIC, &ovrStart);
+        }
+
+        Q_ASSERT(pktLen > 0);
+
+        if (usingRing() && (pktLen <= kMaxFrameLen))
+        {
+            struct tpacket2_hdr *frame = (struct tpacket2_hdr*) nextFrame();
+            uchar *data;
+
+            if (!frame)
+                return -2;
+
+            data = (uchar*) frame + TPACKET2_HDRLEN
+                                    - sizeof(struct sockaddr_ll);
+            memcpy(data, pkt, pktLen);
+            if (variation)
+                variation->variation.apply(data, pktLen,
+                        variation->frameIndex++);
+
+            frame->tp_len = pktLen;
+            __sync_synchronize();
+            frame->tp_status = TP_STATUS_SEND_REQUEST;
+            pending_++;
+
+            stats_->txPkts++;
+            stats_->txBytes += pktLen;
+        }
+        else if (!usingRing())
+        {
+            // Sent straight from the send queue - counted in stats when
+            // actually sent, see flush()
+            if (variation)
+                variation->variation.apply(pkt, pktLen,
+                        variation->frameIndex++);
+
+            iovs_[pending_].iov_base = pkt;
+            iovs_[pending_].iov_len = pktLen;
+            msgs_[pending_].msg_hdr.msg_control = NULL;
+            msgs_[pending_].msg_hdr.msg_controllen = 0;
+            if (++pending_ == kMaxBatch)
+                flush();
+        }
+        else
+        {
+            // Too big for a ring frame (jumbo) - sent by itself on the
+            // plain socket after the ring is flushed to keep the packet
+            // order (as far as the kernel keeps it across the two sockets)
+            flush();
+            if (variation)
+                variation->variation.apply(pkt, pktLen,
+                        variation->frameIndex++);
+            if (sendOne(pkt, pktLen))
+            {
+                stats_->txPkts++;
+                stats_->txBytes += pktLen;
+            }
+        }
+
+        // Step to the next packet in the buffer
+        hdr = (struct pcap_pkthdr*) (pkt + pktLen);
+        pkt = (uchar*) ((uchar*)hdr + sizeof(*hdr));
+
+        if (stop_)
+        {
+            flush();
+            return -2;
+        }
+    }
+
+    flush();
+
+    return 0;
+}
+
+/*!
+  Same as sendQueueTransmit() but the packets are handed over to the
+  kernel ahead of time (by kTxTimeLead or so), each with its departure
+  time (SCM_TXTIME) for the qdisc to send it at. The thread sleeps only
+  to not get too far ahead of the qdisc, so there's no busy waiting
+
+  The departure times follow the packet timestamps, starting kTxTimeLead
+  from now. When the thread falls behind, the rest of the packets are
+  pushed out by as much; as with udelay() pacing, overHead carries over
+  how far behind (or ahead) of the schedule the sequence ends
+*/
+int LinuxPort::BatchTransmitter::txTimeTransmit(pcap_send_queue *queue,
+        long &overHead, PacketVariation *variation)
+{
+    const quint64 kHorizon = 2*kTxTimeLead;
+    struct pcap_pkthdr *hdr = (struct pcap_pkthdr*) queue->buffer;
+    char *end = queue->buffer + queue->len;
+    struct timeval first = hdr->ts;
+    struct timespec now;
+    quint64 nsecNow, base, txTime = 0;
+    long late;      // in usecs
+
+    clock_gettime(txTimeClock_, &now);
+    nsecNow = now.tv_sec*quint64(1e9) + now.tv_nsec;
+    base = nsecNow + kTxTimeLead;
+    late = overHead < 0 ? -overHead : 0;
+
+    while((char*) hdr < end)
+    {
+        uchar *pkt = (uchar*)hdr + sizeof(*hdr);
+        int pktLen = hdr->caplen;
+        struct cmsghdr *cmsg;
+
+        txTime = base + (hdr->ts.tv_sec - first.tv_sec)*quint64(1e9)
+                    + (hdr->ts.tv_usec - first.tv_usec)*1000LL;
+
+        clock_gettime(txTimeClock_, &now);
+        nsecNow = now.tv_sec*quint64(1e9) + now.tv_nsec;
+
+        if (txTime > nsecNow + kHorizon)
+        {
+            // Too far ahead of the qdisc - wait till this one's due soon
+            flush();
+            now.tv_sec = (txTime - kHorizon) / quint64(1e9);
+            now.tv_nsec = (txTime - kHorizon) % quint64(1e9);
+            while (clock_nanosleep(txTimeClock_, TIMER_ABSTIME, &now, NULL)
+                    == EINTR)
+                ;
+        }
+        else if (txTime < nsecNow + kTxTimeLead/2)
+        {
+            // Behind - a departure time already past may be dropped by
+            // the qdisc, so this and the rest go out that much later
+            quint64 shift = nsecNow + kTxTimeLead - txTime;
+
+            base += shift;
+            txTime += shift;
+            late += shift/1000;
+        }
+
+        Q_ASSERT(pktLen > 0);
+
+        if (variation)
+            variation->variation.apply(pkt, pktLen, variation->frameIndex++);
+
+        cmsg = (struct cmsghdr*) (cmsgs_
+                    + pending_*CMSG_SPACE(sizeof(quint64)));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(quint64));
+        memcpy(CMSG_DATA(cmsg), &txTime, sizeof(txTime));
+
+        iovs_[pending_].iov_base = pkt;
+        iovs_[pending_].iov_len = pktLen;
+        msgs_[pending_].msg_hdr.msg_control = cmsg;
+        msgs_[pending_].msg_hdr.msg_controllen =
+                CMSG_SPACE(sizeof(quint64));
+        if (++pending_ == kMaxBatch)
+            flush();
+
+        // Step to the next packet in the buffer
+        hdr = (struct pcap_pkthdr*) (pkt + pktLen);
+
+        if (stop_)
+        {
+            flush();
+            return -2;
+        }
+    }
+
+    flush();
+
+    // The next sequence is due after the last packet of this one goes out
+    // less the lead it will be sent with - and the lateness so far
+    clock_gettime(txTimeClock_, &now);
+    nsecNow = now.tv_sec*quint64(1e9) + now.tv_nsec;
+    overHead = (long(txTime - nsecNow) - kTxTimeLead)/1000 - late;
+
+    return 0;
+}
+
+/*!
+  Returns the next frame of the ring to be filled, waiting for the kernel
+  to be done with it if required - returns NULL if transmit is stopped
+  while waiting
+*/
+uchar* LinuxPort::BatchTransmitter::nextFrame()
+{
+    uchar *frame = ring_ + frameIndex_*kFrameSize;
+    volatile __u32 *status = &((struct tpacket2_hdr*) frame)->tp_status;
+
+    while (*status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+    {
+        // Ring full - kick the kernel and wait for it to free up frames
+        flush();
+        waitWritable(ringFd_);
+
+        if (stop_)
+            return NULL;
+    }
+
+    if (*status & TP_STATUS_WRONG_FORMAT)
+        qDebug("%s: frame %d dropped by kernel", __FUNCTION__, frameIndex_);
+
+    frameIndex_ = (frameIndex_ + 1) % frameCount_;
+
+    return frame;
+}
+
+/*!
+  Hands over the batched packets to the kernel for transmit
+
+  With sendmmsg(), a partial send is retried for the rest of the batch
+  and only the packets actually sent are counted in the stats
+*/
+void LinuxPort::BatchTransmitter::flush()
+{
+    int count = pending_;
+    int sent = 0;
+
+    if (!pending_)
+        return;
+
+    pending_ = 0;
+
+    if (usingRing())
+    {
+        if (send(ringFd_, NULL, 0, MSG_DONTWAIT) < 0 && (errno != EAGAIN))
+            qDebug("%s: send failed: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+
+    while (sent < count)
+    {
+        int n = sendmmsg(fd_, msgs_ + sent, count - sent, 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // Device queue full - wait for it to drain a bit
+            if (((errno == ENOBUFS) || (errno == EAGAIN)) && !stop_)
+            {
+                waitWritable(fd_);
+                continue;
+            }
+
+            qDebug("%s: sendmmsg failed, %d of %d packets not sent: %s",
+                    __FUNCTION__, count - sent, count, strerror(errno));
+            break;
+        }
+
+        for (int i = sent; i < sent + n; i++)
+        {
+            stats_->txPkts++;
+            stats_->txBytes += iovs_[i].iov_len;
+        }
+        sent += n;
+    }
+}
+
+/*!
+  Sends a single packet on the plain socket, waiting for the device queue
+  to drain if it's full - returns false if the packet couldn't be sent
+*/
+bool LinuxPort::BatchTransmitter::sendOne(const uchar *pkt, int pktLen)
+{
+    while (send(fd_, pkt, pktLen, 0) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+
+        if (((errno == ENOBUFS) || (errno == EAGAIN)) && !stop_)
+        {
+            waitWritable(fd_);
+            continue;
+        }
+
+        qDebug("%s: send of %d byte packet failed: %s", __FUNCTION__,
+                pktLen, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void LinuxPort::BatchTransmitter::waitWritable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, 1 /* ms */);
+}
+
+// Pcap capture file format
+static const quint32 kPcapFileMagic = 0xa1b2c3d4;
+static const quint32 kDltEthernet = 1;
+
+struct PcapFileHeader {
+    quint32 magicNumber;
+    quint16 versionMajor;
+    quint16 versionMinor;
+    qint32  thisZone;
+    quint32 sigfigs;
+    quint32 snapLen;
+    quint32 network;
+};
+
+struct PcapPacketHeader {
+    quint32 tsSec;
+    quint32 tsUsec;
+    quint32 inclLen;
+    quint32 origLen;
+};
+
+LinuxPort::RingCapturer::RingCapturer(const char *device,
+        AbstractPort::PortStats *stats)
+    : PortCapturer(device)
+{
+    stats_ = stats;
+    threadCount_ = 1;
+    isWriteFailed_ = false;
+    fileFd_ = -1;
+    fileSize_ = 0;
+}
+
+void LinuxPort::RingCapturer::setThreadCount(int count)
+{
+    threadCount_ = qBound(1, count, QThread::idealThreadCount());
+}
+
+void LinuxPort::RingCapturer::run()
+{
+    QList<Ring*> rings;
+    PcapFileHeader fileHdr;
+    struct iovec iov;
+    int fanoutId = (getpid() ^ int(quintptr(this) >> 4)) & 0xffff;
+
+    qDebug("In %s", __PRETTY_FUNCTION__);
+
+    if (!openCaptureFile())
+        goto _exit;
+
+    for (int i = 0; i < threadCount_; i++)
+    {
+        Ring *ring = new Ring(this);
+
+        if (!ring->open(threadCount_ > 1 ? fanoutId : -1))
+        {
+            delete ring;
+            break;
+        }
+        rings.append(ring);
+    }
+
+    if (rings.isEmpty())
+    {
+        qWarning("%s: no capture ring for %s, using pcap", __FUNCTION__,
+                device_.toAscii().constData());
+        PortCapturer::run();
+        return;
+    }
+
+    fileFd_ = ::open(capFile_.fileName().toAscii().constData(),
+                    O_WRONLY | O_TRUNC);
+    if (fileFd_ < 0)
+    {
+        qWarning("%s: unable to open cap file: %s", __FUNCTION__,
+                strerror(errno));
+        goto _close_rings;
+    }
+
+    fileHdr.magicNumber = kPcapFileMagic;
+    fileHdr.versionMajor = 2;
+    fileHdr.versionMinor = 4;
+    fileHdr.thisZone = 0;
+    fileHdr.sigfigs = 0;
+    // GRO/LRO can hand over packets bigger than 64K
+    fileHdr.snapLen = 262144;
+    fileHdr.network = kDltEthernet;
+    iov.iov_base = &fileHdr;
+    iov.iov_len = sizeof(fileHdr);
+    isWriteFailed_ = false;
+    fileSize_ = sizeof(fileHdr);
+    if (!writeFile(&iov, 1, 0))
+        goto _close_file;
+
+    state_ = kRunning;
+
+    // This thread reads the first ring, the others have their own
+    for (int i = 1; i < rings.size(); i++)
+        rings.at(i)->start();
+    rings.at(0)->run();
+    for (int i = 1; i < rings.size(); i++)
+        rings.at(i)->wait();
+
+    qDebug("user requested capture stop\n");
+
+_close_file:
+    close(fileFd_);
+    fileFd_ = -1;
+    stop_ = false;
+
+_close_rings:
+    qDeleteAll(rings);
+
+_exit:
+    state_ = kFinished;
+}
+
+/*!
+  Returns the capture file offset to write size bytes at - the rings'
+  threads write their blocks side by side, each at its own offset
+*/
+quint64 LinuxPort::RingCapturer::reserveFile(quint64 size)
+{
+    QMutexLocker locker(&fileMutex_);
+    quint64 offset = fileSize_;
+
+    fileSize_ += size;
+    return offset;
+}
+
+/*
+ * Skips the first written bytes of the count entries of iov - *iov and
+ * the entry written in part are adjusted in place to what's left to
+ * write; returns the count of entries left
+ */
+static int skipWritten(struct iovec **iov, int count, size_t written)
+{
+    while (count && (written >= (*iov)->iov_len))
+    {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        count--;
+    }
+
+    if (count)
+    {
+        (*iov)->iov_base = (char*) (*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+
+    return count;
+}
+
+/*!
+  Writes count packets (with their pcap headers) to the capture file at
+  offset - in one go unless the write is short, the rest is written
+  then. The entries of iov may be changed. Stops the capture on error
+*/
+bool LinuxPort::RingCapturer::writeFile(struct iovec *iov, int count,
+        quint64 offset)
+{
+    while (count && !isWriteFailed_)
+    {
+        ssize_t ret = pwritev(fileFd_, iov, count, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        // Nothing written is no better than an error - it'd be forever
+        if (ret <= 0)
+        {
+            stopOnWriteError(ret < 0 ? errno : ENOSPC);
+            return false;
+        }
+
+        offset += ret;
+        count = skipWritten(&iov, count, ret);
+    }
+
+    return !isWriteFailed_;
+}
+
+/*!
+  Stops the capture for good on a capture file write error - there's no
+  point in capturing packets that can't be written; the capture file has
+  all of the packets till then (less those of the failed write)
+*/
+void LinuxPort::RingCapturer::stopOnWriteError(int error)
+{
+    if (isWriteFailed_)
+        return;
+
+    qWarning("%s: cap file write failed, stopping capture on %s: %s",
+            __FUNCTION__, device_.toAscii().constData(), strerror(error));
+    isWriteFailed_ = true;
+    stop_ = true;
+}
+
+LinuxPort::RingCapturer::Ring::Ring(RingCapturer *capturer)
+{
+    capturer_ = capturer;
+    fd_ = -1;
+    ring_ = NULL;
+    blockIndex_ = 0;
+
+    uringFd_ = -1;
+    sqMap_ = cqMap_ = NULL;
+    sqes_ = NULL;
+    toSubmit_ = 0;
+    writesInFlight_ = 0;
+    for (int i = 0; i < kBlockCount; i++)
+        writesPending_[i] = 0;
+}
+
+LinuxPort::RingCapturer::Ring::~Ring()
+{
+    closeUring();
+    if (ring_)
+        munmap(ring_, kBlockSize*kBlockCount);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+/*!
+  Sets up the ring on the capturer's port - joins the fanout group fanoutId
+  unless it is -1
+*/
+bool LinuxPort::RingCapturer::Ring::open(int fanoutId)
+{
+    QByteArray device = capturer_->device_.toAscii();
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    struct packet_mreq mreq;
+    int version = TPACKET_V3;
+    void *ring;
+
+    fd_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd_ < 0)
+        goto _error;
+
+    if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION,
+                &version, sizeof(version)) < 0)
+        goto _error;
+
+    // Blocks are handed over when full or after the timeout, whichever
+    // is earlier
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = kBlockSize;
+    req.tp_block_nr = kBlockCount;
+    req.tp_frame_size = kFrameSize;
+    req.tp_frame_nr = (kBlockSize/kFrameSize) * kBlockCount;
+    req.tp_retire_blk_tov = 100; // ms
+    if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        goto _error;
+
+    ring = mmap(NULL, kBlockSize*kBlockCount, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd_, 0);
+    if (ring == MAP_FAILED)
+        goto _error;
+    ring_ = (uchar*) ring;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(device.constData());
+    if (bind(fd_, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+        goto _error;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = addr.sll_ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                &mreq, sizeof(mreq)) < 0)
+        qDebug("%s:can't set promiscuous mode, trying non-promisc",
+                device.constData());
+
+    if (fanoutId >= 0)
+    {
+        int fanout = fanoutId | (PACKET_FANOUT_HASH << 16);
+
+        if (setsockopt(fd_, SOL_PACKET, PACKET_FANOUT,
+                    &fanout, sizeof(fanout)) < 0)
+            goto _error;
+    }
+
+    if (!openUring())
+        qDebug("%s: io_uring not available for %s, writing synchronously",
+                __FUNCTION__, device.constData());
+
+    return true;
+
+_error:
+    qDebug("%s: capture ring not available for %s: %s", __FUNCTION__,
+            device.constData(), strerror(errno));
+    return false;
+}
+
+/*!
+  Writes out the blocks of the ring as the kernel fills them till the
+  capturer is stopped
+*/
+void LinuxPort::RingCapturer::Ring::run()
+{
+    while (!capturer_->stop_)
+    {
+        volatile __u32 *status = &block(blockIndex_)->hdr.bh1.block_status;
+
+        // A block still being written is not the kernel's yet either
+        if (writesPending_[blockIndex_] || !(*status & TP_STATUS_USER))
+        {
+            struct pollfd pfd[2];
+            int n = 1;
+
+            pfd[0].fd = fd_;
+            pfd[0].events = POLLIN | POLLERR;
+            pfd[0].revents = 0;
+            if (writesInFlight_)
+            {
+                if (toSubmit_)
+                    submitWrites(0);
+
+                pfd[1].fd = uringFd_;
+                pfd[1].events = POLLIN;
+                pfd[1].revents = 0;
+                n++;
+            }
+            poll(pfd, n, 100 /* ms */);
+
+            reapWrites();
+            updateDrops();
+            continue;
+        }
+
+        __sync_synchronize();
+        if (writeBlock(blockIndex_))
+            releaseBlock(blockIndex_);
+
+        blockIndex_ = (blockIndex_ + 1) % kBlockCount;
+    }
+
+    while (writesInFlight_ && submitWrites(1))
+        reapWrites();
+
+    updateDrops();
+}
+
+/*!
+  Writes the packets of the block at index to the capture file - with as
+  few writev()s as possible. Returns true if done; with io_uring the
+  writes are only queued and the block is released once they are done -
+  see reapWrites()
+
+  The tpacket headers are turned into pcap headers in place - each pcap
+  header is written over the (unused) bytes just before its packet
+*/
+bool LinuxPort::RingCapturer::Ring::writeBlock(int index)
+{
+    int count = block(index)->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr*) ((uchar*) block(index)
+            + block(index)->hdr.bh1.offset_to_first_pkt);
+    QVector<struct iovec> &iov = iovs_[index];
+    QVector<quint32> &vlanTags = vlanTags_[index];
+    int n = 0, start = 0;
+    quint64 size = 0;
+
+    // Stay as is till the writes of the block are done - a packet takes
+    // upto 3 entries, see below
+    iov.resize(3*count);
+    vlanTags.resize(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        PcapPacketHeader pktHdr;
+        uchar *pkt = (uchar*) hdr + hdr->tp_mac;
+        bool hasVlan = (hdr->tp_status & TP_STATUS_VLAN_VALID)
+                        && (hdr->tp_snaplen >= 2*ETH_ALEN);
+
+        // writev() takes at most IOV_MAX entries at a time
+        if (n + 3 - start > IOV_MAX)
+        {
+            queueWrite(index, iov.data() + start, n - start, size);
+            start = n;
+            size = 0;
+        }
+
+        pktHdr.tsSec = hdr->tp_sec;
+        pktHdr.tsUsec = hdr->tp_nsec / 1000;
+        pktHdr.inclLen = hdr->tp_snaplen;
+        pktHdr.origLen = hdr->tp_len;
+
+        if (hasVlan)
+        {
+            pktHdr.inclLen += sizeof(quint32);
+            pktHdr.origLen += sizeof(quint32);
+        }
+
+        Q_ASSERT(hdr->tp_mac >= sizeof(*hdr) + sizeof(pktHdr));
+        memcpy(pkt - sizeof(pktHdr), &pktHdr, sizeof(pktHdr));
+
+        iov[n].iov_base = pkt - sizeof(pktHdr);
+        iov[n].iov_len = sizeof(pktHdr) + hdr->tp_snaplen;
+
+        // The kernel strips the VLAN tag of the packet into the header -
+        // put it back in after the MAC addresses
+        if (hasVlan)
+        {
+            quint16 tpid = ETH_P_8021Q;
+
+#ifdef TP_STATUS_VLAN_TPID_VALID
+            if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID)
+                tpid = hdr->hv1.tp_vlan_tpid;
+#endif
+            vlanTags[i] = htonl((quint32(tpid) << 16)
+                                | (hdr->hv1.tp_vlan_tci & 0xffff));
+
+            iov[n].iov_len = sizeof(pktHdr) + 2*ETH_ALEN;
+            n++;
+            iov[n].iov_base = &vlanTags[i];
+            iov[n].iov_len = sizeof(quint32);
+            n++;
+            iov[n].iov_base = pkt + 2*ETH_ALEN;
+            iov[n].iov_len = hdr->tp_snaplen - 2*ETH_ALEN;
+        }
+
+        size += sizeof(pktHdr) + pktHdr.inclLen;
+        n++;
+
+        hdr = (struct tpacket3_hdr*) ((uchar*) hdr + hdr->tp_next_offset);
+    }
+
+    if (n > start)
+        queueWrite(index, iov.data() + start, n - start, size);
+
+    if (toSubmit_)
+        submitWrites(0);
+
+    return writesPending_[index] == 0;
+}
+
+/*!
+  Writes count packets of the block at index (size bytes in all) at the
+  end of the capture file - queued to io_uring if available, else right
+  away
+*/
+void LinuxPort::RingCapturer::Ring::queueWrite(int index,
+        struct iovec *iov, int count, quint64 size)
+{
+    quint64 offset;
+
+    // The capture is stopping anyway
+    if (capturer_->isWriteFailed_)
+        return;
+
+    offset = capturer_->reserveFile(size);
+
+#ifdef HAVE_IO_URING
+    if (uringFd_ >= 0)
+    {
+        Write write;
+        int slot;
+
+        write.index = index;
+        write.iov = iov;
+        write.count = count;
+        write.offset = offset;
+
+        if (freeWrites_.isEmpty())
+        {
+            slot = writes_.size();
+            writes_.append(write);
+        }
+        else
+        {
+            slot = freeWrites_.takeLast();
+            writes_[slot] = write;
+        }
+
+        if (queueUringWrite(slot))
+        {
+            writesPending_[index]++;
+            return;
+        }
+        freeWrites_.append(slot);
+    }
+#else
+    Q_UNUSED(index);
+#endif
+
+    capturer_->writeFile(iov, count, offset);
+}
+
+/*!
+  Queues the write at slot of writes_ to io_uring - returns false if
+  there's no room even after submitting those queued so far
+*/
+bool LinuxPort::RingCapturer::Ring::queueUringWrite(int slot)
+{
+#ifdef HAVE_IO_URING
+    const Write &write = writes_.at(slot);
+    struct io_uring_sqe *sqe;
+    quint32 tail = *sqTail_;
+    quint32 i = tail & sqMask_;
+
+    // The kernel takes in the queued writes when submitted - so make
+    // room by submitting if it's full
+    if ((tail - *sqHead_) == sqEntries_)
+        submitWrites(0);
+    if ((tail - *sqHead_) == sqEntries_)
+        return false;
+
+    sqe = &sqes_[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = capturer_->fileFd_;
+    sqe->addr = quint64(quintptr(write.iov));
+    sqe->len = write.count;
+    sqe->off = write.offset;
+    sqe->user_data = slot;
+    sqArray_[i] = i;
+
+    __sync_synchronize();
+    *sqTail_ = tail + 1;
+
+    toSubmit_++;
+    writesInFlight_++;
+    return true;
+#else
+    Q_UNUSED(slot);
+    return false;
+#endif
+}
+
+/*!
+  Hands over the block at index back to the kernel to fill
+*/
+void LinuxPort::RingCapturer::Ring::releaseBlock(int index)
+{
+    __sync_synchronize();
+    block(index)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+}
+
+/*!
+  Sets up the io_uring for the capture file writes - with raw syscalls,
+  there's no liburing dependency
+*/
+bool LinuxPort::RingCapturer::Ring::openUring()
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    void *map;
+
+    memset(&params, 0, sizeof(params));
+    uringFd_ = syscall(__NR_io_uring_setup, kUringEntries, &params);
+    if (uringFd_ < 0)
+        goto _error;
+
+    sqMapSize_ = params.sq_off.array + params.sq_entries*sizeof(quint32);
+    map = mmap(NULL, sqMapSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uringFd_, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        goto _error;
+    sqMap_ = map;
+
+    cqMapSize_ = params.cq_off.cqes
+                    + params.cq_entries*sizeof(struct io_uring_cqe);
+    map = mmap(NULL, cqMapSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uringFd_, IORING_OFF_CQ_RING);
+    if (map == MAP_FAILED)
+        goto _error;
+    cqMap_ = map;
+
+    sqesSize_ = params.sq_entries*sizeof(struct io_uring_sqe);
+    map = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uringFd_, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        goto _error;
+    sqes_ = (struct io_uring_sqe*) map;
+
+    sqHead_ = (volatile quint32*) ((char*)sqMap_ + params.sq_off.head);
+    sqTail_ = (volatile quint32*) ((char*)sqMap_ + params.sq_off.tail);
+    sqArray_ = (quint32*) ((char*)sqMap_ + params.sq_off.array);
+    sqMask_ = *(quint32*) ((char*)sqMap_ + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+
+    cqHead_ = (volatile quint32*) ((char*)cqMap_ + params.cq_off.head);
+    cqTail_ = (volatile quint32*) ((char*)cqMap_ + params.cq_off.tail);
+    cqes_ = (struct io_uring_cqe*) ((char*)cqMap_ + params.cq_off.cqes);
+    cqMask_ = *(quint32*) ((char*)cqMap_ + params.cq_off.ring_mask);
+
+    return true;
+
+_error:
+    qDebug("%s: io_uring setup failed: %s", __FUNCTION__, strerror(errno));
+    closeUring();
+#endif
+    return false;
+}
+
+void LinuxPort::RingCapturer::Ring::closeUring()
+{
+    if (sqes_)
+        munmap(sqes_, sqesSize_);
+    if (cqMap_)
+        munmap(cqMap_, cqMapSize_);
+    if (sqMap_)
+        munmap(sqMap_, sqMapSize_);
+    if (uringFd_ >= 0)
+        close(uringFd_);
+
+    sqes_ = NULL;
+    sqMap_ = cqMap_ = NULL;
+    uringFd_ = -1;
+}
+
+/*!
+  Submits the writes queued so far - and waits for at least minComplete
+  of those in flight to be done. Returns false if io_uring fails
+*/
+bool LinuxPort::RingCapturer::Ring::submitWrites(int minComplete)
+{
+#ifdef HAVE_IO_URING
+    int ret;
+
+    ret = syscall(__NR_io_uring_enter, uringFd_, toSubmit_, minComplete,
+            minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0)
+    {
+        if (errno == EINTR)
+            return true;
+        qWarning("%s: io_uring_enter failed: %s", __FUNCTION__,
+                strerror(errno));
+        return false;
+    }
+
+    toSubmit_ -= ret;
+    return true;
+#else
+    Q_UNUSED(minComplete);
+    return false;
+#endif
+}
+
+/*!
+  Releases the blocks whose writes are all done - the rest of a short
+  write is queued again (or written right away if there's no room).
+  Stops the capture on error
+*/
+void LinuxPort::RingCapturer::Ring::reapWrites()
+{
+#ifdef HAVE_IO_URING
+    quint32 head;
+
+    if (uringFd_ < 0)
+        return;
+
+    head = *cqHead_;
+    while (head != *cqTail_)
+    {
+        struct io_uring_cqe *cqe;
+        int slot;
+        int index;
+
+        // The entry is read only after the tail
+        __sync_synchronize();
+        cqe = &cqes_[head & cqMask_];
+        slot = int(cqe->user_data);
+        index = writes_.at(slot).index;
+        head++;
+
+        writesInFlight_--;
+        if (cqe->res < 0)
+            capturer_->stopOnWriteError(-cqe->res);
+        else
+        {
+            Write &write = writes_[slot];
+
+            write.count = skipWritten(&write.iov, write.count, cqe->res);
+            write.offset += cqe->res;
+
+            if (write.count && !capturer_->isWriteFailed_)
+            {
+                // Nothing written - writeFile() fails it for good
+                if ((cqe->res > 0) && queueUringWrite(slot))
+                    continue;
+                capturer_->writeFile(write.iov, write.count, write.offset);
+            }
+        }
+
+        freeWrites_.append(slot);
+        if (--writesPending_[index] == 0)
+            releaseBlock(index);
+    }
+
+    __sync_synchronize();
+    *cqHead_ = head;
+#endif
+}
+
+/*!
+  Adds the packets dropped by the kernel for want of space in the ring
+  since the last time to the port stats
+*/
+void LinuxPort::RingCapturer::Ring::updateDrops()
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    // Reading the stats resets them
+    if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0)
+        return;
+
+    if (stats.tp_drops)
+    {
+        QMutexLocker locker(&capturer_->fileMutex_);
+        capturer_->stats_->captureDrops += stats.tp_drops;
+    }
+}
+
 LinuxPort::StatsMonitor::StatsMonitor()
     : QThread()
 {
@@ -155,6 +1754,7 @@ void LinuxPort::StatsMonitor::run()
 void LinuxPort::StatsMonitor::procStats()
 {
     PortStats **portStats;
+    volatile bool **packetMonitored;
     int fd;
     QByteArray buf;
     int len;
@@ -210,6 +1810,7 @@ void LinuxPort::StatsMonitor::procStats()
     }
 
     portStats = (PortStats**) calloc(count, sizeof(PortStats));
+    packetMonitored = (volatile bool**) calloc(count, sizeof(bool*));
     Q_ASSERT(portStats != NULL);
 
     //
@@ -247,6 +1848,7 @@ void LinuxPort::StatsMonitor::procStats()
                 if (strncmp(port->name(), p, int(q-p)) == 0)
                 {
                     portStats[index] = &(port->stats_);
+                    packetMonitored[index] = &(port->isPacketMonitored_);
 
                     if (setPromisc(port->name()))
                         port->clearPromisc_ = true;
@@ -332,30 +1934,35 @@ void LinuxPort::StatsMonitor::procStats()
                 AbstractPort::PortStats *stats = portStats[index];
                 if (stats)
                 {
-                    stats->rxPps = 
-                        ((rxPkts >= stats->rxPkts) ? 
-                                rxPkts - stats->rxPkts : 
-                                rxPkts + (kMaxValue32 - stats->rxPkts))
-                        / kRefreshFreq_;
-                    stats->rxBps = 
-                        ((rxBytes >= stats->rxBytes) ? 
-                                rxBytes - stats->rxBytes : 
-                                rxBytes + (kMaxValue32 - stats->rxBytes))
-                        / kRefreshFreq_;
-                    stats->rxPkts  = rxPkts;
-                    stats->rxBytes = rxBytes;
-                    stats->txPps = 
-                        ((txPkts >= stats->txPkts) ? 
-                                txPkts - stats->txPkts : 
-                                txPkts + (kMaxValue32 - stats->txPkts))
-                        / kRefreshFreq_;
-                    stats->txBps = 
-                        ((txBytes >= stats->txBytes) ? 
-                                txBytes - stats->txBytes : 
-                                txBytes + (kMaxValue32 - stats->txBytes))
-                        / kRefreshFreq_;
-                    stats->txPkts  = txPkts;
-                    stats->txBytes = txBytes;
+                    // The rx/tx counters of a packet monitored port are
+                    // counted by its monitors
+                    if (!*packetMonitored[index])
+                    {
+                        stats->rxPps = 
+                            ((rxPkts >= stats->rxPkts) ? 
+                                    rxPkts - stats->rxPkts : 
+                                    rxPkts + (kMaxValue32 - stats->rxPkts))
+                            / kRefreshFreq_;
+                        stats->rxBps = 
+                            ((rxBytes >= stats->rxBytes) ? 
+                                    rxBytes - stats->rxBytes : 
+                                    rxBytes + (kMaxValue32 - stats->rxBytes))
+                            / kRefreshFreq_;
+                        stats->rxPkts  = rxPkts;
+                        stats->rxBytes = rxBytes;
+                        stats->txPps = 
+                            ((txPkts >= stats->txPkts) ? 
+                                    txPkts - stats->txPkts : 
+                                    txPkts + (kMaxValue32 - stats->txPkts))
+                            / kRefreshFreq_;
+                        stats->txBps = 
+                            ((txBytes >= stats->txBytes) ? 
+                                    txBytes - stats->txBytes : 
+                                    txBytes + (kMaxValue32 - stats->txBytes))
+                            / kRefreshFreq_;
+                        stats->txPkts  = txPkts;
+                        stats->txBytes = txBytes;
+                    }
 
                     stats->rxDrops = rxDrops;
                     stats->rxErrors = rxErrors;
@@ -373,12 +1980,14 @@ void LinuxPort::StatsMonitor::procStats()
     }
 
     free(portStats);
+    free(packetMonitored);
 }
 
 int LinuxPort::StatsMonitor::netlinkStats()
 {
     QHash<uint, PortStats*> portStats;
     QHash<uint, OstProto::LinkState*> linkState;
+    QHash<uint, volatile bool*> packetMonitored;
     int fd;
     struct sockaddr_nl local;
     struct sockaddr_nl kernel;
@@ -556,6 +2165,8 @@ _retry:
             {
                 portStats[uint(ifi->ifi_index)] = &(port->stats_);
                 linkState[uint(ifi->ifi_index)] = &(port->linkState_);
+                packetMonitored[uint(ifi->ifi_index)] =
+                        &(port->isPacketMonitored_);
 
                 if (setPromisc(port->name()))
                     port->clearPromisc_ = true;
@@ -651,34 +2262,39 @@ _retry_recv:
                     if (!stats)
                         break;
 
-                    stats->rxPps = 
-                        ((rtnlStats->rx_packets >= stats->rxPkts) ?
-                            rtnlStats->rx_packets - stats->rxPkts :
-                            rtnlStats->rx_packets + (kMaxValue32 
-                                                        - stats->rxPkts))
-                        / kRefreshFreq_;
-                    stats->rxBps = 
-                        ((rtnlStats->rx_bytes >= stats->rxBytes) ?
-                            rtnlStats->rx_bytes - stats->rxBytes :
-                            rtnlStats->rx_bytes + (kMaxValue32 
-                                                        - stats->rxBytes))
-                        / kRefreshFreq_;
-                    stats->rxPkts  = rtnlStats->rx_packets;
-                    stats->rxBytes = rtnlStats->rx_bytes;
-                    stats->txPps = 
-                        ((rtnlStats->tx_packets >= stats->txPkts) ?
-                            rtnlStats->tx_packets - stats->txPkts :
-                            rtnlStats->tx_packets + (kMaxValue32 
-                                                        - stats->txPkts))
-                        / kRefreshFreq_;
-                    stats->txBps = 
-                        ((rtnlStats->tx_bytes >= stats->txBytes) ?
-                            rtnlStats->tx_bytes - stats->txBytes :
-                            rtnlStats->tx_bytes + (kMaxValue32 
-                                                        - stats->txBytes))
-                        / kRefreshFreq_;
-                    stats->txPkts  = rtnlStats->tx_packets;
-                    stats->txBytes = rtnlStats->tx_bytes;
+                    // The rx/tx counters of a packet monitored port are
+                    // counted by its monitors
+                    if (!*packetMonitored[ifi->ifi_index])
+                    {
+                        stats->rxPps = 
+                            ((rtnlStats->rx_packets >= stats->rxPkts) ?
+                                rtnlStats->rx_packets - stats->rxPkts :
+                                rtnlStats->rx_packets + (kMaxValue32 
+                                                            - stats->rxPkts))
+                            / kRefreshFreq_;
+                        stats->rxBps = 
+                            ((rtnlStats->rx_bytes >= stats->rxBytes) ?
+                                rtnlStats->rx_bytes - stats->rxBytes :
+                                rtnlStats->rx_bytes + (kMaxValue32 
+                                                            - stats->rxBytes))
+                            / kRefreshFreq_;
+                        stats->rxPkts  = rtnlStats->rx_packets;
+                        stats->rxBytes = rtnlStats->rx_bytes;
+                        stats->txPps = 
+                            ((rtnlStats->tx_packets >= stats->txPkts) ?
+                                rtnlStats->tx_packets - stats->txPkts :
+                                rtnlStats->tx_packets + (kMaxValue32 
+                                                            - stats->txPkts))
+                            / kRefreshFreq_;
+                        stats->txBps = 
+                            ((rtnlStats->tx_bytes >= stats->txBytes) ?
+                                rtnlStats->tx_bytes - stats->txBytes :
+                                rtnlStats->tx_bytes + (kMaxValue32 
+                                                            - stats->txBytes))
+                            / kRefreshFreq_;
+                        stats->txPkts  = rtnlStats->tx_packets;
+                        stats->txBytes = rtnlStats->tx_bytes;
+                    }
 
                     // TODO: export detailed error stats
                     stats->rxDrops =   rtnlStats->rx_dropped 
@@ -710,6 +2326,7 @@ _try_later:
 
     portStats.clear();
     linkState.clear();
+    packetMonitored.clear();
 
     return 0;
 }
@@ -26,6 +26,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "pcapport.h"
 
+#include <QMutex>
+#include <QVector>
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+struct iovec;
+struct mmsghdr;
+struct tpacket_block_desc;
+
 class LinuxPort : public PcapPort
 {
 public:
@@ -38,7 +47,171 @@ public:
     virtual bool hasExclusiveControl();
     virtual bool setExclusiveControl(bool exclusive);
 
+    virtual bool setPacketMonitor(bool enable);
+
+    virtual void startTransmit();
+    virtual void startCapture();
+
 protected:
+    // Transmits the packets in batches on an AF_PACKET socket - via an
+    // mmap'd TX ring (PACKET_MMAP) if available, else with sendmmsg(); the
+    // kernel is kicked once per batch instead of once per packet. Falls
+    // back to pcap if there's no packet socket at all
+    //
+    // With SO_TXTIME, every packet carries its departure time and the
+    // qdisc of the port (etf or fq) paces them instead of udelay()
+    class BatchTransmitter: public PortTransmitter
+    {
+    public:
+        BatchTransmitter(const char *device);
+        ~BatchTransmitter();
+        bool hasSocket() { return fd_ >= 0; }
+        void setQdiscBypass(bool bypass);
+        bool setTxTime(int clock);
+        void setupRing();
+    protected:
+        virtual int sendQueueTransmit(pcap_send_queue *queue, long &overHead,
+                    int sync, PacketVariation *variation = NULL);
+    private:
+        int txTimeTransmit(pcap_send_queue *queue, long &overHead,
+                    PacketVariation *variation);
+        bool usingRing() { return ring_ && (txTimeClock_ < 0); }
+        int openSocket();
+        void releaseRing();
+        void setQdiscBypass(int fd, bool bypass);
+        uchar* nextFrame();
+        void flush();
+        bool sendOne(const uchar *pkt, int pktLen);
+        void waitWritable(int fd);
+
+        static const int kFrameSize = 2048;
+        static const int kBlockSize = 1 << 16;
+        static const int kBlockCount = 64;
+        static const int kMaxBatch = 64;    //!< for sendmmsg()
+        static const int kTxTimeLead = 500000;  //!< in nsecs
+
+        QByteArray device_;
+        int fd_;                //!< plain socket - sendmmsg() and jumbos
+        long timerSlack_;       //!< in usecs
+        int pending_;           //!< packets batched since the last kick
+        bool isQdiscBypass_;
+
+        // TX ring - see setupRing()
+        bool isRingTried_;
+        int ringFd_;            //!< socket of the ring, -1 if none
+        uchar *ring_;
+        int frameCount_;
+        int frameIndex_;
+
+        // sendmmsg() batch - the packets aren't copied
+        struct mmsghdr *msgs_;
+        struct iovec *iovs_;
+
+        // SO_TXTIME - the ring can't carry a departure time per packet,
+        // so the packets are sent with sendmmsg() on the plain socket
+        // (see usingRing() and setTxTime())
+        int txTimeClock_;       //!< -1 if not in use
+        char *cmsgs_;           //!< SCM_TXTIME of each packet of the batch
+    };
+
+    // Captures via AF_PACKET TPACKET_V3 RX rings - the packets of a whole
+    // block of the ring are written to the capture file at a time. More
+    // than one ring (each with its own thread) share the rx traffic as a
+    // PACKET_FANOUT group if asked for. Falls back to pcap if there's no
+    // ring
+    //
+    // With io_uring, the file writes are queued and the ring is read on
+    // while they are done - a block goes back to the kernel once written
+    class RingCapturer: public PortCapturer
+    {
+    public:
+        RingCapturer(const char *device, AbstractPort::PortStats *stats);
+        void setThreadCount(int count);
+        void run();
+
+    private:
+        class Ring: public QThread
+        {
+        public:
+            Ring(RingCapturer *capturer);
+            ~Ring();
+            bool open(int fanoutId);
+            void run();
+        private:
+            struct tpacket_block_desc* block(int index) {
+                return (struct tpacket_block_desc*) (ring_ + index*kBlockSize);
+            }
+            bool writeBlock(int index);
+            void queueWrite(int index, struct iovec *iov, int count,
+                    quint64 size);
+            void releaseBlock(int index);
+            void updateDrops();
+
+            bool openUring();
+            void closeUring();
+            bool queueUringWrite(int slot);
+            bool submitWrites(int minComplete);
+            void reapWrites();
+
+            static const int kBlockSize = 1 << 22;
+            static const int kBlockCount = 8;
+            static const int kFrameSize = 2048;
+            static const int kUringEntries = 256;
+
+            RingCapturer *capturer_;
+            int fd_;
+            uchar *ring_;
+            int blockIndex_;
+            QVector<struct iovec> iovs_[kBlockCount];
+            QVector<quint32> vlanTags_[kBlockCount];    //!< see writeBlock()
+
+            // io_uring for the capture file writes - uringFd_ is -1 if not
+            // available, the writes are done right away then
+            int uringFd_;
+            void *sqMap_;
+            size_t sqMapSize_;
+            void *cqMap_;
+            size_t cqMapSize_;
+            struct io_uring_sqe *sqes_;
+            size_t sqesSize_;
+            volatile quint32 *sqHead_;
+            volatile quint32 *sqTail_;
+            quint32 *sqArray_;
+            quint32 sqMask_;
+            quint32 sqEntries_;
+            volatile quint32 *cqHead_;
+            volatile quint32 *cqTail_;
+            struct io_uring_cqe *cqes_;
+            quint32 cqMask_;
+            int toSubmit_;
+            int writesInFlight_;
+            int writesPending_[kBlockCount];    //!< per block
+
+            // A write queued to io_uring - its user_data is the index of
+            // its entry in writes_
+            struct Write
+            {
+                int index;          //!< of the block
+                struct iovec *iov;  //!< what's left to write of it
+                int count;
+                quint64 offset;
+            };
+            QVector<Write> writes_;
+            QList<int> freeWrites_; //!< entries of writes_ not in use
+        };
+
+        quint64 reserveFile(quint64 size);
+        bool writeFile(struct iovec *iov, int count, quint64 offset);
+        void stopOnWriteError(int error);
+
+        AbstractPort::PortStats *stats_;
+        int threadCount_;
+        volatile bool isWriteFailed_;
+        int fileFd_;
+        quint64 fileSize_;      //!< written or being written
+        QMutex fileMutex_;      //!< for fileSize_ and stats_
+    };
+
     class StatsMonitor: public QThread
     {
     public:
@@ -58,8 +231,12 @@ protected:
         int ioctlSocket_;
     };
 
+    void setupTxTimePacing();
+
     bool isPromisc_;
     bool clearPromisc_;
+    volatile bool isPacketMonitored_;
+    QString txPacingNote_;  //!< in the port notes - see setupTxTimePacing()
     static QList<LinuxPort*> allPorts_;
     static StatsMonitor *monitor_; // rx/tx stats for ALL ports
 };
@@ -507,6 +507,11 @@ void MyService::getStats(::google::protobuf::RpcController* /*controller*/,
         s->set_rx_errors(stats.rxErrors);
         s->set_rx_fifo_errors(stats.rxFifoErrors);
         s->set_rx_frame_errors(stats.rxFrameErrors);
+
+        s->set_capture_drops(stats.captureDrops);
+
+        s->set_tx_pacing_overshoot_avg(stats.txPacingOvershootAvg);
+        s->set_tx_pacing_overshoot_max(stats.txPacingOvershootMax);
     }
 
     done->Run();
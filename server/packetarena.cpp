@@ -0,0 +1,140 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "packetarena.h"
+
+#include <stdlib.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+PacketArena::PacketArena()
+{
+    current_ = -1;
+    used_ = 0;
+}
+
+PacketArena::~PacketArena()
+{
+    for (int i = 0; i < chunks_.size(); i++)
+        freeChunk(chunks_.at(i));
+}
+
+/*!
+  Returns all of the free space left in the current chunk (its size in
+  size) if it is at least minSize bytes, else all of the next chunk -
+  returns NULL if out of memory
+
+  Nothing more is to be reserved till the block is committed
+*/
+char* PacketArena::reserve(uint minSize, uint *size)
+{
+    Q_ASSERT(minSize <= kChunkSize);
+
+    if ((current_ < 0) || ((kChunkSize - used_) < minSize))
+    {
+        // The chunk kept by clear() is reused
+        if ((current_ + 1 >= chunks_.size()) && !addChunk())
+        {
+            *size = 0;
+            return NULL;
+        }
+        current_++;
+        used_ = 0;
+    }
+
+    *size = kChunkSize - used_;
+    return chunks_.at(current_).base + used_;
+}
+
+/*!
+  Marks the first size bytes of the block last reserved as used - the rest
+  is available for the next reserve()
+*/
+void PacketArena::commit(const char *block, uint size)
+{
+    Q_ASSERT(current_ >= 0);
+    Q_ASSERT(block == chunks_.at(current_).base + used_);
+    Q_UNUSED(block);
+
+    // Keep the blocks 8 byte aligned
+    used_ = (used_ + size + 7) & ~7U;
+    if (used_ > kChunkSize)
+        used_ = kChunkSize;
+}
+
+/*!
+  Takes back all of the blocks in one go - only the first chunk is kept
+  for reuse, the memory of the rest goes back to the OS so that a big
+  packet list doesn't pin its memory (huge pages included) till the port
+  goes away
+*/
+void PacketArena::clear()
+{
+    while (chunks_.size() > 1)
+        freeChunk(chunks_.takeLast());
+
+    current_ = -1;
+    used_ = 0;
+}
+
+bool PacketArena::addChunk()
+{
+    Chunk chunk;
+
+    chunk.base = NULL;
+    chunk.isHugePage = false;
+
+#if defined(Q_OS_LINUX) && defined(MAP_HUGETLB)
+    // Huge pages are used if the admin has set aside some
+    // (vm.nr_hugepages) - one TLB entry per chunk instead of 512
+    void *p = mmap(NULL, kChunkSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        chunk.base = (char*) p;
+        chunk.isHugePage = true;
+    }
+#endif
+
+    if (!chunk.base)
+        chunk.base = (char*) malloc(kChunkSize);
+
+    if (!chunk.base)
+    {
+        qWarning("%s: out of memory", __FUNCTION__);
+        return false;
+    }
+
+    chunks_.append(chunk);
+    return true;
+}
+
+void PacketArena::freeChunk(const Chunk &chunk)
+{
+#ifdef Q_OS_LINUX
+    if (chunk.isHugePage)
+    {
+        munmap(chunk.base, kChunkSize);
+        return;
+    }
+#endif
+    free(chunk.base);
+}
@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _SERVER_PACKET_ARENA_H
+#define _SERVER_PACKET_ARENA_H
+
+#include <QList>
+#include <QtGlobal>
+
+/*
+ * Memory for the packet sequences of a port - handed out from big chunks
+ * one after the other (so the sequences are packed tightly) and taken
+ * back all at once with clear(), which keeps only the first chunk
+ *
+ * A sequence grows till it is done with, so it reserves all of what is
+ * left of the current chunk and then commits what it actually used
+ */
+class PacketArena
+{
+public:
+    PacketArena();
+    ~PacketArena();
+
+    char* reserve(uint minSize, uint *size);
+    void commit(const char *block, uint size);
+    void clear();
+
+    static const uint kChunkSize = 2*1024*1024;
+
+private:
+    struct Chunk
+    {
+        char *base;
+        bool isHugePage;    //!< mmap'd, not malloc'd
+    };
+
+    bool addChunk();
+    void freeChunk(const Chunk &chunk);
+
+    QList<Chunk> chunks_;
+    int current_;           //!< index of the chunk in use
+    uint used_;             //!< bytes used of the chunk in use
+};
+
+#endif
@@ -19,35 +19,44 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "pcapport.h"
 
+#include <QMutexLocker>
 #include <QtGlobal>
 
 #ifdef Q_OS_WIN32
 #include <windows.h>
 #endif
 
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <time.h>
+#endif
+
+// Delays after which the pacing stats are published - see udelay()
+static const quint64 kPacingStatsInterval = 1024;
+
 pcap_if_t *PcapPort::deviceList_ = NULL;
 
 
 #if defined(Q_OS_LINUX)
-typedef struct timeval TimeStamp;
+// Monotonic so that pacing is not thrown off by the wall clock being set
+typedef struct timespec TimeStamp;
 static void inline getTimeStamp(TimeStamp *stamp)
 {
-    gettimeofday(stamp, NULL);
+    clock_gettime(CLOCK_MONOTONIC, stamp);
+}
+
+// Returns time diff in nsecs between end and start
+static qint64 inline ndiffTimeStamp(const TimeStamp *start,
+        const TimeStamp *end)
+{
+    return qint64(end->tv_sec - start->tv_sec)*1000000000LL
+            + (end->tv_nsec - start->tv_nsec);
 }
 
 // Returns time diff in usecs between end and start
 static long inline udiffTimeStamp(const TimeStamp *start, const TimeStamp *end)
 {
-    struct timeval diff;
-    long usecs;
-
-    timersub(end, start, &diff);
-
-    usecs = diff.tv_usec;
-    if (diff.tv_sec)
-        usecs += diff.tv_sec*1e6;
-
-    return usecs;
+    return long(ndiffTimeStamp(start, end)/1000);
 }
 #elif defined(Q_OS_WIN32)
 static quint64 gTicksFreq;
@@ -74,17 +83,29 @@ static void inline getTimeStamp(TimeStamp*) {}
 static long inline udiffTimeStamp(const TimeStamp*, const TimeStamp*) { return 0; }
 #endif
 
-PcapPort::PcapPort(int id, const char *device)
+/*!
+  Creates the port - without the per port Rx/Tx monitors that count the
+  packets if hasMonitors is false, for subclasses that get the port stats
+  some other way
+*/
+PcapPort::PcapPort(int id, const char *device, bool hasMonitors)
     : AbstractPort(id, device)
 {
-    monitorRx_ = new PortMonitor(device, kDirectionRx, &stats_);
-    monitorTx_ = new PortMonitor(device, kDirectionTx, &stats_);
+    if (hasMonitors)
+    {
+        monitorRx_ = new PortMonitor(device, kDirectionRx, &stats_);
+        monitorTx_ = new PortMonitor(device, kDirectionTx, &stats_);
+
+        if (!monitorRx_->handle() || !monitorTx_->handle())
+            isUsable_ = false;
+    }
+    else
+        monitorRx_ = monitorTx_ = NULL;
+    data_.set_packet_monitor(hasMonitors);
+
     transmitter_ = new PortTransmitter(device);
     capturer_ = new PortCapturer(device);
 
-    if (!monitorRx_->handle() || !monitorTx_->handle())
-        isUsable_ = false;
-
     if (!deviceList_)
     {
         char errbuf[PCAP_ERRBUF_SIZE];
@@ -113,15 +134,18 @@ PcapPort::PcapPort(int id, const char *device)
 
 void PcapPort::init()
 {
-    if (!monitorTx_->isDirectional())
-        transmitter_->useExternalStats(&stats_);
+    if (monitorRx_ && monitorTx_)
+    {
+        if (!monitorTx_->isDirectional())
+            transmitter_->useExternalStats(&stats_);
 
-    transmitter_->setHandle(monitorRx_->handle());
+        transmitter_->setHandle(monitorRx_->handle());
 
-    updateNotes();
+        updateNotes();
 
-    monitorRx_->start();
-    monitorTx_->start();
+        monitorRx_->start();
+        monitorTx_->start();
+    }
 }
 
 PcapPort::~PcapPort()
@@ -167,6 +191,24 @@ void PcapPort::updateNotes()
             arg(notes).toStdString());
 }
 
+/*!
+  Replays the packets straight from the replay file mapping instead of
+  copying them into the packet list - see AbstractPort
+*/
+bool PcapPort::appendReplayToPacketList(PcapReplayFile *replay,
+        long &sec, long &nsec)
+{
+    quint64 nsecs = nsec + replay->nsecDuration();
+    bool ret;
+
+    ret = transmitter_->appendReplayToPacketList(sec, nsec, replay);
+
+    sec += nsecs / ulong(1e9);
+    nsec = nsecs % ulong(1e9);
+
+    return ret;
+}
+
 PcapPort::PortMonitor::PortMonitor(const char *device, Direction direction,
         AbstractPort::PortStats *stats)
 {
@@ -314,8 +356,6 @@ void PcapPort::PortMonitor::stop()
 
 PcapPort::PortTransmitter::PortTransmitter(const char *device)
 {
-    char errbuf[PCAP_ERRBUF_SIZE] = "";
-
 #ifdef Q_OS_WIN32
     LARGE_INTEGER   freq;
     if (QueryPerformanceFrequency(&freq))
@@ -327,25 +367,22 @@ PcapPort::PortTransmitter::PortTransmitter(const char *device)
     state_ = kNotStarted;
     returnToQIdx_ = -1;
     loopDelay_ = 0;
+    currentPacketVariation_ = NULL;
     stop_ = false;
     stats_ = new AbstractPort::PortStats;
     usingInternalStats_ = true;
-    handle_ = pcap_open_live(device, 64 /* FIXME */, 0, 1000 /* ms */, errbuf);
-
-    if (handle_ == NULL)
-        goto _open_error;
-
-    usingInternalHandle_ = true;
-
-    return;
-
-_open_error:
-    qDebug("%s: Error opening port %s: %s\n", __FUNCTION__, device, errbuf);
+    spinThreshold_ = 0;
+    pacingStats_ = NULL;
+    pacingStatsMutex_ = NULL;
+    overshootSum_ = overshootCount_ = overshootMax_ = 0;
+    device_ = QByteArray(device);
+    handle_ = NULL;
     usingInternalHandle_ = false;
 }
 
 PcapPort::PortTransmitter::~PortTransmitter()
 {
+    qDeleteAll(packetVariationList_);
     if (usingInternalStats_)
         delete stats_;
     if (usingInternalHandle_)
@@ -358,12 +395,17 @@ void PcapPort::PortTransmitter::clearPacketList()
     // \todo lock for packetSequenceList
     while(packetSequenceList_.size())
         delete packetSequenceList_.takeFirst();
+    arena_.clear();
 
     currentPacketSequence_ = NULL;
     repeatSequenceStart_ = -1;
     repeatSize_ = 0;
     packetCount_ = 0;
 
+    qDeleteAll(packetVariationList_);
+    packetVariationList_.clear();
+    currentPacketVariation_ = NULL;
+
     returnToQIdx_ = -1;
 
     setPacketListLoopMode(false, 0, 0); 
@@ -372,16 +414,15 @@ void PcapPort::PortTransmitter::clearPacketList()
 void PcapPort::PortTransmitter::loopNextPacketSet(qint64 size, qint64 repeats,
         long repeatDelaySec, long repeatDelayNsec)
 {
-    currentPacketSequence_ = new PacketSequence;
+    currentPacketSequence_ = newPacketSequence();
     currentPacketSequence_->repeatCount_ = repeats;
     currentPacketSequence_->usecDelay_ = repeatDelaySec * long(1e6) 
                                             + repeatDelayNsec/1000;
+    currentPacketSequence_->variation_ = currentPacketVariation_;
 
-    repeatSequenceStart_ = packetSequenceList_.size();
+    repeatSequenceStart_ = packetSequenceList_.size() - 1;
     repeatSize_ = size;
     packetCount_ = 0;
-
-    packetSequenceList_.append(currentPacketSequence_);
 }
 
 bool PcapPort::PortTransmitter::appendToPacketList(long sec, long nsec, 
@@ -394,8 +435,10 @@ bool PcapPort::PortTransmitter::appendToPacketList(long sec, long nsec,
     pktHdr.ts.tv_sec = sec;
     pktHdr.ts.tv_usec = nsec/1000;
 
+    // Packets with different variations can't share a packet sequence
     if (currentPacketSequence_ == NULL || 
-            !currentPacketSequence_->hasFreeSpace(2*sizeof(pcap_pkthdr)+length))
+            !currentPacketSequence_->hasFreeSpace(2*sizeof(pcap_pkthdr)+length)
+            || (currentPacketSequence_->variation_ != currentPacketVariation_))
     {
         if (currentPacketSequence_ != NULL)
         {
@@ -409,10 +452,8 @@ bool PcapPort::PortTransmitter::appendToPacketList(long sec, long nsec,
             currentPacketSequence_->usecDelay_ = usecs;
         }
 
-        //! \todo (LOW): calculate sendqueue size
-        currentPacketSequence_ = new PacketSequence;
-
-        packetSequenceList_.append(currentPacketSequence_);
+        currentPacketSequence_ = newPacketSequence();
+        currentPacketSequence_->variation_ = currentPacketVariation_;
 
         // Validate that the pkt will fit inside the new currentSendQueue_
         Q_ASSERT(currentPacketSequence_->hasFreeSpace(
@@ -453,6 +494,112 @@ bool PcapPort::PortTransmitter::appendToPacketList(long sec, long nsec,
     return op;
 }
 
+/*!
+  The flow set fields of variation are applied to the packets appended
+  hereafter, just before they are transmitted - with the frame index being
+  the number of such packets transmitted since transmit was started. So
+  the flows need not be built into the packet list upfront.
+
+  The variation is copied; pass NULL to stop varying the packets appended
+  hereafter
+*/
+bool PcapPort::PortTransmitter::setPacketListFrameVariation(
+        const FrameVariation *variation)
+{
+    PacketVariation *packetVariation = NULL;
+
+    if (variation)
+    {
+        packetVariation = new PacketVariation;
+        packetVariation->variation = *variation;
+        packetVariation->frameIndex = 0;
+        packetVariationList_.append(packetVariation);
+    }
+
+    currentPacketVariation_ = packetVariation;
+
+    // An empty packet sequence (see loopNextPacketSet) can be reused
+    if (currentPacketSequence_ && (currentPacketSequence_->packets_ == 0))
+        currentPacketSequence_->variation_ = currentPacketVariation_;
+
+    return true;
+}
+
+/*!
+  Appends a packet sequence that transmits the packets of replay straight
+  from its file mapping - the first one at sec/nsec; takes ownership of
+  replay
+*/
+bool PcapPort::PortTransmitter::appendReplayToPacketList(long sec, long nsec,
+        PcapReplayFile *replay)
+{
+    PacketSequence *seq;
+
+    if (currentPacketSequence_ && currentPacketSequence_->lastPacket_)
+    {
+        long usecs;
+
+        usecs = (sec - currentPacketSequence_->lastPacket_->ts.tv_sec)
+                    * long(1e6);
+        usecs += (nsec/1000 - currentPacketSequence_->lastPacket_->ts.tv_usec);
+        currentPacketSequence_->usecDelay_ = usecs;
+    }
+
+    seq = newPacketSequence(false);
+    seq->replay_ = replay;
+    seq->packets_ = replay->packetCount();
+    seq->bytes_ = replay->byteCount();
+    seq->usecDuration_ = replay->nsecDuration()/1000;
+
+    // Packets appended hereafter need a new packet sequence
+    currentPacketSequence_ = NULL;
+
+    return true;
+}
+
+/*!
+  Returns a new packet sequence appended to the packet list - its buffer
+  is taken from the port's arena, right after that of the last sequence
+  which is closed now as no packets are appended to it hereafter
+*/
+PcapPort::PortTransmitter::PacketSequence*
+PcapPort::PortTransmitter::newPacketSequence(bool needsBuffer)
+{
+    PacketSequence *seq;
+
+    if (!packetSequenceList_.isEmpty())
+        packetSequenceList_.last()->close();
+
+    seq = new PacketSequence(needsBuffer ? &arena_ : NULL);
+    packetSequenceList_.append(seq);
+
+    return seq;
+}
+
+/*!
+  Returns the pcap handle to transmit on - opened on first use unless set
+  with setHandle(); NULL if it can't be opened
+*/
+pcap_t* PcapPort::PortTransmitter::pcapHandle()
+{
+    char errbuf[PCAP_ERRBUF_SIZE] = "";
+
+    if (handle_)
+        return handle_;
+
+    handle_ = pcap_open_live(device_.constData(), 64 /* FIXME */, 0,
+                1000 /* ms */, errbuf);
+    if (handle_ == NULL)
+    {
+        qDebug("%s: Error opening port %s: %s\n", __FUNCTION__,
+                device_.constData(), errbuf);
+        return NULL;
+    }
+
+    usingInternalHandle_ = true;
+    return handle_;
+}
+
 void PcapPort::PortTransmitter::setHandle(pcap_t *handle)
 {
     if (usingInternalHandle_)
@@ -461,12 +608,57 @@ void PcapPort::PortTransmitter::setHandle(pcap_t *handle)
     usingInternalHandle_ = false;
 }
 
+/*!
+  Sets the pacing parameters for the next transmit - see udelay(); the
+  overshoot stats are reported in stats with statsMutex held
+*/
+void PcapPort::PortTransmitter::setPacing(long spinThreshold,
+        AbstractPort::PortStats *stats, QMutex *statsMutex)
+{
+    spinThreshold_ = spinThreshold;
+    pacingStats_ = stats;
+    pacingStatsMutex_ = statsMutex;
+}
+
+/*!
+  Copies the overshoot stats gathered by the transmit thread so far to
+  the port stats - done every kPacingStatsInterval delays and at the end
+  of the transmit instead of for every delay, to keep the lock off the
+  transmit path
+*/
+void PcapPort::PortTransmitter::publishPacingStats()
+{
+    if (!pacingStats_)
+        return;
+
+    QMutexLocker locker(pacingStatsMutex_);
+
+    pacingStats_->txPacingOvershootAvg = overshootCount_ ?
+            overshootSum_/overshootCount_ : 0;
+    pacingStats_->txPacingOvershootMax = overshootMax_;
+}
+
+/*!
+  Makes the transmitter count the packets it sends in stats instead of its
+  own (unused) stats - pass NULL to go back to its own stats
+
+  Must not be called while transmitting
+*/
 void PcapPort::PortTransmitter::useExternalStats(AbstractPort::PortStats *stats)
 {
     if (usingInternalStats_)
         delete stats_;
-    stats_ = stats;
-    usingInternalStats_ = false;
+
+    if (stats)
+    {
+        stats_ = stats;
+        usingInternalStats_ = false;
+    }
+    else
+    {
+        stats_ = new AbstractPort::PortStats;
+        usingInternalStats_ = true;
+    }
 }
 
 void PcapPort::PortTransmitter::run()
@@ -503,6 +695,12 @@ void PcapPort::PortTransmitter::run()
                 packetSequenceList_.at(i)->usecDuration_);
     }
 
+    for (i = 0; i < packetVariationList_.size(); i++)
+        packetVariationList_.at(i)->frameIndex = 0;
+
+    overshootSum_ = overshootCount_ = overshootMax_ = 0;
+    publishPacingStats();
+
     state_ = kRunning;
     i = 0;
     while (i < packetSequenceList_.size())
@@ -521,10 +719,12 @@ _restart:
 #ifdef Q_OS_WIN32
                 TimeStamp ovrStart, ovrEnd;
 
-                if (seq->usecDuration_ <= long(1e6)) // 1s
+                // packets to be varied or replayed are sent one by one
+                if ((seq->usecDuration_ <= long(1e6)) // 1s
+                        && !seq->variation_ && !seq->replay_)
                 {
                     getTimeStamp(&ovrStart);
-                    ret = pcap_sendqueue_transmit(handle_, 
+                    ret = pcap_sendqueue_transmit(pcapHandle(), 
                             seq->sendQueue_, kSyncTransmit);
                     if (ret >= 0)
                     {
@@ -539,14 +739,19 @@ _restart:
                     if (stop_)
                         ret = -2;
                 }
+                else if (seq->replay_)
+                    ret = replayTransmit(seq->replay_, overHead);
                 else
                 {
-                    ret = sendQueueTransmit(handle_, seq->sendQueue_, 
-                            overHead, kSyncTransmit);
+                    ret = sendQueueTransmit(seq->sendQueue_, 
+                            overHead, kSyncTransmit, seq->variation_);
                 }
 #else
-                ret = sendQueueTransmit(handle_, seq->sendQueue_, 
-                            overHead, kSyncTransmit);
+                if (seq->replay_)
+                    ret = replayTransmit(seq->replay_, overHead);
+                else
+                    ret = sendQueueTransmit(seq->sendQueue_, 
+                            overHead, kSyncTransmit, seq->variation_);
 #endif
 
                 if (ret >= 0)
@@ -586,11 +791,16 @@ _restart:
         else
             overHead = usecs;
 
+        // The stream list starts over and so do the flows
+        for (i = 0; i < packetVariationList_.size(); i++)
+            packetVariationList_.at(i)->frameIndex = 0;
+
         i = returnToQIdx_;
         goto _restart;
     }
 
 _exit:
+    publishPacingStats();
     state_ = kFinished;
 }
 
@@ -628,13 +838,17 @@ bool PcapPort::PortTransmitter::isRunning()
     return (state_ == kRunning);
 }
 
-int PcapPort::PortTransmitter::sendQueueTransmit(pcap_t *p,
-        pcap_send_queue *queue, long &overHead, int sync)
+int PcapPort::PortTransmitter::sendQueueTransmit(pcap_send_queue *queue,
+        long &overHead, int sync, PacketVariation *variation)
 {
     TimeStamp ovrStart, ovrEnd;
     struct timeval ts;
     struct pcap_pkthdr *hdr = (struct pcap_pkthdr*) queue->buffer;
     char *end = queue->buffer + queue->len;
+    pcap_t *p = pcapHandle();
+
+    if (!p)
+        return -1;
 
     ts = hdr->ts;
 
@@ -668,6 +882,9 @@ int PcapPort::PortTransmitter::sendQueueTransmit(pcap_t *p,
 
         Q_ASSERT(pktLen > 0);
 
+        if (variation)
+            variation->variation.apply(pkt, pktLen, variation->frameIndex++);
+
         pcap_sendpacket(p, pkt, pktLen);
         stats_->txPkts++;
         stats_->txBytes += pktLen;
@@ -685,6 +902,60 @@ int PcapPort::PortTransmitter::sendQueueTransmit(pcap_t *p,
     return 0;
 }
 
+/*!
+  Transmits the packets of replay as per their gaps - the sub-microsecond
+  part of the gaps is carried over so that it is not lost at high rates
+*/
+int PcapPort::PortTransmitter::replayTransmit(PcapReplayFile *replay,
+        long &overHead)
+{
+    TimeStamp ovrStart, ovrEnd;
+    PcapReplayFile::Packet packet;
+    quint64 nsecGap = 0;
+    pcap_t *p = pcapHandle();
+
+    if (!p)
+        return -1;
+
+    replay->rewind();
+
+    getTimeStamp(&ovrStart);
+    while (replay->nextPacket(packet))
+    {
+        long usec;
+
+        nsecGap += packet.nsecGap;
+        usec = long(nsecGap/1000);
+        nsecGap %= 1000;
+
+        getTimeStamp(&ovrEnd);
+
+        overHead -= udiffTimeStamp(&ovrStart, &ovrEnd);
+        Q_ASSERT(overHead <= 0);
+        usec += overHead;
+        if (usec > 0)
+        {
+            udelay(usec);
+            overHead = 0;
+        }
+        else
+            overHead = usec;
+
+        getTimeStamp(&ovrStart);
+
+        pcap_sendpacket(p, packet.data, packet.length);
+        stats_->txPkts++;
+        stats_->txBytes += packet.length;
+
+        if (stop_)
+        {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
 void PcapPort::PortTransmitter::udelay(long usec)
 {
 #if defined(Q_OS_WIN32)
@@ -697,25 +968,51 @@ void PcapPort::PortTransmitter::udelay(long usec)
     while (curTicks.QuadPart < tgtTicks.QuadPart)
         QueryPerformanceCounter(&curTicks);
 #elif defined(Q_OS_LINUX)
-    struct timeval delay, target, now;
+    TimeStamp target, now;
+    qint64 overshoot;
 
     //qDebug("usec delay = %ld", usec);
 
-    delay.tv_sec = 0;
-    delay.tv_usec = usec;
-
-    while (delay.tv_usec >= 1000000)
+    getTimeStamp(&now);
+    target.tv_sec = now.tv_sec + usec/1000000;
+    target.tv_nsec = now.tv_nsec + (usec%1000000)*1000;
+    if (target.tv_nsec >= 1000000000)
     {
-        delay.tv_sec++;
-        delay.tv_usec -= 1000000;
+        target.tv_sec++;
+        target.tv_nsec -= 1000000000;
     }
 
-    gettimeofday(&now, NULL);
-    timeradd(&now, &delay, &target);
+    // Sleep through a long wait except for the last spinThreshold_ usecs
+    // which are busy waited - a sleep may oversleep by upto the timer
+    // slack and then some, a busy wait doesn't but it keeps a core busy
+    if (usec > spinThreshold_)
+    {
+        TimeStamp wake = target;
+
+        wake.tv_sec -= spinThreshold_/1000000;
+        wake.tv_nsec -= (spinThreshold_%1000000)*1000;
+        if (wake.tv_nsec < 0)
+        {
+            wake.tv_sec--;
+            wake.tv_nsec += 1000000000;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+                == EINTR)
+            ;
+    }
 
     do {
-        gettimeofday(&now, NULL);
-    } while (timercmp(&now, &target, <));
+        getTimeStamp(&now);
+    } while (ndiffTimeStamp(&now, &target) > 0);
+
+    overshoot = ndiffTimeStamp(&target, &now);
+    overshootSum_ += overshoot;
+    overshootCount_++;
+    if (quint64(overshoot) > overshootMax_)
+        overshootMax_ = overshoot;
+    if ((overshootCount_ % kPacingStatsInterval) == 0)
+        publishPacingStats();
 #else
     QThread::usleep(usec);
 #endif 
@@ -727,11 +1024,6 @@ PcapPort::PortCapturer::PortCapturer(const char *device)
     stop_ = false;
     state_ = kNotStarted;
 
-    if (!capFile_.open())
-        qWarning("Unable to open temp cap file");
-
-    qDebug("cap file = %s", capFile_.fileName().toAscii().constData());
-
     dumpHandle_ = NULL;
     handle_ = NULL;
 }
@@ -748,11 +1040,8 @@ void PcapPort::PortCapturer::run()
     
     qDebug("In %s", __PRETTY_FUNCTION__);
 
-    if (!capFile_.isOpen())
-    {
-        qWarning("temp cap file is not open");
+    if (!openCaptureFile())
         goto _exit;
-    }
 _retry:
     handle_ = pcap_open_live(device_.toAscii().constData(), 65535, 
                     flag, 1000 /* ms */, errbuf);
@@ -851,6 +1140,25 @@ bool PcapPort::PortCapturer::isRunning()
     return (state_ == kRunning);
 }
 
+/*!
+  Opens the temp capture file the first time capture is started - so that
+  ports that never capture don't have one
+*/
+bool PcapPort::PortCapturer::openCaptureFile()
+{
+    if (capFile_.isOpen())
+        return true;
+
+    if (!capFile_.open())
+    {
+        qWarning("Unable to open temp cap file");
+        return false;
+    }
+
+    qDebug("cap file = %s", capFile_.fileName().toAscii().constData());
+    return true;
+}
+
 QFile* PcapPort::PortCapturer::captureFile()
 {
     return &capFile_;
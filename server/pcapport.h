@@ -26,11 +26,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "abstractport.h"
 #include "pcapextra.h"
+#include "../common/framevariation.h"
+#include "packetarena.h"
+#include "pcapreplayfile.h"
 
 class PcapPort : public AbstractPort
 {
 public:
-    PcapPort(int id, const char *device);
+    PcapPort(int id, const char *device, bool hasMonitors = true);
     ~PcapPort();
 
     void init();
@@ -55,9 +58,17 @@ public:
     {
         transmitter_->setPacketListLoopMode(loop, secDelay, nsecDelay);
     }
+    virtual bool setPacketListFrameVariation(const FrameVariation *variation)
+    {
+        return transmitter_->setPacketListFrameVariation(variation);
+    }
+    virtual bool appendReplayToPacketList(PcapReplayFile *replay,
+            long &sec, long &nsec);
 
     virtual void startTransmit() { 
         Q_ASSERT(!isDirty());
+        transmitter_->setPacing(data_.tx_spin_threshold(), &stats_,
+                &pacingStatsMutex_);
         transmitter_->start(); 
     }
     virtual void stopTransmit()  { transmitter_->stop();  }
@@ -111,13 +122,18 @@ protected:
             returnToQIdx_ = loop ? 0 : -1;
             loopDelay_ = secDelay*long(1e6) + nsecDelay/1000;
         }
+        bool setPacketListFrameVariation(const FrameVariation *variation);
+        bool appendReplayToPacketList(long sec, long nsec,
+            PcapReplayFile *replay);
         void setHandle(pcap_t *handle);
         void useExternalStats(AbstractPort::PortStats *stats);
+        void setPacing(long spinThreshold, AbstractPort::PortStats *stats,
+                QMutex *statsMutex);
         void run();
         void start();
         void stop();
         bool isRunning();
-    private:
+    protected:
         enum State 
         {
             kNotStarted,
@@ -125,11 +141,27 @@ protected:
             kFinished
         };
 
+        //! Flow set fields varied in the packets just before transmit
+        struct PacketVariation
+        {
+            FrameVariation variation;
+            quint64 frameIndex;     //!< frame index of the next packet
+        };
+
         class PacketSequence
         {
         public:
-            PacketSequence() {
-                sendQueue_ = pcap_sendqueue_alloc(1*1024*1024);
+            // Room for at least one packet of the largest size
+            static const uint kMinSize = 2*sizeof(pcap_pkthdr) + 65536;
+
+            //! replay sequences don't need an arena (or a buffer) at all
+            PacketSequence(PacketArena *arena) {
+                arena_ = arena;
+                queue_.len = 0;
+                queue_.maxlen = 0;
+                queue_.buffer = arena_ ?
+                    arena_->reserve(kMinSize, &queue_.maxlen) : NULL;
+                sendQueue_ = &queue_;
                 lastPacket_ = NULL;
                 packets_ = 0;
                 bytes_ = 0;
@@ -137,9 +169,19 @@ protected:
                 repeatCount_ = 1;
                 repeatSize_ = 1;
                 usecDelay_ = 0;
+                variation_ = NULL;
+                replay_ = NULL;
             }
             ~PacketSequence() {
-                pcap_sendqueue_destroy(sendQueue_);
+                // buffer goes back with the arena - see clearPacketList()
+                delete replay_;
+            }
+            //! Gives back the unused part of the buffer to the arena
+            void close() {
+                if (arena_ && queue_.buffer)
+                    arena_->commit(queue_.buffer, queue_.len);
+                queue_.maxlen = queue_.len;
+                arena_ = NULL;
             }
             bool hasFreeSpace(int size) {
                 if ((sendQueue_->len + size) <= sendQueue_->maxlen)
@@ -163,6 +205,8 @@ protected:
                 return pcap_sendqueue_queue(sendQueue_, pktHeader, pktData);
             }
             pcap_send_queue *sendQueue_;
+            pcap_send_queue queue_;
+            PacketArena *arena_;        //!< NULL once closed
             struct pcap_pkthdr *lastPacket_;
             long packets_;
             long bytes_;
@@ -170,26 +214,45 @@ protected:
             int repeatCount_;
             int repeatSize_;
             long usecDelay_;
+            PacketVariation *variation_;
+            PcapReplayFile *replay_;    //!< packets sent from here if set
         };
 
         void udelay(long usec);
-        int sendQueueTransmit(pcap_t *p, pcap_send_queue *queue, long &overHead,
-                    int sync);
+        void publishPacingStats();
+        virtual int sendQueueTransmit(pcap_send_queue *queue, long &overHead,
+                    int sync, PacketVariation *variation = NULL);
+        int replayTransmit(PcapReplayFile *replay, long &overHead);
+        pcap_t* pcapHandle();
+        PacketSequence* newPacketSequence(bool needsBuffer = true);
 
         quint64 ticksFreq_;
+        PacketArena arena_;     //!< packet sequence buffers come from here
         QList<PacketSequence*> packetSequenceList_;
         PacketSequence *currentPacketSequence_;
         int repeatSequenceStart_;
         quint64 repeatSize_;
         quint64 packetCount_;
 
+        QList<PacketVariation*> packetVariationList_;
+        PacketVariation *currentPacketVariation_;
+
         int returnToQIdx_;
         quint64 loopDelay_;
 
         bool usingInternalStats_;
         AbstractPort::PortStats *stats_;
+
+        // Pacing - see udelay()
+        long spinThreshold_;                    //!< in usecs
+        AbstractPort::PortStats *pacingStats_;  //!< overshoot stats go here
+        QMutex *pacingStatsMutex_;              //!< guards pacingStats_
+        quint64 overshootSum_;                  //!< tx thread only
+        quint64 overshootCount_;                //!< tx thread only
+        quint64 overshootMax_;                  //!< tx thread only
+        QByteArray device_;
         bool usingInternalHandle_;
-        pcap_t *handle_;
+        pcap_t *handle_;        //!< opened only when needed - see pcapHandle()
         volatile bool stop_;
         volatile State state_;
     };
@@ -205,7 +268,7 @@ protected:
         bool isRunning();
         QFile* captureFile();
 
-    private:
+    protected:
         enum State 
         {
             kNotStarted,
@@ -213,6 +276,8 @@ protected:
             kFinished
         };
 
+        bool openCaptureFile();
+
         QString         device_;
         volatile bool   stop_;
         QTemporaryFile  capFile_;
@@ -226,10 +291,10 @@ protected:
 
     void updateNotes();
 
-private:
     PortTransmitter *transmitter_;
     PortCapturer    *capturer_;
 
+private:
     static pcap_if_t *deviceList_;
 };
 
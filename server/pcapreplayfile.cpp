@@ -0,0 +1,302 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "pcapreplayfile.h"
+
+#include <string.h>
+
+static const quint32 kPcapFileMagic = 0xa1b2c3d4;
+static const quint32 kPcapFileMagicSwapped = 0xd4c3b2a1;
+static const quint32 kPcapFileMagicNsec = 0xa1b23c4d;
+static const quint32 kPcapFileMagicNsecSwapped = 0x4d3cb2a1;
+static const quint32 kDltEthernet = 1;
+
+static const int kFileHeaderSize = 24;
+static const int kRecordHeaderSize = 16;
+static const quint32 kMaxPacketSize = 262144;
+
+static inline quint32 swap32(quint32 val)
+{
+    return (((val >> 24) & 0x000000FF) |
+            ((val >> 8)  & 0x0000FF00) |
+            ((val << 8)  & 0x00FF0000) |
+            ((val << 24) & 0xFF000000));
+}
+
+PcapReplayFile::PcapReplayFile()
+{
+    map_ = NULL;
+    close();
+}
+
+PcapReplayFile::~PcapReplayFile()
+{
+    close();
+}
+
+/*!
+  Opens and memory maps the pcap file of the replay and validates its
+  packet records - a truncated last record is ignored. Returns false with
+  the reason in error if the file can't be replayed
+
+  Both the microsecond and nanosecond resolution pcap formats in either
+  byte order are supported; the link type must be ethernet
+*/
+bool PcapReplayFile::open(const OstProto::StreamReplay &replay,
+        QString &error)
+{
+    quint32 magic;
+    qint64 offset;
+
+    close();
+
+    file_.setFileName(QString::fromStdString(replay.file_name()));
+    if (!file_.open(QIODevice::ReadOnly))
+    {
+        error = QString("Unable to open %1 - %2").arg(file_.fileName())
+                    .arg(file_.errorString());
+        goto _error;
+    }
+
+    size_ = file_.size();
+    if (size_ < kFileHeaderSize)
+    {
+        error = QString("%1 is not a pcap file").arg(file_.fileName());
+        goto _error;
+    }
+
+    map_ = file_.map(0, size_);
+    if (!map_)
+    {
+        error = QString("Unable to map %1 - %2").arg(file_.fileName())
+                    .arg(file_.errorString());
+        goto _error;
+    }
+
+    memcpy(&magic, map_, sizeof(magic));
+    switch (magic)
+    {
+        case kPcapFileMagic:
+            break;
+        case kPcapFileMagicSwapped:
+            isSwapped_ = true;
+            break;
+        case kPcapFileMagicNsec:
+            isNsec_ = true;
+            break;
+        case kPcapFileMagicNsecSwapped:
+            isSwapped_ = true;
+            isNsec_ = true;
+            break;
+        default:
+            error = QString("%1 is not a pcap file (magic = %2)")
+                        .arg(file_.fileName()).arg(magic, 8, 16, QChar('0'));
+            goto _error;
+    }
+
+    if (value32(map_ + 20) != kDltEthernet)
+    {
+        error = QString("%1 has non-ethernet link type %2")
+                    .arg(file_.fileName()).arg(value32(map_ + 20));
+        goto _error;
+    }
+
+    offset = kFileHeaderSize;
+    while ((offset + kRecordHeaderSize) <= size_)
+    {
+        const uchar *p = map_ + offset;
+        quint32 length = value32(p + 8);
+        quint64 nsec;
+
+        if ((length > kMaxPacketSize)
+                || ((offset + kRecordHeaderSize + length) > size_))
+            break;
+
+        offset += kRecordHeaderSize + length;
+        if (length == 0)
+            continue;
+
+        nsec = quint64(value32(p)) * 1000000000ULL
+                + (isNsec_ ? value32(p + 4) : value32(p + 4) * 1000ULL);
+        if (packetCount_ == 0)
+            nsecFirst_ = nsec;
+        nsecLast_ = nsec;
+
+        packetCount_++;
+        byteCount_ += length;
+    }
+
+    if (offset != size_)
+    {
+        qWarning("%s: ignoring %lld bytes of truncated/bad records at the "
+                "end of %s", __FUNCTION__, size_ - offset,
+                qPrintable(file_.fileName()));
+        size_ = offset;
+    }
+
+    if (packetCount_ == 0)
+    {
+        error = QString("%1 has no packets").arg(file_.fileName());
+        goto _error;
+    }
+
+    timing_ = replay.timing();
+    speed_ = replay.speed() > 0 ? replay.speed() : 1;
+    nsecFixedGap_ = replay.packets_per_sec() > 0 ?
+            quint64(1e9/replay.packets_per_sec()) : 0;
+    loopCount_ = replay.loop_count() ? replay.loop_count() : 1;
+
+    qDebug("%s: %s - %llu packets, %llu bytes, %u loops", __FUNCTION__,
+            qPrintable(file_.fileName()), packetCount_, byteCount_,
+            loopCount_);
+
+    rewind();
+    return true;
+
+_error:
+    close();
+    return false;
+}
+
+void PcapReplayFile::close()
+{
+    if (map_)
+        file_.unmap((uchar*) map_);
+    if (file_.isOpen())
+        file_.close();
+
+    map_ = NULL;
+    size_ = 0;
+    isSwapped_ = false;
+    isNsec_ = false;
+    packetCount_ = 0;
+    byteCount_ = 0;
+    nsecFirst_ = 0;
+    nsecLast_ = 0;
+    timing_ = OstProto::StreamReplay::e_rt_original;
+    speed_ = 1;
+    nsecFixedGap_ = 0;
+    loopCount_ = 1;
+    offset_ = kFileHeaderSize;
+    loop_ = 0;
+    nsecPrev_ = 0;
+}
+
+/*!
+  Returns the time taken to replay all the packets for all the loops
+*/
+quint64 PcapReplayFile::nsecDuration() const
+{
+    quint64 nsec = nsecLast_ > nsecFirst_ ? nsecLast_ - nsecFirst_ : 0;
+
+    switch (timing_)
+    {
+        case OstProto::StreamReplay::e_rt_scaled:
+            return quint64(nsec / speed_) * loopCount_;
+        case OstProto::StreamReplay::e_rt_fixed:
+            return packetCount() ? nsecFixedGap_ * (packetCount() - 1) : 0;
+        default:
+            break;
+    }
+
+    return nsec * loopCount_;
+}
+
+/*!
+  Positions the cursor at the first packet of the first loop
+*/
+void PcapReplayFile::rewind()
+{
+    offset_ = kFileHeaderSize;
+    loop_ = 0;
+    nsecPrev_ = nsecFirst_;
+}
+
+/*!
+  Returns the packet at the cursor and moves the cursor to the next one -
+  or false after the last packet of the last loop
+
+  The packet data points into the file mapping and is valid till the file
+  is closed. The gap of the first packet of a loop is 0 except for fixed
+  timing where all the packets but the very first are equally spaced
+*/
+bool PcapReplayFile::nextPacket(Packet &packet)
+{
+    bool isFirst = (loop_ == 0) && (offset_ == kFileHeaderSize);
+
+    if (!map_)
+        return false;
+
+    while (1)
+    {
+        const uchar *p;
+        quint32 length;
+        quint64 nsec;
+
+        if (offset_ >= size_)
+        {
+            if ((loop_ + 1) >= loopCount_)
+                return false;
+
+            loop_++;
+            offset_ = kFileHeaderSize;
+            nsecPrev_ = nsecFirst_;
+        }
+
+        p = map_ + offset_;
+        length = value32(p + 8);
+        offset_ += kRecordHeaderSize + length;
+        if (length == 0)
+            continue;
+
+        nsec = quint64(value32(p)) * 1000000000ULL
+                + (isNsec_ ? value32(p + 4) : value32(p + 4) * 1000ULL);
+
+        packet.data = p + kRecordHeaderSize;
+        packet.length = length;
+
+        switch (timing_)
+        {
+            case OstProto::StreamReplay::e_rt_fixed:
+                packet.nsecGap = isFirst ? 0 : nsecFixedGap_;
+                break;
+            case OstProto::StreamReplay::e_rt_scaled:
+                packet.nsecGap = nsec > nsecPrev_ ?
+                        quint64((nsec - nsecPrev_) / speed_) : 0;
+                break;
+            default:
+                packet.nsecGap = nsec > nsecPrev_ ? nsec - nsecPrev_ : 0;
+                break;
+        }
+        nsecPrev_ = nsec;
+
+        return true;
+    }
+
+    return false;
+}
+
+quint32 PcapReplayFile::value32(const uchar *p) const
+{
+    quint32 value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return isSwapped_ ? swap32(value) : value;
+}
@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _SERVER_PCAP_REPLAY_FILE_H
+#define _SERVER_PCAP_REPLAY_FILE_H
+
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+
+#include "../common/protocol.pb.h"
+
+/*
+ * A pcap file memory mapped for replay by a replay stream - the packets
+ * are read in place from the mapping one after the other (for all the
+ * loops) alongwith the gap to the previous packet as per the replay timing
+ */
+class PcapReplayFile
+{
+public:
+    struct Packet
+    {
+        const uchar *data;
+        int length;
+        quint64 nsecGap;    //!< gap from the previous packet
+    };
+
+    PcapReplayFile();
+    ~PcapReplayFile();
+
+    bool open(const OstProto::StreamReplay &replay, QString &error);
+    void close();
+
+    quint64 packetCount() const { return packetCount_ * loopCount_; }
+    quint64 byteCount() const { return byteCount_ * loopCount_; }
+    quint64 nsecDuration() const;
+
+    void rewind();
+    bool nextPacket(Packet &packet);
+
+private:
+    quint32 value32(const uchar *p) const;
+
+    QFile file_;
+    const uchar *map_;
+    qint64 size_;
+
+    bool isSwapped_;
+    bool isNsec_;
+    quint64 packetCount_;
+    quint64 byteCount_;
+    quint64 nsecFirst_;
+    quint64 nsecLast_;
+
+    OstProto::StreamReplay::Timing timing_;
+    double speed_;
+    quint64 nsecFixedGap_;
+    uint loopCount_;
+
+    // Cursor
+    qint64 offset_;
+    uint loop_;
+    quint64 nsecPrev_;
+};
+
+#endif
@@ -27,6 +27,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include "pcapport.h"
 #include "dpdkport.h"
 #include "winpcapport.h"
+#include "xdpport.h"
 
 PortManager *PortManager::instance_ = NULL;
 
@@ -54,7 +55,12 @@ PortManager::PortManager()
 #if defined(Q_OS_WIN32)
         port = new WinPcapPort(i, device->name);
 #elif defined(Q_OS_LINUX)
+#ifdef HAVE_AF_XDP
+        // A LinuxPort unless asked to use AF_XDP - see XdpPort::setXdp()
+        port = new XdpPort(i, device->name);
+#else
         port = new LinuxPort(i, device->name);
+#endif
 #elif defined(Q_OS_BSD4)
         port = new BsdPort(i, device->name);
 #else
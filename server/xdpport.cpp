@@ -0,0 +1,873 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include "xdpport.h"
+
+#ifdef HAVE_AF_XDP
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/rtnetlink.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// Returns time diff in usecs between end and start
+static long inline udiffTimeStamp(const struct timespec *start,
+        const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)*long(1e6)
+            + (end->tv_nsec - start->tv_nsec)/1000;
+}
+
+static inline quint64 ptrToU64(const void *p)
+{
+    return quint64(quintptr(p));
+}
+
+static const char *kXdpCaptureNote = "<i>Capture</i>: AF_XDP - only the "
+        "rx packets of queue 0 (not seen by the OS while capturing), no tx "
+        "packets";
+static const char *kXdpCopyModeNote = "<i>Tx/Capture</i>: AF_XDP in copy "
+        "mode - no zero-copy support in driver";
+
+XdpPort::XdpPort(int id, const char *device)
+    : LinuxPort(id, device)
+{
+    socket_ = NULL;
+}
+
+XdpPort::~XdpPort()
+{
+    // The transmitter and capturer use the socket - so they go first
+    delete capturer_;
+    capturer_ = NULL;
+    delete transmitter_;
+    transmitter_ = NULL;
+
+    delete socket_;
+}
+
+/*!
+  Switches the port's transmitter and capturer to (or back from) AF_XDP -
+  not possible while transmitting or capturing. The packet list is lost
+  with the old transmitter, so it is rebuilt before the next transmit
+
+  No socket is opened here - see openSocket()
+*/
+bool XdpPort::setXdp(bool enable)
+{
+    if (enable == (socket_ != NULL))
+        return true;
+
+    if (isTransmitOn() || isCaptureOn())
+    {
+        qWarning("%s: can't change AF_XDP use of %s while transmitting or "
+                "capturing", __FUNCTION__, name());
+        return false;
+    }
+
+    delete capturer_;
+    delete transmitter_;
+
+    if (enable)
+    {
+        socket_ = new Socket(name());
+        transmitter_ = new XdpTransmitter(name(), socket_);
+        capturer_ = new XdpCapturer(name(), socket_, &stats_);
+        addNote(kXdpCaptureNote);
+    }
+    else
+    {
+        transmitter_ = new BatchTransmitter(name());
+        capturer_ = new RingCapturer(name(), &stats_);
+
+        delete socket_;
+        socket_ = NULL;
+
+        removeNote(kXdpCaptureNote);
+        removeNote(kXdpCopyModeNote);
+        removeNote(xdpTxNote_);
+        xdpTxNote_.clear();
+    }
+
+    // Same as LinuxPort::setPacketMonitor()
+    if (monitorTx_ && !monitorTx_->isDirectional())
+        transmitter_->useExternalStats(&stats_);
+
+    setDirty();
+
+    return true;
+}
+
+/*!
+  Opens the AF_XDP socket on first use - if it can't be, the transmitter
+  and capturer make do with pcap
+*/
+bool XdpPort::openSocket()
+{
+    if (socket_->isOpen())
+        return true;
+
+    if (!socket_->open())
+    {
+        qWarning("%s: AF_XDP not available for %s - using pcap",
+                __FUNCTION__, name());
+        return false;
+    }
+
+    if (!socket_->isZeroCopy())
+        addNote(kXdpCopyModeNote);
+
+    return true;
+}
+
+/*!
+  Same as LinuxPort::startTransmit() less the qdisc settings with AF_XDP -
+  its packets don't go through the qdisc at all; the port notes say so if
+  those settings are asked for
+*/
+void XdpPort::startTransmit()
+{
+    if (!socket_)
+    {
+        LinuxPort::startTransmit();
+        return;
+    }
+
+    removeNote(xdpTxNote_);
+    xdpTxNote_.clear();
+
+    if (data_.is_txtime_pacing())
+        xdpTxNote_ = "<i>Tx Pacing</i>: by Ostinato - SO_TXTIME pacing "
+                     "needs the qdisc, which AF_XDP doesn't use";
+    else if (data_.is_qdisc_bypass())
+        xdpTxNote_ = "<i>Tx</i>: AF_XDP doesn't use the qdisc - bypass "
+                     "setting not applicable";
+
+    if (!xdpTxNote_.isEmpty())
+        addNote(xdpTxNote_);
+
+    openSocket();
+
+    PcapPort::startTransmit();
+}
+
+void XdpPort::startCapture()
+{
+    if (!socket_)
+    {
+        LinuxPort::startCapture();
+        return;
+    }
+
+    openSocket();
+
+    PcapPort::startCapture();
+}
+
+/*
+ * --------------------------------------------------------- *
+ * Socket
+ * --------------------------------------------------------- *
+ */
+
+XdpPort::Socket::Socket(const char *device)
+{
+    device_ = QByteArray(device);
+    isOpenTried_ = false;
+    ifIndex_ = 0;
+    fd_ = -1;
+    umem_ = NULL;
+    isZeroCopy_ = false;
+    mapFd_ = progFd_ = -1;
+    memset(&tx_, 0, sizeof(tx_));
+    memset(&completion_, 0, sizeof(completion_));
+    memset(&rx_, 0, sizeof(rx_));
+    memset(&fill_, 0, sizeof(fill_));
+}
+
+/*!
+  Opens the AF_XDP socket, with its UMEM and rings, bound to queue 0 of
+  the device - zero-copy if possible, else in copy mode. Returns false
+  (and isOpen() is false) if any of it fails
+
+  Tried only once - whatever was set up before a failure is undone by the
+  destructor. Needs need_wakeup support (Linux 5.4+)
+*/
+bool XdpPort::Socket::open()
+{
+    const int kUmemSize = (kTxFrames + kRxFrames) * kFrameSize;
+    const char *device = device_.constData();
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    socklen_t len = sizeof(off);
+    int ringSize;
+    void *umem;
+
+    if (isOpenTried_)
+        return isOpen();
+    isOpenTried_ = true;
+
+    ifIndex_ = if_nametoindex(device);
+    if (!ifIndex_)
+        goto _error;
+
+    fd_ = socket(AF_XDP, SOCK_RAW, 0);
+    if (fd_ < 0)
+        goto _error;
+
+    umem = mmap(NULL, kUmemSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED)
+        goto _error;
+    umem_ = (uchar*) umem;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = ptrToU64(umem_);
+    reg.len = kUmemSize;
+    reg.chunk_size = kFrameSize;
+    reg.headroom = 0;
+    if (setsockopt(fd_, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+        goto _error;
+
+    ringSize = kTxFrames;
+    if ((setsockopt(fd_, SOL_XDP, XDP_TX_RING,
+                    &ringSize, sizeof(ringSize)) < 0)
+            || (setsockopt(fd_, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                    &ringSize, sizeof(ringSize)) < 0))
+        goto _error;
+
+    ringSize = kRxFrames;
+    if ((setsockopt(fd_, SOL_XDP, XDP_RX_RING,
+                    &ringSize, sizeof(ringSize)) < 0)
+            || (setsockopt(fd_, SOL_XDP, XDP_UMEM_FILL_RING,
+                    &ringSize, sizeof(ringSize)) < 0))
+        goto _error;
+
+    // Older kernels have no ring flags (and so no need_wakeup)
+    if (getsockopt(fd_, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        goto _error;
+    if (len != sizeof(off))
+    {
+        errno = ENOTSUP;
+        goto _error;
+    }
+
+    if (!mapRing(&tx_, kTxFrames, XDP_PGOFF_TX_RING, &off.tx,
+                sizeof(struct xdp_desc))
+            || !mapRing(&completion_, kTxFrames,
+                XDP_UMEM_PGOFF_COMPLETION_RING, &off.cr, sizeof(quint64))
+            || !mapRing(&rx_, kRxFrames, XDP_PGOFF_RX_RING, &off.rx,
+                sizeof(struct xdp_desc))
+            || !mapRing(&fill_, kRxFrames, XDP_UMEM_PGOFF_FILL_RING, &off.fr,
+                sizeof(quint64)))
+        goto _error;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifIndex_;
+    addr.sxdp_queue_id = 0;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    if (bind(fd_, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+        isZeroCopy_ = true;
+    else
+    {
+        addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        if (bind(fd_, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+            goto _error;
+    }
+
+    // All of the rx frames are given to the kernel upfront - the capturer
+    // gives them back as it is done with them
+    for (int i = 0; i < kRxFrames; i++)
+        ((quint64*) fill_.descs)[i] = quint64(kTxFrames + i) * kFrameSize;
+    __sync_synchronize();
+    *fill_.producer = kRxFrames;
+
+    qDebug("%s: %s: AF_XDP socket on queue 0 (%s)", __FUNCTION__, device,
+            isZeroCopy_ ? "zero-copy" : "copy mode");
+    return true;
+
+_error:
+    qDebug("%s: AF_XDP not available for %s: %s", __FUNCTION__, device,
+            strerror(errno));
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+    return false;
+}
+
+XdpPort::Socket::~Socket()
+{
+    Ring *rings[] = { &tx_, &completion_, &rx_, &fill_ };
+
+    detachProgram();
+
+    for (uint i = 0; i < sizeof(rings)/sizeof(rings[0]); i++)
+    {
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->mapSize);
+    }
+
+    if (fd_ >= 0)
+        close(fd_);
+
+    if (umem_)
+        munmap(umem_, (kTxFrames + kRxFrames) * kFrameSize);
+}
+
+bool XdpPort::Socket::mapRing(Ring *ring, quint32 size, quint64 pgoff,
+        const struct xdp_ring_offset *offsets, size_t descSize)
+{
+    void *map;
+
+    ring->size = size;
+    ring->mapSize = offsets->desc + size*descSize;
+
+    map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, pgoff);
+    if (map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        return false;
+    }
+
+    ring->map = map;
+    ring->producer = (volatile quint32*) ((char*)map + offsets->producer);
+    ring->consumer = (volatile quint32*) ((char*)map + offsets->consumer);
+    ring->flags = (volatile quint32*) ((char*)map + offsets->flags);
+    ring->descs = (char*)map + offsets->desc;
+
+    return true;
+}
+
+/*!
+  Returns true if the kernel needs a syscall to go on with ring - it
+  doesn't if it's busy with the ring anyway (or polls it on its own)
+*/
+bool XdpPort::Socket::needsWakeup(Ring *ring)
+{
+    return *ring->flags & XDP_RING_NEED_WAKEUP;
+}
+
+/*!
+  Attaches the XDP program that steers the packets received on queue 0
+  to the socket - the packets of the other queues go to the OS as usual.
+  Doesn't replace any XDP program already on the interface - returns false
+  then (or if the program can't be loaded at all)
+
+  No libbpf - the program is all of five instructions:
+
+      return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS);
+
+  where XDP_PASS is what's returned if there's no socket for the queue
+  (Linux 5.3+)
+*/
+bool XdpPort::Socket::attachProgram()
+{
+    static const char license[] = "GPL";
+    union bpf_attr attr;
+    int key = 0;
+    int fd = fd_;
+
+    if (progFd_ >= 0)
+        return true;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(key);
+    attr.value_size = sizeof(fd);
+    attr.max_entries = 1;
+    mapFd_ = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+    if (mapFd_ < 0)
+        goto _error;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd_;
+    attr.key = ptrToU64(&key);
+    attr.value = ptrToU64(&fd);
+    attr.flags = BPF_ANY;
+    if (syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) < 0)
+        goto _error;
+
+    {
+        struct bpf_insn prog[] = {
+            // r2 = ctx->rx_queue_index
+            { BPF_LDX | BPF_MEM | BPF_W, 2, 1,
+                offsetof(struct xdp_md, rx_queue_index), 0 },
+            // r1 = &xskmap (a 16 byte instruction)
+            { BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, mapFd_ },
+            { 0, 0, 0, 0, 0 },
+            // r3 = XDP_PASS
+            { BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS },
+            // r0 = bpf_redirect_map(r1, r2, r3)
+            { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+            { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 }
+        };
+
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+        attr.insns = ptrToU64(prog);
+        attr.license = ptrToU64(license);
+        progFd_ = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+        if (progFd_ < 0)
+            goto _error;
+    }
+
+    if (!setXdpProgram(progFd_, XDP_FLAGS_UPDATE_IF_NOEXIST))
+        goto _error;
+
+    qDebug("%s: %s: XDP program attached", __FUNCTION__,
+            device_.constData());
+    return true;
+
+_error:
+    qWarning("%s: %s: unable to attach XDP program: %s", __FUNCTION__,
+            device_.constData(), strerror(errno));
+    if (progFd_ >= 0)
+        close(progFd_);
+    if (mapFd_ >= 0)
+        close(mapFd_);
+    progFd_ = mapFd_ = -1;
+    return false;
+}
+
+void XdpPort::Socket::detachProgram()
+{
+    if (progFd_ < 0)
+        return;
+
+    if (!setXdpProgram(-1, 0))
+        qWarning("%s: %s: unable to detach XDP program: %s", __FUNCTION__,
+                device_.constData(), strerror(errno));
+
+    close(progFd_);
+    close(mapFd_);
+    progFd_ = mapFd_ = -1;
+}
+
+/*!
+  Sets (or with progFd -1, clears) the XDP program of the interface with
+  an RTM_SETLINK - returns false with errno set on failure
+*/
+bool XdpPort::Socket::setXdpProgram(int progFd, quint32 flags)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+        char attrs[64];
+    } req;
+    struct rtattr *xdp;
+    struct rtattr *rta;
+    char buf[1024];
+    struct nlmsghdr *nlm = (struct nlmsghdr*) buf;
+    int fd, len;
+    bool ret = false;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (fd < 0)
+        return false;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nlh.nlmsg_type = RTM_SETLINK;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifIndex_;
+
+    // IFLA_XDP { IFLA_XDP_FD, IFLA_XDP_FLAGS }
+    xdp = (struct rtattr*) ((char*)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+    xdp->rta_type = IFLA_XDP | NLA_F_NESTED;
+    xdp->rta_len = RTA_LENGTH(0);
+
+    rta = (struct rtattr*) ((char*)xdp + RTA_ALIGN(xdp->rta_len));
+    rta->rta_type = IFLA_XDP_FD;
+    rta->rta_len = RTA_LENGTH(sizeof(progFd));
+    memcpy(RTA_DATA(rta), &progFd, sizeof(progFd));
+    xdp->rta_len = RTA_ALIGN(xdp->rta_len) + RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr*) ((char*)xdp + xdp->rta_len);
+    rta->rta_type = IFLA_XDP_FLAGS;
+    rta->rta_len = RTA_LENGTH(sizeof(flags));
+    memcpy(RTA_DATA(rta), &flags, sizeof(flags));
+    xdp->rta_len += RTA_ALIGN(rta->rta_len);
+
+    req.nlh.nlmsg_len = NLMSG_ALIGN(req.nlh.nlmsg_len)
+                            + RTA_ALIGN(xdp->rta_len);
+
+    if (send(fd, &req, req.nlh.nlmsg_len, 0) < 0)
+        goto _exit;
+
+    len = recv(fd, buf, sizeof(buf), 0);
+    if ((len > 0) && NLMSG_OK(nlm, (uint)len)
+            && (nlm->nlmsg_type == NLMSG_ERROR))
+    {
+        struct nlmsgerr *err = (struct nlmsgerr*) NLMSG_DATA(nlm);
+
+        errno = -err->error;
+        ret = (err->error == 0);
+    }
+
+_exit:
+    close(fd);
+    return ret;
+}
+
+/*
+ * --------------------------------------------------------- *
+ * Transmitter
+ * --------------------------------------------------------- *
+ */
+
+XdpPort::XdpTransmitter::XdpTransmitter(const char *device, Socket *socket)
+    : PortTransmitter(device)
+{
+    socket_ = socket;
+    queued_ = 0;
+    completed_ = 0;
+    pending_ = 0;
+}
+
+/*!
+  Same as PortTransmitter::sendQueueTransmit() but with the packets copied
+  to the UMEM frames of the TX ring - the kernel is kicked once for all
+  the packets due back to back (up to kMaxBatch), not once per packet
+
+  Packets bigger than a UMEM frame (jumbos) are sent with pcap instead,
+  each after the ones queued before it are flushed to keep the order
+*/
+int XdpPort::XdpTransmitter::sendQueueTransmit(pcap_send_queue *queue,
+        long &overHead, int sync, PacketVariation *variation)
+{
+    struct timespec ovrStart, ovrEnd;
+    struct timeval ts;
+    struct pcap_pkthdr *hdr = (struct pcap_pkthdr*) queue->buffer;
+    char *end = queue->buffer + queue->len;
+    Ring *ring = &socket_->tx_;
+
+    if (!socket_->isOpen())
+        return PortTransmitter::sendQueueTransmit(queue, overHead, sync,
+                variation);
+
+    ts = hdr->ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ovrStart);
+    while((char*) hdr < end)
+    {
+        uchar *pkt = (uchar*)hdr + sizeof(*hdr);
+        int pktLen = hdr->caplen;
+
+        if (sync)
+        {
+            long usec = (hdr->ts.tv_sec - ts.tv_sec) * 1000000 +
+                (hdr->ts.tv_usec - ts.tv_usec);
+
+            // Not due back to back - the packets so far go out now
+            if (usec > 0)
+                flush();
+
+            clock_gettime(CLOCK_MONOTONIC, &ovrEnd);
+
+            overHead -= udiffTimeStamp(&ovrStart, &ovrEnd);
+            Q_ASSERT(overHead <= 0);
+            usec += overHead;
+            if (usec > 0)
+            {
+                udelay(usec);
+                overHead = 0;
+            }
+            else
+                overHead = usec;
+
+            ts = hdr->ts;
+            clock_gettime(CLOCK_MONOTONIC, &ovrStart);
+        }
+
+        Q_ASSERT(pktLen > 0);
+
+        if (pktLen <= Socket::kFrameSize)
+        {
+            struct xdp_desc *desc;
+            quint32 index;
+            uchar *frame = nextFrame(&index);
+
+            if (!frame)
+                return -2;
+
+            memcpy(frame, pkt, pktLen);
+            if (variation)
+                variation->variation.apply(frame, pktLen,
+                        variation->frameIndex++);
+
+            desc = (struct xdp_desc*) ring->descs
+                        + (queued_ & (ring->size - 1));
+            desc->addr = quint64(index) * Socket::kFrameSize;
+            desc->len = pktLen;
+            desc->options = 0;
+            queued_++;
+
+            stats_->txPkts++;
+            stats_->txBytes += pktLen;
+
+            if (++pending_ == kMaxBatch)
+                flush();
+        }
+        else
+        {
+            pcap_t *p = pcapHandle();
+
+            flush();
+            if (variation)
+                variation->variation.apply(pkt, pktLen,
+                        variation->frameIndex++);
+            if (p && (pcap_sendpacket(p, pkt, pktLen) == 0))
+            {
+                stats_->txPkts++;
+                stats_->txBytes += pktLen;
+            }
+            else
+                qDebug("%s: %d byte packet not sent: %s", __FUNCTION__,
+                        pktLen, p ? pcap_geterr(p) : "no pcap handle");
+        }
+
+        // Step to the next packet in the buffer
+        hdr = (struct pcap_pkthdr*) (pkt + pktLen);
+
+        if (stop_)
+        {
+            flush();
+            return -2;
+        }
+    }
+
+    flush();
+
+    return 0;
+}
+
+/*!
+  Returns the next TX frame to be filled (its index in index), waiting
+  for the kernel to be done with it if required - returns NULL if
+  transmit is stopped while waiting
+
+  The frames are used round robin - the kernel is done with them (see
+  reclaim()) in the same order
+*/
+uchar* XdpPort::XdpTransmitter::nextFrame(quint32 *index)
+{
+    while ((queued_ - completed_) >= quint32(Socket::kTxFrames))
+    {
+        struct pollfd pfd;
+
+        flush();
+        reclaim();
+        if ((queued_ - completed_) < quint32(Socket::kTxFrames))
+            break;
+
+        pfd.fd = socket_->fd();
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, 1 /* ms */);
+
+        if (stop_)
+            return NULL;
+    }
+
+    *index = queued_ % Socket::kTxFrames;
+    return socket_->frame(quint64(*index) * Socket::kFrameSize);
+}
+
+/*!
+  Takes back the TX frames the kernel is done with from the completion
+  ring - their addresses are not looked at as they come back in order
+*/
+void XdpPort::XdpTransmitter::reclaim()
+{
+    Ring *ring = &socket_->completion_;
+    quint32 count = *ring->producer - *ring->consumer;
+
+    if (!count)
+        return;
+
+    completed_ += count;
+    __sync_synchronize();
+    *ring->consumer += count;
+}
+
+/*!
+  Hands over the packets queued so far to the kernel
+*/
+void XdpPort::XdpTransmitter::flush()
+{
+    Ring *ring = &socket_->tx_;
+
+    if (!pending_)
+        return;
+
+    pending_ = 0;
+
+    // The descriptors must be seen by the kernel before the producer
+    __sync_synchronize();
+    *ring->producer = queued_;
+
+    if (socket_->needsWakeup(ring)
+            && (sendto(socket_->fd(), NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+            && (errno != EAGAIN) && (errno != EBUSY) && (errno != ENOBUFS))
+        qDebug("%s: sendto failed: %s", __FUNCTION__, strerror(errno));
+}
+
+/*
+ * --------------------------------------------------------- *
+ * Capturer
+ * --------------------------------------------------------- *
+ */
+
+XdpPort::XdpCapturer::XdpCapturer(const char *device, Socket *socket,
+        AbstractPort::PortStats *stats)
+    : PortCapturer(device)
+{
+    socket_ = socket;
+    stats_ = stats;
+}
+
+/*!
+  Writes the packets received on the RX ring to the capture file and gives
+  their frames back to the kernel via the fill ring - the XDP program that
+  steers the packets to the socket is attached only for this long
+*/
+void XdpPort::XdpCapturer::run()
+{
+    Ring *rx = &socket_->rx_;
+    Ring *fill = &socket_->fill_;
+
+    if (!socket_->isOpen() || !socket_->attachProgram())
+    {
+        qWarning("%s: %s: capturing with pcap instead", __FUNCTION__,
+                device_.toAscii().constData());
+        PortCapturer::run();
+        return;
+    }
+
+    if (!openCaptureFile())
+        goto _detach;
+
+    handle_ = pcap_open_dead(DLT_EN10MB, 65535);
+    dumpHandle_ = pcap_dump_open(handle_,
+            capFile_.fileName().toAscii().constData());
+    if (!dumpHandle_)
+    {
+        qWarning("%s: unable to write capture file: %s", __FUNCTION__,
+                pcap_geterr(handle_));
+        pcap_close(handle_);
+        handle_ = NULL;
+        goto _detach;
+    }
+
+    state_ = kRunning;
+    while (!stop_)
+    {
+        struct pcap_pkthdr hdr;
+        quint32 consumer = *rx->consumer;
+        quint32 producer = *fill->producer;
+        quint32 count = *rx->producer - consumer;
+
+        if (!count)
+        {
+            struct pollfd pfd;
+
+            updateDrops();
+
+            pfd.fd = socket_->fd();
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, 100 /* ms */);
+            continue;
+        }
+
+        // The descriptors are read only after the producer
+        __sync_synchronize();
+
+        for (quint32 i = 0; i < count; i++)
+        {
+            struct xdp_desc *desc = (struct xdp_desc*) rx->descs
+                                        + ((consumer + i) & (rx->size - 1));
+
+            // No rx timestamp from the kernel - the packets of a batch are
+            // a few usecs apart at most, so it's the time they're seen at
+            gettimeofday(&hdr.ts, NULL);
+            hdr.caplen = hdr.len = desc->len;
+            pcap_dump((uchar*) dumpHandle_, &hdr, socket_->frame(desc->addr));
+
+            // There are as many fill ring entries as rx frames, so there's
+            // always room for the frame to go back
+            ((quint64*) fill->descs)[(producer + i) & (fill->size - 1)] =
+                    desc->addr & ~quint64(Socket::kFrameSize - 1);
+        }
+
+        __sync_synchronize();
+        *rx->consumer = consumer + count;
+        *fill->producer = producer + count;
+
+        if (socket_->needsWakeup(fill))
+            recvfrom(socket_->fd(), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+    updateDrops();
+
+    pcap_dump_close(dumpHandle_);
+    pcap_close(handle_);
+    dumpHandle_ = NULL;
+    handle_ = NULL;
+    stop_ = false;
+
+_detach:
+    socket_->detachProgram();
+    state_ = kFinished;
+}
+
+void XdpPort::XdpCapturer::updateDrops()
+{
+    struct xdp_statistics xs;
+    socklen_t len = sizeof(xs);
+
+    // rx_dropped - no rx frame (or RX ring entry) for the packet
+    if (getsockopt(socket_->fd(), SOL_XDP, XDP_STATISTICS, &xs, &len) == 0)
+        stats_->captureDrops = xs.rx_dropped;
+}
+
+#endif
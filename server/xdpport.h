@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2010 Srivats P.
+
+This file is part of "Ostinato"
+
+This is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef _SERVER_XDP_PORT_H
+#define _SERVER_XDP_PORT_H
+
+#include <QtGlobal>
+
+#ifdef HAVE_AF_XDP
+
+#include "linuxport.h"
+
+struct xdp_ring_offset;
+
+/*
+ * A Linux port that transmits and captures via an AF_XDP socket bound to
+ * queue 0 of the interface - the packets move between the NIC and the
+ * socket's UMEM (memory shared with the kernel) without a syscall or an
+ * sk_buff per packet; with zero-copy if the driver supports it, else in
+ * copy (generic/SKB) mode which works with any interface, veth included.
+ *
+ * The interface is still shared with the kernel - the XDP program that
+ * steers the rx packets to the socket is attached only while capturing.
+ * Link state and stats are the same as those of LinuxPort
+ *
+ * AF_XDP is opt-in (see setXdp()) - until then, and after, the port is
+ * just a LinuxPort. The socket and its UMEM are set up on the first
+ * transmit or capture with AF_XDP
+ */
+class XdpPort : public LinuxPort
+{
+public:
+    XdpPort(int id, const char *device);
+    ~XdpPort();
+
+    virtual bool setXdp(bool enable);
+
+    virtual void startTransmit();
+    virtual void startCapture();
+
+protected:
+    struct Ring
+    {
+        volatile quint32 *producer;
+        volatile quint32 *consumer;
+        volatile quint32 *flags;
+        void *descs;
+        quint32 size;       //!< entries - a power of 2
+        void *map;
+        size_t mapSize;
+    };
+
+    // The AF_XDP socket and its UMEM - the first kTxFrames frames of the
+    // UMEM are for transmit (TX/completion rings, owned by the
+    // transmitter), the rest for receive (fill/RX rings, owned by the
+    // capturer)
+    class Socket
+    {
+    public:
+        Socket(const char *device);
+        ~Socket();
+        bool open();
+        bool isOpen() { return fd_ >= 0; }
+        bool isZeroCopy() { return isZeroCopy_; }
+        int fd() { return fd_; }
+        uchar* frame(quint64 addr) { return umem_ + addr; }
+        bool needsWakeup(Ring *ring);
+
+        bool attachProgram();
+        void detachProgram();
+
+        static const int kFrameSize = 4096;
+        static const int kTxFrames = 2048;
+        static const int kRxFrames = 2048;
+
+        Ring tx_;
+        Ring completion_;
+        Ring rx_;
+        Ring fill_;
+
+    private:
+        bool mapRing(Ring *ring, quint32 size, quint64 pgoff,
+                const struct xdp_ring_offset *offsets, size_t descSize);
+        bool setXdpProgram(int progFd, quint32 flags);
+
+        QByteArray device_;
+        bool isOpenTried_;
+        int ifIndex_;
+        int fd_;
+        uchar *umem_;
+        bool isZeroCopy_;
+        int mapFd_;         //!< XSKMAP with the socket for rx queue 0
+        int progFd_;
+    };
+
+    // Falls back to pcap if the socket isn't open - and for packets too
+    // big for a UMEM frame
+    class XdpTransmitter: public PortTransmitter
+    {
+    public:
+        XdpTransmitter(const char *device, Socket *socket);
+    protected:
+        virtual int sendQueueTransmit(pcap_send_queue *queue, long &overHead,
+                    int sync, PacketVariation *variation = NULL);
+    private:
+        uchar* nextFrame(quint32 *index);
+        void reclaim();
+        void flush();
+
+        static const int kMaxBatch = 64;
+
+        Socket *socket_;
+        quint32 queued_;        //!< frames put on the TX ring so far
+        quint32 completed_;     //!< of which the kernel is done with
+        int pending_;           //!< queued, but the kernel not kicked yet
+    };
+
+    // Falls back to pcap capture if the socket isn't open or the XDP
+    // program can't be attached - if the interface has one already, for
+    // instance
+    class XdpCapturer: public PortCapturer
+    {
+    public:
+        XdpCapturer(const char *device, Socket *socket,
+                AbstractPort::PortStats *stats);
+        void run();
+    private:
+        void updateDrops();
+
+        Socket *socket_;
+        AbstractPort::PortStats *stats_;
+    };
+
+    bool openSocket();
+
+    Socket *socket_;        //!< NULL unless AF_XDP is enabled
+    QString xdpTxNote_;     //!< in the port notes - see startTransmit()
+};
+
+#endif
+
+#endif
@@ -1,14 +1,32 @@
 
+#include "abstractprotocol.h"
+#include "counterrng.h"
+#include "framecursor.h"
+#include "framevariation.h"
+#include "ip4.pb.h"
+#include "ipchecksum.h"
+#include "mac.pb.h"
 #include "ostprotolib.h"
 #include "pcapfileformat.h"
+#include "pcapreplayfile.h"
 #include "protocol.pb.h"
+#include "protocollistiterator.h"
 #include "protocolmanager.h"
 #include "settings.h"
+#include "streambase.h"
+#include "tcp.pb.h"
+#include "udp.pb.h"
 
 #include <QCoreApplication>
 #include <QFile>
+#include <QList>
 #include <QSettings>
 #include <QString>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QtEndian>
+
+#include <string.h>
 
 extern ProtocolManager *OstProtocolManager;
 
@@ -26,6 +44,15 @@ int usage(int /*argc*/, char* argv[])
     printf("%s <command>\n", argv[0]);
     printf("command -\n");
     printf("  importpcap\n");
+    printf("  cksum\n");
+    printf("  rng\n");
+    printf("  framevariation\n");
+    printf("  frametemplate\n");
+    printf("  framecursor\n");
+    printf("  flowset\n");
+    printf("  portvariation\n");
+    printf("  replayfile\n");
+    printf("  all - all of the above except importpcap\n");
 
     return 255;
 }
@@ -58,6 +85,941 @@ int testImportPcap(int argc, char* argv[])
     return 0;
 }
 
+static int failures;
+
+static void check(bool isOk, const char *test, const QString &what)
+{
+    if (isOk)
+        return;
+
+    printf("%s: FAIL - %s\n", test, qPrintable(what));
+    failures++;
+}
+
+static int result(const char *test)
+{
+    int exitCode = failures ? 1 : 0;
+
+    printf("%s: %s\n", test, failures ? "FAIL" : "PASS");
+    failures = 0;
+
+    return exitCode;
+}
+
+// 0x0000 and 0xFFFF are both zero in one's complement
+static bool isSameCksum(quint16 cksum1, quint16 cksum2)
+{
+    return (cksum1 == cksum2)
+        || (quint16(cksum1 + 1) <= 1 && quint16(cksum2 + 1) <= 1);
+}
+
+/*
+  Reference one's complement sum - 16-bit words in native byte order, a
+  trailing odd byte padded with a zero byte - to check ipChecksumSum()
+  (which may use a SIMD implementation) against
+*/
+static quint16 referenceSum(const uchar *buffer, uint length)
+{
+    quint32 sum = 0;
+
+    while (length >= 2)
+    {
+        quint16 w;
+
+        memcpy(&w, buffer, 2);
+        sum += w;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        buffer += 2;
+        length -= 2;
+    }
+
+    if (length)
+    {
+        quint16 w = 0;
+
+        *(uchar*)&w = *buffer;
+        sum += w;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return quint16(sum);
+}
+
+static void fillRandom(uchar *buffer, uint length, quint64 key)
+{
+    for (uint i = 0; i < length; i++)
+        buffer[i] = uchar(counterRng::random(key, i));
+}
+
+int testChecksum(int /*argc*/, char* /*argv*/[])
+{
+    const int kMaxLen = 9100;
+    const int kMaxAlign = 64;
+    QByteArray mem(kMaxLen + kMaxAlign * 2, 0);
+    uchar *base = (uchar*) mem.data();
+    int lengths[] = { 1499, 1500, 1514, 4095, 9000, kMaxLen };
+
+    base += kMaxAlign - (quintptr(base) % kMaxAlign);
+
+    // Odd and even lengths around the SIMD widths at all alignments
+    for (int align = 0; align < kMaxAlign; align++)
+    {
+        for (int len = 0; len <= 300; len++)
+        {
+            uchar *p = base + align;
+
+            fillRandom(p, len, align * 1000 + len);
+            check(ipChecksumSum(p, len) == referenceSum(p, len), "cksum",
+                QString("random data, align %1 len %2").arg(align).arg(len));
+
+            memset(p, 0xFF, len);
+            check(ipChecksumSum(p, len) == referenceSum(p, len), "cksum",
+                QString("all ones, align %1 len %2").arg(align).arg(len));
+        }
+    }
+
+    for (uint i = 0; i < sizeof(lengths)/sizeof(lengths[0]); i++)
+    {
+        for (int align = 0; align < 4; align++)
+        {
+            uchar *p = base + align;
+
+            fillRandom(p, lengths[i], lengths[i]);
+            check(ipChecksumSum(p, lengths[i])
+                        == referenceSum(p, lengths[i]), "cksum",
+                QString("align %1 len %2").arg(align).arg(lengths[i]));
+        }
+    }
+
+    // Incremental update must match a recompute
+    for (int i = 0; i < 1000; i++)
+    {
+        uchar *p = base;
+        quint16 cksum, oldValue, newValue;
+        quint32 oldValue32, newValue32;
+
+        fillRandom(p, 40, i);
+        memcpy(&oldValue, p + 6, 2);
+        memcpy(&oldValue32, p + 12, 4);
+        cksum = ~ipChecksumSum(p, 40);
+
+        newValue = quint16(counterRng::random(i, 1000));
+        newValue32 = quint32(counterRng::random(i, 1001));
+        memcpy(p + 6, &newValue, 2);
+        memcpy(p + 12, &newValue32, 4);
+        cksum = ipChecksumUpdate(cksum, oldValue, newValue);
+        cksum = ipChecksumUpdate32(cksum, oldValue32, newValue32);
+
+        check(isSameCksum(cksum, quint16(~ipChecksumSum(p, 40))), "cksum",
+                QString("incremental update %1").arg(i));
+    }
+
+    return result("cksum");
+}
+
+int testRng(int /*argc*/, char* /*argv*/[])
+{
+    // Published splitmix64 outputs for seed 0
+    const quint64 kExpected[] = {
+        Q_UINT64_C(0xE220A8397B1DCDAF),
+        Q_UINT64_C(0x6E789E6AA1B965F4),
+        Q_UINT64_C(0x06C45D188009454F)
+    };
+
+    for (int i = 0; i < 3; i++)
+        check(counterRng::random(0, i) == kExpected[i], "rng",
+                QString("splitmix64 output %1").arg(i));
+
+    // The n-th number depends only on the key and n, not on the order
+    // (or thread) in which the numbers are generated
+    for (quint64 key = 1; key < 100; key++)
+    {
+        quint64 forward[64];
+
+        for (int i = 0; i < 64; i++)
+            forward[i] = counterRng::random(counterRng::key(key, 42), i);
+        for (int i = 63; i >= 0; i--)
+            check(counterRng::random(counterRng::key(key, 42), i)
+                        == forward[i], "rng",
+                    QString("key %1 counter %2").arg(key).arg(i));
+
+        check(counterRng::key(key, 1) != counterRng::key(key, 2), "rng",
+                QString("derived keys of %1 are distinct").arg(key));
+    }
+
+    return result("rng");
+}
+
+/*
+  Value of a FrameVariation field for frameIndex as per the semantics
+  documented by FrameVariation - recomputed independently here
+*/
+static quint64 variationValue(quint64 frameIndex, FrameVariation::Mode mode,
+        quint64 base, quint64 count, quint64 step, quint64 divisor,
+        quint64 period, quint64 randomKey)
+{
+    quint64 index = (period ? frameIndex % period : frameIndex) / divisor;
+
+    if (mode == FrameVariation::kRandom)
+        index = counterRng::random(randomKey, index);
+    if (count)
+        index %= count;
+
+    return mode == FrameVariation::kDecrement ?
+            base - index * step : base + index * step;
+}
+
+static void writeField(uchar *p, int size, quint64 mask, quint64 value)
+{
+    quint64 old = 0;
+
+    for (int i = 0; i < size; i++)
+        old = (old << 8) | p[i];
+
+    value = (old & ~mask) | (value & mask);
+    for (int i = size - 1; i >= 0; i--)
+    {
+        p[i] = uchar(value);
+        value >>= 8;
+    }
+}
+
+static void writeCksum(uchar *frame, int cksumOffset, int regionOffset,
+        int regionEnd)
+{
+    quint16 cksum = 0;
+
+    memcpy(frame + cksumOffset, &cksum, 2);
+    cksum = ~ipChecksumSum(frame + regionOffset, regionEnd - regionOffset);
+    memcpy(frame + cksumOffset, &cksum, 2);
+}
+
+static quint16 cksumAt(const uchar *frame, int offset)
+{
+    quint16 cksum;
+
+    memcpy(&cksum, frame + offset, 2);
+    return cksum;
+}
+
+int testFrameVariation(int /*argc*/, char* /*argv*/[])
+{
+    // Checksum 1 covers [14, 34) like an IPv4 header, checksum 2 covers
+    // [27, 64) - an odd start so that fields are summed at both parities
+    const int kFrameLen = 64;
+    const int kCksum1 = 24, kRegion1 = 14, kRegionEnd1 = 34;
+    const int kCksum2 = 41, kRegion2 = 27, kRegionEnd2 = 64;
+    const quint64 kRandomKey = counterRng::key(1234, 5678);
+    const quint64 kAllOnes = ~Q_UINT64_C(0);
+    uchar original[kFrameLen];
+    uchar frame[kFrameLen];
+    uchar rebuilt[kFrameLen];
+    FrameVariation variation;
+    int f;
+
+    fillRandom(original, kFrameLen, 99);
+    writeCksum(original, kCksum1, kRegion1, kRegionEnd1);
+    writeCksum(original, kCksum2, kRegion2, kRegionEnd2);
+    memcpy(frame, original, kFrameLen);
+
+    f = variation.addField(28, 4, 0xFFFFFFFF, FrameVariation::kIncrement,
+            0x0A000001, 100, 1);
+    variation.addFieldCksum(f, kCksum1, kRegion1);
+    variation.addFieldCksum(f, kCksum2, kRegion2);
+    check(!variation.addFieldCksum(f, kCksum2, kRegion2), "framevariation",
+            "more than kMaxFieldCksums checksums accepted");
+
+    f = variation.addField(45, 3, 0x0FFFFF, FrameVariation::kRandom,
+            0, 0, 1, 7, 50, kRandomKey);
+    variation.addFieldCksum(f, kCksum2, kRegion2);
+
+    f = variation.addField(50, 2, 0xFFFF, FrameVariation::kDecrement,
+            1000, 10, 3, 100);
+    variation.addFieldCksum(f, kCksum2, kRegion2, true);
+
+    f = variation.addField(55, 8, kAllOnes, FrameVariation::kIncrement,
+            Q_UINT64_C(0xFFFFFFFFFFFFFFF0), 0, 5);
+    variation.addFieldCksum(f, kCksum2, kRegion2);
+
+    check(variation.addField(0, FrameVariation::kMaxFieldSize + 1, kAllOnes,
+                FrameVariation::kIncrement, 0, 0, 1) < 0, "framevariation",
+            "oversized field accepted");
+    check(variation.fieldCount() == 4, "framevariation", "field count");
+
+    // Apply in place over the previous frame - in sequence and then
+    // jumping around - and compare with the frame rebuilt from scratch
+    for (int i = 0; i < 2000; i++)
+    {
+        quint64 n = i < 1000 ? i : counterRng::random(7, i) % 100000;
+
+        variation.apply(frame, kFrameLen, n);
+
+        memcpy(rebuilt, original, kFrameLen);
+        writeField(rebuilt + 28, 4, 0xFFFFFFFF, variationValue(n,
+                    FrameVariation::kIncrement, 0x0A000001, 100, 1, 1, 0, 0));
+        writeField(rebuilt + 45, 3, 0x0FFFFF, variationValue(n,
+                    FrameVariation::kRandom, 0, 0, 1, 7, 50, kRandomKey));
+        writeField(rebuilt + 50, 2, 0xFFFF, variationValue(n,
+                    FrameVariation::kDecrement, 1000, 10, 3, 100, 0, 0));
+        writeField(rebuilt + 55, 8, kAllOnes, variationValue(n,
+                    FrameVariation::kIncrement,
+                    Q_UINT64_C(0xFFFFFFFFFFFFFFF0), 0, 5, 1, 0, 0));
+        writeCksum(rebuilt, kCksum1, kRegion1, kRegionEnd1);
+        writeCksum(rebuilt, kCksum2, kRegion2, kRegionEnd2);
+
+        check(isSameCksum(cksumAt(frame, kCksum1), cksumAt(rebuilt, kCksum1))
+                && isSameCksum(cksumAt(frame, kCksum2),
+                    cksumAt(rebuilt, kCksum2)), "framevariation",
+                QString("checksum mismatch at frame %1").arg(n));
+
+        memcpy(rebuilt + kCksum1, frame + kCksum1, 2);
+        memcpy(rebuilt + kCksum2, frame + kCksum2, 2);
+        check(memcmp(frame, rebuilt, kFrameLen) == 0, "framevariation",
+                QString("content mismatch at frame %1").arg(n));
+    }
+
+    // Fields beyond the frame length are left alone
+    memcpy(frame, original, kFrameLen);
+    variation.apply(frame, 48, 3);
+    check(memcmp(frame + 50, original + 50, kFrameLen - 50) == 0,
+            "framevariation", "field beyond frame length modified");
+
+    return result("framevariation");
+}
+
+static void addProtocol(OstProto::Stream &stream, int protocolNumber)
+{
+    stream.add_protocol()->mutable_protocol_id()->set_id(protocolNumber);
+}
+
+/*
+  A mac:eth2:ip4:udp:payload stream with varying mac, ip and port fields
+*/
+static void makeStream(OstProto::Stream &stream, quint32 randomSeed)
+{
+    OstProto::Protocol *proto;
+    OstProto::Mac *mac;
+    OstProto::Ip4 *ip4;
+    OstProto::Udp *udp;
+
+    stream.mutable_stream_id()->set_id(1);
+    stream.mutable_core()->set_frame_len(128);
+    stream.mutable_core()->set_random_seed(randomSeed);
+
+    addProtocol(stream, OstProto::Protocol::kMacFieldNumber);
+    proto = stream.mutable_protocol(stream.protocol_size() - 1);
+    mac = proto->MutableExtension(OstProto::mac);
+    mac->set_dst_mac(Q_UINT64_C(0x001122334455));
+    mac->set_dst_mac_mode(OstProto::Mac::e_mm_inc);
+    mac->set_dst_mac_count(20);
+    mac->set_src_mac(Q_UINT64_C(0x00AABBCCDDEE));
+
+    addProtocol(stream, OstProto::Protocol::kEth2FieldNumber);
+
+    addProtocol(stream, OstProto::Protocol::kIp4FieldNumber);
+    proto = stream.mutable_protocol(stream.protocol_size() - 1);
+    ip4 = proto->MutableExtension(OstProto::ip4);
+    ip4->set_src_ip(0x0A000001);
+    ip4->set_src_ip_mode(OstProto::Ip4::e_im_inc_host);
+    ip4->set_src_ip_count(50);
+    ip4->set_dst_ip(0xC0A80101);
+    ip4->set_dst_ip_mode(OstProto::Ip4::e_im_random_host);
+
+    addProtocol(stream, OstProto::Protocol::kUdpFieldNumber);
+    proto = stream.mutable_protocol(stream.protocol_size() - 1);
+    udp = proto->MutableExtension(OstProto::udp);
+    udp->set_is_override_src_port(true);
+    udp->set_src_port(5000);
+    udp->set_src_port_mode(OstProto::Udp::e_pm_inc);
+    udp->set_src_port_count(30);
+
+    addProtocol(stream, OstProto::Protocol::kPayloadFieldNumber);
+}
+
+/*
+  Builds the frame at frameIndex by concatenating the protocol values -
+  independent of the stream's frame template
+*/
+static QByteArray referenceFrame(const StreamBase &stream, int frameIndex)
+{
+    ProtocolListIterator *iter = stream.createProtocolListIterator();
+    QByteArray frame;
+
+    while (iter->hasNext())
+        frame.append(iter->next()->protocolFrameValue(frameIndex));
+    delete iter;
+
+    return frame;
+}
+
+int testFrameTemplate(int /*argc*/, char* /*argv*/[])
+{
+    const int kFrames = 200;
+    OstProto::Stream config;
+    StreamBase stream;
+    QList<QByteArray> reference;
+    QByteArray buf(2048, 0);
+    QVector<int> lens(kFrames);
+
+    makeStream(config, 1234);
+    stream.protoDataCopyFrom(config);
+
+    // References first - creating the protocol list iterator drops the
+    // template
+    for (int i = 0; i < kFrames; i++)
+        reference.append(referenceFrame(stream, i));
+
+    for (int i = 0; i < kFrames; i++)
+    {
+        int len = stream.frameValue((uchar*) buf.data(), buf.size(), i);
+
+        check(QByteArray(buf.constData(), len) == reference.at(i),
+                "frametemplate", QString("frameValue() frame %1").arg(i));
+    }
+
+    // Out of order
+    for (int i = kFrames - 1; i >= 0; i -= 7)
+    {
+        int len = stream.frameValue((uchar*) buf.data(), buf.size(), i);
+
+        check(QByteArray(buf.constData(), len) == reference.at(i),
+                "frametemplate",
+                QString("frameValue() reverse frame %1").arg(i));
+    }
+
+
+    // Same seed => same frames; a modified stream is regenerated
+    {
+        StreamBase other;
+
+        other.protoDataCopyFrom(config);
+        for (int i = kFrames - 1; i >= 0; i--)
+        {
+            int len = other.frameValue((uchar*) buf.data(), buf.size(), i);
+
+            check(QByteArray(buf.constData(), len) == reference.at(i),
+                    "frametemplate",
+                    QString("same seed, other stream frame %1").arg(i));
+        }
+
+        other.setFrameLen(200);
+        check(other.frameValue((uchar*) buf.data(), buf.size(), 0)
+                    == 200 - kFcsSize, "frametemplate",
+                "template not recompiled on frame length change");
+        check(QByteArray(buf.constData(), 200 - kFcsSize)
+                    == referenceFrame(other, 0), "frametemplate",
+                "frame after frame length change");
+
+        // The random fields are keyed by the stream id and random seed
+        other.setFrameLen(128);
+        other.setRandomSeed(4321);
+        other.frameValue((uchar*) buf.data(), buf.size(), 5);
+        check(QByteArray(buf.constData(), 128 - kFcsSize)
+                    == referenceFrame(other, 5), "frametemplate",
+                "frame after random seed change");
+        check(QByteArray(buf.constData(), 128 - kFcsSize) != reference.at(5),
+                "frametemplate", "template not recompiled on seed change");
+
+        other.setRandomSeed(1234);
+        other.setId(2);
+        other.frameValue((uchar*) buf.data(), buf.size(), 5);
+        check(QByteArray(buf.constData(), 128 - kFcsSize)
+                    == referenceFrame(other, 5), "frametemplate",
+                "frame after stream id change");
+        check(QByteArray(buf.constData(), 128 - kFcsSize) != reference.at(5),
+                "frametemplate", "template not recompiled on id change");
+    }
+
+    return result("frametemplate");
+}
+
+int testFrameCursor(int /*argc*/, char* /*argv*/[])
+{
+    const int kFrames = 200;
+    OstProto::Stream config;
+    StreamBase stream;
+    QList<QByteArray> reference;
+    QByteArray buf(2048, 0);
+    QVector<int> lens(kFrames);
+
+    makeStream(config, 1234);
+    stream.protoDataCopyFrom(config);
+
+    for (int i = 0; i < kFrames; i++)
+        reference.append(referenceFrame(stream, i));
+
+    // Cursor - patches only the varying bytes of successive frames
+    {
+        FrameCursor cursor(&stream);
+
+        for (int i = 0; i < kFrames; i++)
+        {
+            int len = cursor.next();
+
+            check(QByteArray((const char*) cursor.frame(), len)
+                        == reference.at(i), "framecursor",
+                    QString("cursor frame %1").arg(i));
+        }
+    }
+
+    // Cursor with read ahead in batches
+    {
+        FrameCursor cursor(&stream, 0);
+        int i = 0;
+
+        cursor.setReadAhead(64);
+        while (i < kFrames)
+        {
+            int n = cursor.nextBatch((uchar*) buf.data(), buf.size(),
+                    kFrames - i, lens.data());
+            int offset = 0;
+
+            check(n > 0, "framecursor", "empty batch");
+            if (n <= 0)
+                break;
+
+            for (int j = 0; j < n; j++)
+            {
+                check(QByteArray(buf.constData() + offset, lens.at(j))
+                            == reference.at(i + j), "framecursor",
+                        QString("batch frame %1").arg(i + j));
+                offset += lens.at(j);
+            }
+            i += n;
+            check(cursor.frameIndex() == i, "framecursor",
+                    QString("batch cursor at %1 instead of %2")
+                        .arg(cursor.frameIndex()).arg(i));
+        }
+    }
+
+    return result("framecursor");
+}
+
+/*
+  Validates the IPv4 header and UDP checksums of a mac:eth2:ip4:udp frame
+  by recomputing them from scratch
+*/
+static bool isUdpFrameCksumValid(const uchar *frame, int len)
+{
+    const int kIpOfs = 14, kUdpOfs = 34;
+    QByteArray pseudo;
+    uchar hdr[4];
+    int udpLen = len - kUdpOfs;
+
+    if (ipChecksumSum(frame + kIpOfs, 20) != 0xFFFF)
+        return false;
+
+    // Pseudo header: src ip, dst ip, 0, protocol, udp length
+    pseudo.append((const char*) frame + kIpOfs + 12, 8);
+    hdr[0] = 0;
+    hdr[1] = 17;
+    hdr[2] = uchar(udpLen >> 8);
+    hdr[3] = uchar(udpLen);
+    pseudo.append((const char*) hdr, 4);
+    pseudo.append((const char*) frame + kUdpOfs, udpLen);
+
+    return ipChecksumSum((const uchar*) pseudo.constData(), pseudo.size())
+            == 0xFFFF;
+}
+
+/*
+  Checks the flow set fields (src ip 0x0B000001 x 100, src port 1000 x 37)
+  and the checksums of the frames of stream
+*/
+static void checkFlowFrames(const StreamBase &stream, int frames,
+        const QString &what)
+{
+    QByteArray buf(2048, 0);
+
+    for (int i = 0; i < frames; i++)
+    {
+        const uchar *p = (const uchar*) buf.constData();
+        int len = stream.frameValue((uchar*) buf.data(), buf.size(), i);
+        quint32 srcIp = qFromBigEndian<quint32>(p + 26);
+        quint16 srcPort = qFromBigEndian<quint16>(p + 34);
+
+        check(len == stream.frameLen(i) - kFcsSize, "flowset",
+                QString("%1: frame %2 length %3").arg(what).arg(i).arg(len));
+        check(srcIp == quint32(0x0B000001 + (i % 100)), "flowset",
+                QString("%1: frame %2 src ip %3").arg(what).arg(i)
+                    .arg(srcIp, 0, 16));
+        check(srcPort == 1000 + (i % 100) % 37, "flowset",
+                QString("%1: frame %2 src port %3").arg(what).arg(i)
+                    .arg(srcPort));
+        check(isUdpFrameCksumValid(p, len), "flowset",
+                QString("%1: frame %2 checksum").arg(what).arg(i));
+    }
+}
+
+int testFlowSet(int /*argc*/, char* /*argv*/[])
+{
+    const int kFrames = 300;
+    OstProto::Stream config;
+    OstProto::StreamFlowSet *flowSet;
+    QString preflight;
+
+    makeStream(config, 1234);
+    flowSet = config.mutable_flow_set();
+    flowSet->mutable_src_ip()->set_start(0x0B000001);
+    flowSet->mutable_src_ip()->set_count(100);
+    flowSet->mutable_src_port()->set_start(1000);
+    flowSet->mutable_src_port()->set_count(37);
+
+    {
+        StreamBase stream;
+
+        stream.protoDataCopyFrom(config);
+        checkFlowFrames(stream, kFrames, "fixed length");
+    }
+
+    // The payload follows the frame length - the headers carrying the
+    // flow set fields are still at the same offsets
+    config.mutable_core()->set_len_mode(OstProto::StreamCore::e_fl_inc);
+    config.mutable_core()->set_frame_len_min(100);
+    config.mutable_core()->set_frame_len_max(1000);
+    {
+        StreamBase stream;
+
+        stream.protoDataCopyFrom(config);
+        checkFlowFrames(stream, kFrames, "variable length");
+        stream.preflightCheck(preflight);
+        check(!preflight.contains("Flow set"), "flowset",
+                "variable length: " + preflight);
+    }
+
+    return result("flowset");
+}
+
+/*
+  A mac:eth2:ip4:<tcp|udp>:payload stream with only the src and dst ports
+  of the L4 protocol varying - as per srcMode and dstMode (Tcp and Udp
+  share the PortMode values)
+*/
+static void makePortStream(OstProto::Stream &stream, bool isUdp,
+        int srcMode, int dstMode, uint count)
+{
+    OstProto::Protocol *proto;
+    OstProto::Ip4 *ip4;
+
+    stream.mutable_stream_id()->set_id(1);
+    stream.mutable_core()->set_frame_len(128);
+    stream.mutable_core()->set_random_seed(1234);
+
+    addProtocol(stream, OstProto::Protocol::kMacFieldNumber);
+    proto = stream.mutable_protocol(stream.protocol_size() - 1);
+    proto->MutableExtension(OstProto::mac)->set_dst_mac(
+            Q_UINT64_C(0x001122334455));
+    proto->MutableExtension(OstProto::mac)->set_src_mac(
+            Q_UINT64_C(0x00AABBCCDDEE));
+
+    addProtocol(stream, OstProto::Protocol::kEth2FieldNumber);
+
+    addProtocol(stream, OstProto::Protocol::kIp4FieldNumber);
+    proto = stream.mutable_protocol(stream.protocol_size() - 1);
+    ip4 = proto->MutableExtension(OstProto::ip4);
+    ip4->set_src_ip(0x0A000001);
+    ip4->set_dst_ip(0xC0A80101);
+
+    if (isUdp)
+    {
+        OstProto::Udp *udp;
+
+        addProtocol(stream, OstProto::Protocol::kUdpFieldNumber);
+        proto = stream.mutable_protocol(stream.protocol_size() - 1);
+        udp = proto->MutableExtension(OstProto::udp);
+        udp->set_is_override_src_port(true);
+        udp->set_src_port(5000);
+        udp->set_src_port_mode(OstProto::Udp::PortMode(srcMode));
+        udp->set_src_port_count(count);
+        udp->set_is_override_dst_port(true);
+        udp->set_dst_port(6000);
+        udp->set_dst_port_mode(OstProto::Udp::PortMode(dstMode));
+        udp->set_dst_port_count(count);
+        udp->set_dst_port_step(3);
+    }
+    else
+    {
+        OstProto::Tcp *tcp;
+
+        addProtocol(stream, OstProto::Protocol::kTcpFieldNumber);
+        proto = stream.mutable_protocol(stream.protocol_size() - 1);
+        tcp = proto->MutableExtension(OstProto::tcp);
+        tcp->set_is_override_src_port(true);
+        tcp->set_src_port(5000);
+        tcp->set_src_port_mode(OstProto::Tcp::PortMode(srcMode));
+        tcp->set_src_port_count(count);
+        tcp->set_is_override_dst_port(true);
+        tcp->set_dst_port(6000);
+        tcp->set_dst_port_mode(OstProto::Tcp::PortMode(dstMode));
+        tcp->set_dst_port_count(count);
+        tcp->set_dst_port_step(3);
+    }
+
+    addProtocol(stream, OstProto::Protocol::kPayloadFieldNumber);
+}
+
+/*
+  Checks the frames of a port varying stream patched by FrameCursor
+  against the frames built from the protocol values; returns the count
+  of frames whose L4 checksum is 0xFFFF
+*/
+static int checkPortFrames(const OstProto::Stream &config, int frames,
+        const QString &what)
+{
+    const bool isUdp = config.protocol(3).protocol_id().id()
+            == OstProto::Protocol::kUdpFieldNumber;
+    const int kCksumOfs = 34 + (isUdp ? 6 : 16);
+    StreamBase stream;
+    QList<QByteArray> reference;
+    int allOnes = 0;
+
+    stream.protoDataCopyFrom(config);
+
+    // References first - creating the protocol list iterator drops the
+    // template
+    for (int i = 0; i < frames; i++)
+        reference.append(referenceFrame(stream, i));
+
+    FrameCursor cursor(&stream);
+
+    for (int i = 0; i < frames; i++)
+    {
+        int len = cursor.next();
+        QByteArray frame((const char*) cursor.frame(), len);
+        quint16 cksum;
+
+        if (frame != reference.at(i))
+        {
+            check(false, "portvariation",
+                    QString("%1: frame %2").arg(what).arg(i));
+            break;
+        }
+
+        cksum = qFromBigEndian<quint16>(
+                (const uchar*) frame.constData() + kCksumOfs);
+
+        check(!isUdp || cksum, "portvariation",
+                QString("%1: frame %2 checksum 0").arg(what).arg(i));
+        if (cksum == 0xFFFF)
+            allOnes++;
+    }
+
+    return allOnes;
+}
+
+int testPortVariation(int /*argc*/, char* /*argv*/[])
+{
+    int modes[] = { OstProto::Udp::e_pm_inc, OstProto::Udp::e_pm_dec,
+                    OstProto::Udp::e_pm_random };
+    const char *modeNames[] = { "inc", "dec", "random" };
+
+    for (int isUdp = 0; isUdp < 2; isUdp++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                OstProto::Stream config;
+
+                makePortStream(config, isUdp, modes[i], modes[j], 100);
+                checkPortFrames(config, 500, QString("%1 src %2 dst %3")
+                        .arg(isUdp ? "udp" : "tcp")
+                        .arg(modeNames[i]).arg(modeNames[j]));
+            }
+        }
+    }
+
+    // Sweeping a port through all its values sweeps the checksum through
+    // all of its values too - the one that comes out as 0 must be sent as
+    // 0xFFFF for UDP (0 is "no checksum") both when varied and when
+    // regenerated
+    {
+        OstProto::Stream config;
+        int allOnes;
+
+        makePortStream(config, true, OstProto::Udp::e_pm_inc,
+                OstProto::Udp::e_pm_fixed, 65536);
+        allOnes = checkPortFrames(config, 65536, "udp src sweep");
+        check(allOnes > 0, "portvariation",
+                "udp src sweep: no frame with checksum 0xFFFF");
+    }
+
+    return result("portvariation");
+}
+
+static void append32(QByteArray &data, quint32 value, bool isSwapped)
+{
+    if (isSwapped)
+        value = qbswap(value);
+    data.append((const char*) &value, sizeof(value));
+}
+
+static void appendFileHeader(QByteArray &data, quint32 magic,
+        quint32 linkType, bool isSwapped)
+{
+    append32(data, magic, isSwapped);
+    append32(data, 0x00040002, isSwapped); // version 2.4
+    append32(data, 0, isSwapped);
+    append32(data, 0, isSwapped);
+    append32(data, 65535, isSwapped);
+    append32(data, linkType, isSwapped);
+}
+
+static void appendRecord(QByteArray &data, quint32 sec, quint32 subSec,
+        quint32 length, bool isSwapped, quint32 dataLength = quint32(-1))
+{
+    append32(data, sec, isSwapped);
+    append32(data, subSec, isSwapped);
+    append32(data, length, isSwapped);
+    append32(data, length, isSwapped);
+    data.append(QByteArray(qMin(length, dataLength), char(length)));
+}
+
+static bool openReplay(PcapReplayFile &replay, QTemporaryFile &file,
+        const QByteArray &data, QString &error, uint loopCount = 1)
+{
+    OstProto::StreamReplay config;
+
+    file.open();
+    file.resize(0);
+    file.write(data);
+    file.flush();
+
+    config.set_file_name(file.fileName().toStdString());
+    config.set_loop_count(loopCount);
+
+    error.clear();
+    return replay.open(config, error);
+}
+
+int testReplayFile(int /*argc*/, char* /*argv*/[])
+{
+    const quint32 kMagic = 0xa1b2c3d4;
+    const quint32 kMagicNsec = 0xa1b23c4d;
+    PcapReplayFile replay;
+    PcapReplayFile::Packet packet;
+    QByteArray data;
+    QString error;
+    bool isOk;
+
+    // Valid file - zero length records are skipped
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagic, 1, false);
+        appendRecord(data, 1, 0, 60, false);
+        appendRecord(data, 1, 200000, 0, false);
+        appendRecord(data, 1, 500000, 1514, false);
+        appendRecord(data, 3, 0, 100, false);
+
+        isOk = openReplay(replay, file, data, error, 2);
+        check(isOk, "replayfile", "valid file: " + error);
+        check(replay.packetCount() == 6, "replayfile",
+                QString("valid file: %1 packets")
+                    .arg(replay.packetCount()));
+        check(replay.byteCount() == 2 * (60 + 1514 + 100), "replayfile",
+                QString("valid file: %1 bytes").arg(replay.byteCount()));
+        check(replay.nsecDuration() == Q_UINT64_C(4000000000), "replayfile",
+                QString("valid file: duration %1")
+                    .arg(replay.nsecDuration()));
+
+        quint64 gaps[] = { 0, 500000000, 1500000000, 0, 500000000,
+                            1500000000 };
+        int lengths[] = { 60, 1514, 100, 60, 1514, 100 };
+        for (int i = 0; i < 6; i++)
+        {
+            isOk = replay.nextPacket(packet);
+            check(isOk && (packet.length == lengths[i])
+                        && (packet.nsecGap == gaps[i])
+                        && (packet.data[0] == uchar(lengths[i])),
+                    "replayfile", QString("valid file: packet %1").arg(i));
+        }
+        check(!replay.nextPacket(packet), "replayfile",
+                "valid file: packet after the last loop");
+        replay.close();
+    }
+
+    // Truncated last record is ignored
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagic, 1, false);
+        appendRecord(data, 1, 0, 60, false);
+        appendRecord(data, 2, 0, 100, false, 10);
+
+        isOk = openReplay(replay, file, data, error);
+        check(isOk && (replay.packetCount() == 1), "replayfile",
+                "truncated record: " + error);
+        replay.close();
+    }
+
+    // Records from an oversized one onwards are ignored
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagic, 1, false);
+        appendRecord(data, 1, 0, 60, false);
+        appendRecord(data, 2, 0, 300000, false);
+        appendRecord(data, 3, 0, 60, false);
+
+        isOk = openReplay(replay, file, data, error);
+        check(isOk && (replay.packetCount() == 1), "replayfile",
+                "oversized record: " + error);
+        replay.close();
+    }
+
+    // Swapped byte order, nanosecond resolution
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagicNsec, 1, true);
+        appendRecord(data, 1, 0, 60, true);
+        appendRecord(data, 1, 250, 60, true);
+
+        isOk = openReplay(replay, file, data, error);
+        check(isOk && (replay.packetCount() == 2), "replayfile",
+                "swapped nsec file: " + error);
+        isOk = replay.nextPacket(packet) && replay.nextPacket(packet);
+        check(isOk && (packet.nsecGap == 250), "replayfile",
+                "swapped nsec file: gap");
+        replay.close();
+    }
+
+    // Unusable files
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, 0x12345678, 1, false);
+        appendRecord(data, 1, 0, 60, false);
+        check(!openReplay(replay, file, data, error) && !error.isEmpty(),
+                "replayfile", "bad magic accepted");
+    }
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagic, 105, false);
+        appendRecord(data, 1, 0, 60, false);
+        check(!openReplay(replay, file, data, error) && !error.isEmpty(),
+                "replayfile", "non-ethernet link type accepted");
+    }
+    {
+        QTemporaryFile file;
+
+        data.clear();
+        appendFileHeader(data, kMagic, 1, false);
+        check(!openReplay(replay, file, data, error) && !error.isEmpty(),
+                "replayfile", "file without packets accepted");
+    }
+
+    return result("replayfile");
+}
+
 int main(int argc, char* argv[])
 {
     QCoreApplication app(argc, argv);
@@ -100,6 +1062,33 @@ int main(int argc, char* argv[])
         exitCode = usage(argc, argv);
     else if (strcmp(argv[1],"importpcap") == 0)
         exitCode = testImportPcap(argc, argv);
+    else if (strcmp(argv[1],"cksum") == 0)
+        exitCode = testChecksum(argc, argv);
+    else if (strcmp(argv[1],"rng") == 0)
+        exitCode = testRng(argc, argv);
+    else if (strcmp(argv[1],"framevariation") == 0)
+        exitCode = testFrameVariation(argc, argv);
+    else if (strcmp(argv[1],"frametemplate") == 0)
+        exitCode = testFrameTemplate(argc, argv);
+    else if (strcmp(argv[1],"framecursor") == 0)
+        exitCode = testFrameCursor(argc, argv);
+    else if (strcmp(argv[1],"flowset") == 0)
+        exitCode = testFlowSet(argc, argv);
+    else if (strcmp(argv[1],"portvariation") == 0)
+        exitCode = testPortVariation(argc, argv);
+    else if (strcmp(argv[1],"replayfile") == 0)
+        exitCode = testReplayFile(argc, argv);
+    else if (strcmp(argv[1],"all") == 0)
+    {
+        exitCode |= testChecksum(argc, argv);
+        exitCode |= testRng(argc, argv);
+        exitCode |= testFrameVariation(argc, argv);
+        exitCode |= testFrameTemplate(argc, argv);
+        exitCode |= testFrameCursor(argc, argv);
+        exitCode |= testFlowSet(argc, argv);
+        exitCode |= testPortVariation(argc, argv);
+        exitCode |= testReplayFile(argc, argv);
+    }
     else
         exitCode = usage(argc, argv);
 
@@ -536,6 +536,44 @@ try:
         drone.stopTransmit(tx_port)
         suite.test_end(passed)
 
+    # ----------------------------------------------------------------- #
+    # TESTCASE: Verify a jumbo (9000 byte) stream is transmitted - such
+    #           frames are too big for a TX ring frame
+    # ----------------------------------------------------------------- #
+    passed = False
+    suite.test_begin('jumboFrameStreamIsTransmitted')
+    try:
+        stream_cfg.stream[0].core.frame_len = 9000
+        log.info('configuring tx_stream %d' % stream_id.stream_id[0].id)
+        drone.modifyStream(stream_cfg)
+
+        drone.startCapture(rx_port)
+        drone.startTransmit(tx_port)
+        log.info('waiting for transmit to finish ...')
+        time.sleep(12)
+        drone.stopTransmit(tx_port)
+        drone.stopCapture(rx_port)
+
+        buff = drone.getCaptureBuffer(rx_port.port_id[0])
+        drone.saveCaptureBuffer(buff, 'capture.pcap')
+        log.info('dumping Rx capture buffer')
+        cap_pkts = subprocess.check_output([tshark, '-r', 'capture.pcap',
+            '-T', 'fields', '-e', 'frame.len'])
+        print(cap_pkts)
+        # frame_len includes the 4 byte FCS which is not captured
+        jumbo_count = cap_pkts.split().count('8996')
+        log.info('%d jumbo frames captured' % jumbo_count)
+        if jumbo_count >= stream_cfg.stream[0].control.num_packets:
+            passed = True
+        os.remove('capture.pcap')
+    except RpcError as e:
+            raise
+    finally:
+        drone.stopTransmit(tx_port)
+        stream_cfg.stream[0].core.frame_len = 64
+        drone.modifyStream(stream_cfg)
+        suite.test_end(passed)
+
     suite.complete()
 
     # delete streams
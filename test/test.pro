@@ -1,7 +1,7 @@
 TEMPLATE = app
 CONFIG += qt console
 QT += xml network script
-INCLUDEPATH += "../rpc/" "../common/" "../client"
+INCLUDEPATH += "../rpc/" "../common/" "../client" "../server"
 win32 {
     LIBS += -lwpcap -lpacket
     CONFIG(debug, debug|release) {
@@ -32,7 +32,8 @@ LIBS += -lprotobuf
 LIBS += -L"../extra/qhexedit2/$(OBJECTS_DIR)/" -lqhexedit2
 
 HEADERS += 
-SOURCES += main.cpp
+SOURCES += main.cpp \
+    ../server/pcapreplayfile.cpp
 
 QMAKE_DISTCLEAN += object_script.*
 